@@ -0,0 +1,102 @@
+#include "admin_server.hpp"
+
+#include <iostream>
+
+// a scraper that stops talking is dropped after this long
+static const std::chrono::seconds admin_timeout(30);
+
+AdminServer::AdminServer(net::io_context & ioc, tcp::endpoint endpoint) : acceptor_(ioc) {
+  beast::error_code ec;
+  acceptor_.open(endpoint.protocol(), ec);
+  if (ec) {
+    fail(ec, "admin open");
+    return;
+  }
+  acceptor_.set_option(net::socket_base::reuse_address(true), ec);
+  if (ec) {
+    fail(ec, "admin set_option");
+    return;
+  }
+  acceptor_.bind(endpoint, ec);
+  if (ec) {
+    fail(ec, "admin bind");
+    return;
+  }
+  acceptor_.listen(net::socket_base::max_listen_connections, ec);
+  if (ec) {
+    fail(ec, "admin listen");
+    return;
+  }
+}
+
+void AdminServer::fail(beast::error_code ec, char const * what) {
+  std::cerr << what << ": " << ec.message() << "\n";
+}
+
+const AdminServer::RenderHandler * AdminServer::find(beast::string_view target) const {
+  auto it = routes_.find(std::string(target));
+  return it == routes_.end() ? nullptr : &it->second;
+}
+
+void AdminServer::do_accept() {
+  if (!acceptor_.is_open()) {
+    return;
+  }
+  acceptor_.async_accept(
+      beast::bind_front_handler(&AdminServer::on_accept, shared_from_this()));
+}
+
+void AdminServer::on_accept(beast::error_code ec, tcp::socket socket) {
+  if (ec) {
+    fail(ec, "admin accept");
+    return;
+  }
+  std::make_shared<AdminSession>(std::move(socket), shared_from_this())->run();
+  do_accept();
+}
+
+void AdminSession::do_read() {
+  req_ = {};
+  stream_.expires_after(admin_timeout);
+  http::async_read(stream_,
+                   buffer_,
+                   req_,
+                   beast::bind_front_handler(&AdminSession::on_read, shared_from_this()));
+}
+
+void AdminSession::on_read(beast::error_code ec, std::size_t bytes_transferred) {
+  boost::ignore_unused(bytes_transferred);
+  if (ec) {
+    // the scraper closed the connection or went quiet
+    stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+    return;
+  }
+  res_ = {};
+  res_.version(req_.version());
+  res_.keep_alive(req_.keep_alive());
+  const AdminServer::RenderHandler * render =
+      req_.method() == http::verb::get ? server_->find(req_.target()) : nullptr;
+  if (render) {
+    res_.result(http::status::ok);
+    res_.set(http::field::content_type, "text/plain; version=0.0.4");
+    (*render)(res_.body());
+  }
+  else {
+    res_.result(http::status::not_found);
+    res_.set(http::field::content_type, "text/plain");
+    res_.body() = "Not Found\n";
+  }
+  res_.prepare_payload();
+  http::async_write(stream_,
+                    res_,
+                    beast::bind_front_handler(&AdminSession::on_write, shared_from_this()));
+}
+
+void AdminSession::on_write(beast::error_code ec, std::size_t bytes_transferred) {
+  boost::ignore_unused(bytes_transferred);
+  if (ec || !res_.keep_alive()) {
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+    return;
+  }
+  do_read();
+}
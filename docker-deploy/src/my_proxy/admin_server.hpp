@@ -0,0 +1,79 @@
+#ifndef ADMIN_SERVER
+#define ADMIN_SERVER
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+namespace net = boost::asio;     // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * the admin port: a GET of a registered target (/metrics, /latency) answers
+ * with the text its handler renders, anything else is a 404.
+ * it runs on an io_context of its own, so a scrape never waits behind
+ * proxy traffic and proxy traffic never waits behind a scrape.
+*/
+class AdminServer : public std::enable_shared_from_this<AdminServer> {
+ public:
+  // appends the response body to the string
+  typedef std::function<void(std::string &)> RenderHandler;
+
+ private:
+  tcp::acceptor acceptor_;
+  // filled before run(), only read afterwards
+  std::map<std::string, RenderHandler> routes_;
+
+  void fail(beast::error_code ec, char const * what);
+
+ public:
+  AdminServer(net::io_context & ioc, tcp::endpoint endpoint);
+
+  void add_route(const std::string & target, RenderHandler render) {
+    routes_[target] = std::move(render);
+  }
+
+  // the handler for target, nullptr if there is none
+  const RenderHandler * find(beast::string_view target) const;
+
+  void run() { do_accept(); }
+
+ private:
+  void do_accept();
+
+  void on_accept(beast::error_code ec, tcp::socket socket);
+};
+
+/**
+ * one scrape connection, requests are answered one after another until the
+ * scraper closes it
+*/
+class AdminSession : public std::enable_shared_from_this<AdminSession> {
+  beast::tcp_stream stream_;
+  beast::flat_buffer buffer_;
+  http::request<http::empty_body> req_;
+  http::response<http::string_body> res_;
+  std::shared_ptr<const AdminServer> server_;
+
+ public:
+  AdminSession(tcp::socket && socket, std::shared_ptr<const AdminServer> server) :
+      stream_(std::move(socket)), server_(std::move(server)) {}
+
+  void run() { do_read(); }
+
+ private:
+  void do_read();
+
+  void on_read(beast::error_code ec, std::size_t bytes_transferred);
+
+  void on_write(beast::error_code ec, std::size_t bytes_transferred);
+};
+
+#endif  //ADMIN_SERVER
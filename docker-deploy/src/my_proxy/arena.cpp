@@ -0,0 +1,47 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <new>
+
+const size_t Arena::max_block;
+
+Arena::Arena(size_t first_block) {
+  add_block(first_block);
+}
+
+void Arena::add_block(size_t size) {
+  Block * block = static_cast<Block *>(::operator new(sizeof(Block) + size));
+  block->next = blocks_;
+  block->size = size;
+  blocks_ = block;
+  cur_ = reinterpret_cast<char *>(block + 1);
+  end_ = cur_ + size;
+  capacity_ += size;
+}
+
+void * Arena::allocate_slow(size_t bytes, size_t align) {
+  // double the arena, or more for a single large allocation
+  add_block(std::max(capacity_, bytes + align));
+  return allocate(bytes, align);
+}
+
+void Arena::release_blocks() {
+  while (blocks_) {
+    Block * next = blocks_->next;
+    ::operator delete(blocks_);
+    blocks_ = next;
+  }
+  capacity_ = 0;
+}
+
+void Arena::reset() {
+  if (blocks_->next) {
+    // one block the size of the whole chain, capped so a single outsized
+    // request does not pin its memory for the rest of the connection
+    size_t size = std::min(capacity_, max_block);
+    release_blocks();
+    add_block(size);
+    return;
+  }
+  cur_ = reinterpret_cast<char *>(blocks_ + 1);
+}
@@ -0,0 +1,99 @@
+#ifndef ARENA
+#define ARENA
+
+#include <boost/beast/http/fields.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * monotonic memory for everything one request allocates: headers, the
+ * parser's message, strings built for the request.
+ * allocate bumps a pointer, deallocate is a no-op and reset() hands the
+ * whole arena back at once. a request that outgrows the first block chains
+ * more blocks, reset() then replaces the chain by a single block of the
+ * combined size, so the next such request fits without touching the heap.
+*/
+class Arena {
+  struct Block {
+    Block * next;
+    size_t size;  // usable bytes after the Block
+  };
+
+  Block * blocks_{nullptr};  // newest first
+  char * cur_{nullptr};
+  char * end_{nullptr};
+  size_t capacity_{0};  // bytes in all blocks
+
+  static const size_t max_block = 64 * 1024;
+
+  void add_block(size_t size);
+  void * allocate_slow(size_t bytes, size_t align);
+  void release_blocks();
+
+ public:
+  explicit Arena(size_t first_block = 4096);
+  ~Arena() { release_blocks(); }
+  Arena(const Arena &) = delete;
+  Arena & operator=(const Arena &) = delete;
+
+  void * allocate(size_t bytes, size_t align) {
+    std::uintptr_t p = (reinterpret_cast<std::uintptr_t>(cur_) + align - 1) &
+                       ~static_cast<std::uintptr_t>(align - 1);
+    if (p + bytes <= reinterpret_cast<std::uintptr_t>(end_)) {
+      cur_ = reinterpret_cast<char *>(p + bytes);
+      return reinterpret_cast<void *>(p);
+    }
+    return allocate_slow(bytes, align);
+  }
+
+  // everything allocated so far must be dead
+  void reset();
+
+  size_t capacity() const { return capacity_; }
+};
+
+/**
+ * allocator handing out arena memory, copies share the arena. containers
+ * keep the allocator on assignment so their memory never changes arenas
+*/
+template<class T>
+class ArenaAllocator {
+  template<class U>
+  friend class ArenaAllocator;
+
+  Arena * arena_;
+
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  explicit ArenaAllocator(Arena & arena) noexcept : arena_(&arena) {}
+
+  template<class U>
+  ArenaAllocator(const ArenaAllocator<U> & other) noexcept : arena_(other.arena_) {}
+
+  T * allocate(std::size_t n) {
+    return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *, std::size_t) noexcept {}
+
+  template<class U>
+  bool operator==(const ArenaAllocator<U> & other) const noexcept {
+    return arena_ == other.arena_;
+  }
+
+  template<class U>
+  bool operator!=(const ArenaAllocator<U> & other) const noexcept {
+    return arena_ != other.arena_;
+  }
+};
+
+// http header fields kept in a session's arena
+typedef boost::beast::http::basic_fields<ArenaAllocator<char> > ArenaFields;
+
+#endif  //ARENA
@@ -0,0 +1,171 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "../proxy_server.hpp"
+
+/**
+ * global heap allocations per request on the proxy's io thread.
+ * operator new is replaced by a counting one, only the thread running the
+ * io_context counts. a stub origin and a keep-alive client run on threads
+ * of their own, every phase warms up first and then measures:
+ *   hit   GET answered from the cache
+ *   miss  GET of an uncacheable object over a pooled upstream connection
+ *   post  small upload relayed to the origin
+ * a phase averaging more allocations per request than its bound fails the
+ * run. what the bounds still allow is beyond the session's reach:
+ *  - beast 1.74's basic_stream arms a steady_timer behind any_io_executor
+ *    for every read or write with a deadline, and the wait copies the
+ *    strand to the heap (one per operation, a hit reads once and writes once)
+ *  - asio recycles one handler block per thread, a timer wait and a strand
+ *    dispatch in flight together make it miss twice per relayed response
+ *  - a miss registers the fetch it leads: the map node and its key
+ * usage: alloc_bench [requests_per_phase]
+*/
+
+static thread_local bool counting = false;
+static std::atomic<unsigned long long> alloc_count(0);
+static std::atomic<unsigned long long> alloc_bytes(0);
+
+// gcc pairs the replaced operators with the malloc/free inside them
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void * operator new(std::size_t size) {
+  if (counting) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  void * p = std::malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void * p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+  std::free(p);
+}
+
+// keep-alive origin: "/hit" is cacheable, everything else is not
+static void serve_origin_connection(tcp::socket s) {
+  beast::flat_buffer buf;
+  boost::system::error_code ec;
+  for (;;) {
+    http::request<http::string_body> req;
+    http::read(s, buf, req, ec);
+    if (ec) {
+      return;
+    }
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::server, "stub");
+    res.set(http::field::content_type, "text/plain");
+    if (req.target().ends_with("/hit")) {
+      res.set(http::field::cache_control, "max-age=600");
+    }
+    res.body() = std::string(1024, 'x');
+    res.prepare_payload();
+    http::write(s, res, ec);
+    if (ec) {
+      return;
+    }
+  }
+}
+
+static void run_origin(tcp::acceptor & acceptor) {
+  for (;;) {
+    tcp::socket socket(acceptor.get_executor());
+    boost::system::error_code ec;
+    acceptor.accept(socket, ec);
+    if (ec) {
+      return;
+    }
+    std::thread(serve_origin_connection, std::move(socket)).detach();
+  }
+}
+
+static unsigned short free_port(net::io_context & ioc) {
+  tcp::acceptor a(ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+  return a.local_endpoint().port();
+}
+
+int main(int argc, char * argv[]) {
+  int requests = argc > 1 ? std::atoi(argv[1]) : 2000;
+  int warmup = 200;
+
+  net::io_context origin_ioc;
+  tcp::acceptor origin(origin_ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+  std::string origin_host = "127.0.0.1:" + std::to_string(origin.local_endpoint().port());
+  std::thread(run_origin, std::ref(origin)).detach();
+
+  net::io_context ioc{1};
+  LogPipeline log_pipeline("/dev/null");
+  unsigned short port = free_port(ioc);
+  SharedState shared(log_pipeline, 64 << 20, ioc);
+  std::make_shared<listener>(
+      ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), port), shared)
+      ->run();
+  std::thread io([&ioc] {
+    counting = true;
+    ioc.run();
+  });
+
+  net::io_context client_ioc;
+  tcp::socket client(client_ioc);
+  client.connect(tcp::endpoint(net::ip::make_address("127.0.0.1"), port));
+  beast::flat_buffer buf;
+
+  struct Phase {
+    const char * name;
+    double max_allocs;
+  };
+  const Phase phases[] = {{"hit", 2}, {"miss", 11}, {"post", 12}};
+  bool over = false;
+  std::cout << "phase,requests,allocs_per_request,bytes_per_request,bound\n";
+  for (const Phase & bounded : phases) {
+    const char * phase = bounded.name;
+    std::string path = std::string(phase) == "post" ? "/upload" : std::string("/") + phase;
+    for (int i = 0; i < warmup + requests; ++i) {
+      if (i == warmup) {
+        alloc_count = 0;
+        alloc_bytes = 0;
+      }
+      http::request<http::string_body> req{
+          std::string(phase) == "post" ? http::verb::post : http::verb::get,
+          "http://" + origin_host + path,
+          11};
+      req.set(http::field::host, origin_host);
+      if (std::string(phase) == "post") {
+        req.body() = std::string(256, 'p');
+        req.prepare_payload();
+      }
+      http::write(client, req);
+      http::response<http::string_body> res;
+      http::read(client, buf, res);
+      if (res.result() != http::status::ok) {
+        std::cerr << phase << ": unexpected " << res.result_int() << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    double allocs = static_cast<double>(alloc_count) / requests;
+    std::cout << phase << "," << requests << "," << allocs << ","
+              << static_cast<double>(alloc_bytes) / requests << ","
+              << bounded.max_allocs << std::endl;
+    // the last handler of the warmup may still run when the count is reset,
+    // one allocation either way is not a regression
+    if (alloc_count > bounded.max_allocs * requests + 1) {
+      std::cerr << phase << ": " << allocs << " allocations per request, over "
+                << bounded.max_allocs << std::endl;
+      over = true;
+    }
+  }
+  std::_Exit(over ? EXIT_FAILURE : EXIT_SUCCESS);
+}
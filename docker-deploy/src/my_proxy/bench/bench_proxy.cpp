@@ -0,0 +1,41 @@
+#include "../admin_server.hpp"
+#include "../proxy_server.hpp"
+
+/**
+ * the proxy as the load tests run it: in the foreground (so the caller
+ * knows its pid), optimized and without the thread sanitizer, logging to
+ * /dev/null unless a log file is given.
+ * usage: bench_proxy <address> <port> <threads> [cache_mb] [log_file]
+ *   [admin_port] [shared|per-core]
+*/
+int main(int argc, char * argv[]) {
+  ProxyServer::ThreadModel model = ProxyServer::shared;
+  if (argc < 4 || argc > 8 ||
+      (argc == 8 && !ProxyServer::parse_thread_model(argv[7], model))) {
+    std::cerr << "Usage: bench_proxy <address> <port> <threads> [cache_mb] [log_file] "
+                 "[admin_port] [shared|per-core]\n";
+    return EXIT_FAILURE;
+  }
+  auto const address = net::ip::make_address(argv[1]);
+  auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
+  auto const threads = std::max<int>(1, std::atoi(argv[3]));
+  size_t const cache_bytes =
+      static_cast<size_t>(argc >= 5 ? std::max<int>(1, std::atoi(argv[4])) : 64) << 20;
+  std::string const log_file = argc >= 6 ? argv[5] : "/dev/null";
+  auto const admin_port = static_cast<unsigned short>(argc >= 7 ? std::atoi(argv[6]) : 0);
+
+  LogPipeline log_pipeline(log_file);
+  ProxyServer proxy_server(
+      model, threads, tcp::endpoint{address, port}, log_pipeline, cache_bytes);
+  if (admin_port != 0) {
+    // shares a proxy thread, scrapes are rare during a load test
+    auto admin = std::make_shared<AdminServer>(proxy_server.context(),
+                                               tcp::endpoint{address, admin_port});
+    admin->add_route("/metrics", [&proxy_server](std::string & out) {
+      proxy_server.render_metrics(out);
+    });
+    admin->run();
+  }
+  proxy_server.run();
+  return EXIT_SUCCESS;
+}
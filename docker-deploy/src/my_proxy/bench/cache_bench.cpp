@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cache.hpp"
+#include "../cache_key.hpp"
+
+/**
+ * contention benchmark for the response cache:
+ * every thread hammers get() on a pre-filled cache for a fixed duration,
+ * the sharded Cache of shared entries is compared against the old
+ * single-mutex LRU that copied the whole CachedResponse out on every hit,
+ * and keyed by CacheKey (the proxy's keys, hashed once when built) instead
+ * of std::string (hashed on every get()).
+ * a second run is read-through traffic (get, put on a miss) with Zipfian
+ * keys over a key space larger than the cache, as 1..max_threads threads.
+ * a third run mixes a hot set with a one-hit-wonder scan and reports the
+ * hit ratio the admission filter keeps.
+ * usage: cache_bench [max_threads] [millis_per_run] [num_keys]
+*/
+
+// the previous implementation: one mutex, list splice on every hit
+template<typename K, typename V>
+class SingleLockLRU {
+  size_t capacity;
+  std::mutex cache_mutex;
+  std::unordered_map<K, std::pair<V, typename std::list<K>::iterator> > cache;
+  std::list<K> lru;
+
+ public:
+  explicit SingleLockLRU(size_t capacity) : capacity(capacity) {}
+  void put(const K & key, const V & value) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+      lru.erase(it->second.second);
+      lru.push_front(key);
+      it->second = {value, lru.begin()};
+      return;
+    }
+    if (cache.size() == capacity) {
+      cache.erase(lru.back());
+      lru.pop_back();
+    }
+    lru.push_front(key);
+    cache[key] = {value, lru.begin()};
+  }
+  V get(const K & key) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+      lru.erase(it->second.second);
+      lru.push_front(key);
+      it->second.second = lru.begin();
+      return it->second.first;
+    }
+    return V();
+  }
+};
+
+bool is_hit(const CachedResponse & cr) {
+  return cr.status_code == 200;
+}
+
+bool is_hit(const CachedResponsePtr & cr) {
+  return cr != nullptr;
+}
+
+template<typename C, typename K>
+double run_hits(C & cache,
+                const std::vector<K> & keys,
+                int threads,
+                int millis) {
+  std::atomic<bool> stop(false);
+  std::atomic<unsigned long long> total(0);
+  std::vector<std::thread> v;
+  for (int t = 0; t < threads; ++t) {
+    v.emplace_back([&, t] {
+      unsigned long long ops = 0;
+      size_t i = static_cast<size_t>(t) * 7919;
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int n = 0; n < 256; ++n) {
+          if (!is_hit(cache.get(keys[i++ % keys.size()]))) {
+            std::abort();
+          }
+        }
+        ops += 256;
+      }
+      total += ops;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  stop = true;
+  for (auto & th : v) {
+    th.join();
+  }
+  return total.load() * 1000.0 / millis;
+}
+
+// key indices drawn from a Zipf distribution with exponent s, most popular
+// first
+static std::vector<uint32_t> zipf_samples(size_t num_keys, double s, size_t count) {
+  std::vector<double> cdf(num_keys);
+  double sum = 0;
+  for (size_t i = 0; i < num_keys; ++i) {
+    sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+    cdf[i] = sum;
+  }
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  std::vector<uint32_t> samples(count);
+  for (uint32_t & sample : samples) {
+    sample = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+  }
+  return samples;
+}
+
+// operations per second, every thread walks the samples from its own offset
+static double run_read_through(Cache<std::string, CachedResponsePtr> & cache,
+                               const std::vector<std::string> & keys,
+                               const std::vector<uint32_t> & samples,
+                               const CachedResponsePtr & value,
+                               int threads,
+                               int millis) {
+  std::atomic<bool> stop(false);
+  std::atomic<unsigned long long> total(0);
+  std::vector<std::thread> v;
+  for (int t = 0; t < threads; ++t) {
+    v.emplace_back([&, t] {
+      unsigned long long ops = 0;
+      size_t i = static_cast<size_t>(t) * samples.size() / threads;
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int n = 0; n < 256; ++n) {
+          const std::string & key = keys[samples[i++ % samples.size()]];
+          if (!cache.get(key)) {
+            cache.put(key, value);
+          }
+        }
+        ops += 256;
+      }
+      total += ops;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  stop = true;
+  for (auto & th : v) {
+    th.join();
+  }
+  return total.load() * 1000.0 / millis;
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = argc > 1 ? std::atoi(argv[1]) : 16;
+  int millis = argc > 2 ? std::atoi(argv[2]) : 500;
+  size_t num_keys = argc > 3 ? std::atoi(argv[3]) : 1000;
+
+  CachedResponse value;
+  value.status_code = 200;
+  value.status_message = "OK";
+  value.content_type = "text/html";
+  value.body = std::string(512, 'x');
+
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < num_keys; ++i) {
+    keys.push_back("GET http://origin.local/object/" + std::to_string(i));
+  }
+  // both caches are big enough that every get() is a hit
+  CachedResponsePtr entry = std::make_shared<CachedResponse>(value);
+  Cache<std::string, CachedResponsePtr> sharded(num_keys * 4096);
+  SingleLockLRU<std::string, CachedResponse> single(num_keys * 2);
+  Cache<CacheKey, CachedResponsePtr> hashed(num_keys * 4096);
+  std::vector<CacheKey> hashed_keys;
+  for (const auto & k : keys) {
+    sharded.put(k, entry);
+    single.put(k, value);
+    hashed_keys.emplace_back(k);
+    hashed.put(hashed_keys.back(), entry);
+  }
+
+  std::cout << "threads,single_lock_hits_per_sec,sharded_hits_per_sec,"
+               "sharded_cache_key_hits_per_sec\n";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    double s = run_hits(single, keys, threads, millis);
+    double c = run_hits(sharded, keys, threads, millis);
+    double h = run_hits(hashed, hashed_keys, threads, millis);
+    std::cout << threads << "," << static_cast<unsigned long long>(s) << ","
+              << static_cast<unsigned long long>(c) << ","
+              << static_cast<unsigned long long>(h) << std::endl;
+  }
+
+  // read-through with Zipfian popularity (s = 0.99, as in YCSB) over ten
+  // times the keys, the cache holds about a tenth of them
+  std::vector<std::string> zipf_keys;
+  for (size_t i = 0; i < num_keys * 10; ++i) {
+    zipf_keys.push_back("GET http://origin.local/zipf/" + std::to_string(i));
+  }
+  std::vector<uint32_t> samples = zipf_samples(zipf_keys.size(), 0.99, 1 << 20);
+  std::cout << "threads,zipf_ops_per_sec,zipf_hit_ratio\n";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    Cache<std::string, CachedResponsePtr> zipf(num_keys * (cache_charge(entry) + 160));
+    double ops = run_read_through(zipf, zipf_keys, samples, entry, threads, millis);
+    std::cout << threads << "," << static_cast<unsigned long long>(ops) << ","
+              << zipf.stats().hit_ratio() << std::endl;
+  }
+
+  // admission: a hot set that fits the budget, interleaved with a stream of
+  // one-hit-wonders several times larger than the cache
+  Cache<std::string, CachedResponsePtr> scanned(num_keys / 2 * 1024);
+  std::shared_ptr<CachedResponse> small = std::make_shared<CachedResponse>(value);
+  small->body = std::string(256, 'x');
+  std::vector<std::string> hot(keys.begin(), keys.begin() + num_keys / 4);
+  size_t scan = 0;
+  for (int round = 0; round < 200; ++round) {
+    for (const auto & k : hot) {
+      if (!scanned.get(k)) {
+        scanned.put(k, small);
+      }
+    }
+    for (size_t n = 0; n < num_keys; ++n) {
+      std::string k = "GET http://origin.local/scan/" + std::to_string(scan++);
+      scanned.get(k);
+      scanned.put(k, small);
+    }
+  }
+  CacheStats st = scanned.stats();
+  std::cout << "scan_hit_ratio,bytes_used,capacity_bytes,evictions,rejections\n"
+            << st.hit_ratio() << "," << st.bytes_used << "," << st.capacity_bytes << ","
+            << st.evictions << "," << st.rejections << std::endl;
+  return EXIT_SUCCESS;
+}
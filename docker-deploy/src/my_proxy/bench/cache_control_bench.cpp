@@ -0,0 +1,109 @@
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../cache_control.hpp"
+
+/**
+ * Cache-Control parsing cost per response header:
+ * the previous code split the value into a vector of strings twice per
+ * cacheable response (can_be_cached, then parse_response) and scanned it
+ * with one find_if per directive, CacheControl::parse reads it once.
+ * "agree" tells whether both saw the same directives, the old checks
+ * missed anything after ", ".
+ * usage: cache_control_bench [iterations]
+*/
+
+struct Directives {
+  bool no_store{false};
+  bool no_cache{false};
+  bool is_private{false};
+  bool must_revalidate{false};
+  int max_age{-1};
+};
+
+static bool has(const std::vector<std::string> & directives, const char * name) {
+  return std::find(directives.begin(), directives.end(), name) != directives.end();
+}
+
+static int delta(const std::vector<std::string> & directives, const std::string & prefix) {
+  auto it = std::find_if(
+      directives.begin(), directives.end(), [&prefix](const std::string & directive) {
+        return boost::starts_with(directive, prefix);
+      });
+  return it == directives.end() ? -1 : std::stoi(it->substr(prefix.size()));
+}
+
+// the previous can_be_cached and parse_response, each splitting on its own
+static Directives legacy_parse(const std::string & value) {
+  Directives d;
+  std::vector<std::string> directives;
+  boost::split(directives, value, boost::is_any_of(","));
+  d.no_store = has(directives, "no-store");
+  d.is_private = has(directives, "private");
+  d.no_cache = has(directives, "no-cache");
+  d.max_age = delta(directives, "max-age=");
+  std::vector<std::string> again;
+  boost::split(again, value, boost::is_any_of(","));
+  d.max_age = delta(again, "max-age=");
+  d.must_revalidate = has(again, "must-revalidate");
+  d.no_cache = has(again, "no-cache");
+  delta(again, "max-stale=");
+  return d;
+}
+
+static Directives single_pass_parse(const std::string & value) {
+  CacheControl cc = CacheControl::parse(value);
+  Directives d;
+  d.no_store = cc.no_store;
+  d.no_cache = cc.no_cache;
+  d.is_private = cc.is_private;
+  d.must_revalidate = cc.must_revalidate;
+  d.max_age = cc.max_age;
+  return d;
+}
+
+static bool same(const Directives & a, const Directives & b) {
+  return a.no_store == b.no_store && a.no_cache == b.no_cache &&
+         a.is_private == b.is_private && a.must_revalidate == b.must_revalidate &&
+         a.max_age == b.max_age;
+}
+
+template<class Parse>
+static double ns_per_parse(Parse parse, const std::string & value, int iterations) {
+  volatile int sink = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    sink = sink + parse(value).max_age;
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+}
+
+int main(int argc, char * argv[]) {
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+  const std::vector<std::string> headers = {
+      "max-age=600",
+      "no-store",
+      "max-age=3600,must-revalidate",
+      "public, max-age=3600, must-revalidate",
+      "private, no-cache, max-age=0",
+      "public, max-age=31536000, immutable, stale-while-revalidate=60",
+  };
+
+  std::cout << "header,legacy_ns,single_pass_ns,speedup,agree\n";
+  for (const std::string & value : headers) {
+    double legacy = ns_per_parse(legacy_parse, value, iterations);
+    double single_pass = ns_per_parse(single_pass_parse, value, iterations);
+    std::cout << '"' << value << "\"," << legacy << "," << single_pass << ","
+              << legacy / single_pass << ","
+              << (same(legacy_parse(value), single_pass_parse(value)) ? "yes" : "no")
+              << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
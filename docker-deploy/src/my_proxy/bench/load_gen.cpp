@@ -0,0 +1,427 @@
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../latency.hpp"
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace http = beast::http;      // from <boost/beast/http.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * drives one traffic scenario through the proxy over loopback and prints
+ * the result as one JSON object per line, so runs can be collected and
+ * compared. the origin is expected to be bench/origin_stub:
+ *   hit      GET of `keys` cacheable objects, all cached after the warmup
+ *   miss     GET of uncacheable objects
+ *   post     POST of `size` bytes (1024 unless given)
+ *   connect  GET of uncacheable objects through one CONNECT tunnel per
+ *            connection
+ *   large, chunked, slow  GET of those origin_stub responses
+ * closed loop unless --rate is given: each connection sends its next
+ * request when the last answer is in. with a rate the connections follow a
+ * fixed schedule and latency counts from the scheduled start, a stalled
+ * proxy cannot hide its queue (no coordinated omission).
+ * with --pid the CPU time and RSS of that process are reported as well.
+ * usage: load_gen --proxy host:port --origin host:port [--scenario hit]
+ *   [--concurrency 16] [--rate 0] [--duration 10] [--warmup 2] [--size 0]
+ *   [--keys 100] [--threads 1] [--pid 0]
+*/
+
+typedef std::chrono::steady_clock clock_type;
+
+static clock_type::duration seconds(double s) {
+  typedef std::chrono::duration<double> fractional;
+  return std::chrono::duration_cast<clock_type::duration>(fractional(s));
+}
+
+struct Options {
+  std::string proxy_host{"127.0.0.1"};
+  std::string proxy_port{"3128"};
+  std::string origin{"127.0.0.1:8080"};
+  std::string scenario{"hit"};
+  int concurrency{16};
+  double rate{0};  // requests per second over all connections, 0 = closed loop
+  double duration{10};
+  double warmup{2};
+  size_t size{0};  // response or upload size, 0 = the stub's default
+  int keys{100};
+  int threads{1};
+  int pid{0};
+};
+
+// shared by all clients, read-only once they run
+struct Run {
+  Options options;
+  tcp::endpoint proxy;
+  clock_type::time_point begin;  // warmup over, samples count from here
+  clock_type::time_point end;
+  std::atomic<bool> stopping{false};
+};
+
+class Client : public std::enable_shared_from_this<Client> {
+  Run & run_;
+  int id_;
+  tcp::socket socket_;
+  net::steady_timer timer_;
+  beast::flat_buffer buffer_;
+  http::request<http::string_body> req_;
+  boost::optional<http::response_parser<http::string_body> > parser_;
+  clock_type::time_point due_;  // when the request in flight was due
+  uint64_t seq_{0};
+
+ public:
+  Latency::Histogram histogram;
+  uint64_t completed{0};
+  uint64_t errors{0};
+  uint64_t max_us{0};
+
+  Client(net::io_context & ioc, Run & run, int id) :
+      run_(run), id_(id), socket_(net::make_strand(ioc)), timer_(socket_.get_executor()) {
+    histogram.counts.fill(0);
+    histogram.sum_us = 0;
+  }
+
+  void start() {
+    if (run_.options.rate > 0) {
+      // spread the first requests over one interval
+      due_ = clock_type::now() + seconds(id_ / run_.options.rate);
+    }
+    connect();
+  }
+
+ private:
+  bool tunnel() const { return run_.options.scenario == "connect"; }
+
+  void connect() {
+    beast::error_code ec;
+    socket_.close(ec);
+    buffer_.consume(buffer_.size());
+    auto self = shared_from_this();
+    socket_.async_connect(run_.proxy,
+                          [self](beast::error_code ec) { self->on_connect(ec); });
+  }
+
+  void on_connect(beast::error_code ec) {
+    if (ec) {
+      return retry();
+    }
+    socket_.set_option(tcp::no_delay(true), ec);
+    if (!tunnel()) {
+      return next();
+    }
+    req_ = {};
+    req_.method(http::verb::connect);
+    req_.target(run_.options.origin);
+    req_.version(11);
+    req_.set(http::field::host, run_.options.origin);
+    parser_.emplace();
+    // the answer to CONNECT has no body, whatever its header says
+    parser_->skip(true);
+    auto self = shared_from_this();
+    http::async_write(socket_, req_, [self](beast::error_code ec, std::size_t) {
+      if (ec) {
+        return self->retry();
+      }
+      http::async_read_header(
+          self->socket_,
+          self->buffer_,
+          *self->parser_,
+          [self](beast::error_code ec, std::size_t) { self->on_tunnel(ec); });
+    });
+  }
+
+  void on_tunnel(beast::error_code ec) {
+    if (ec || parser_->get().result() != http::status::ok) {
+      return retry();
+    }
+    next();
+  }
+
+  void retry() {
+    if (clock_type::now() >= run_.begin) {
+      ++errors;
+    }
+    if (run_.stopping) {
+      return;
+    }
+    // a refused connect must not spin
+    timer_.expires_after(std::chrono::milliseconds(10));
+    auto self = shared_from_this();
+    timer_.async_wait([self](beast::error_code) { self->connect(); });
+  }
+
+  void next() {
+    if (run_.stopping) {
+      return;
+    }
+    if (run_.options.rate <= 0) {
+      due_ = clock_type::now();
+      return send();
+    }
+    if (clock_type::now() < due_) {
+      timer_.expires_at(due_);
+      auto self = shared_from_this();
+      return timer_.async_wait([self](beast::error_code) { self->send(); });
+    }
+    send();
+  }
+
+  std::string path() {
+    const Options & o = run_.options;
+    std::string query = o.size > 0 ? "?size=" + std::to_string(o.size) : "";
+    std::string unique = std::to_string(id_) + "-" + std::to_string(seq_);
+    if (o.scenario == "hit") {
+      uint64_t key = (id_ + seq_ * o.concurrency) % o.keys;
+      return "/cacheable/k" + std::to_string(key) + query;
+    }
+    if (o.scenario == "large" || o.scenario == "chunked" || o.scenario == "slow") {
+      return "/" + o.scenario + "/" + unique + query;
+    }
+    if (o.scenario == "post") {
+      return "/upload/" + unique;
+    }
+    return "/uncacheable/" + unique + query;
+  }
+
+  void send() {
+    if (run_.stopping) {
+      return;
+    }
+    const Options & o = run_.options;
+    req_ = {};
+    req_.version(11);
+    std::string p = path();
+    req_.target(tunnel() ? p : "http://" + o.origin + p);
+    req_.set(http::field::host, o.origin);
+    if (o.scenario == "post") {
+      req_.method(http::verb::post);
+      req_.body().assign(o.size > 0 ? o.size : 1024, 'p');
+    }
+    else {
+      req_.method(http::verb::get);
+    }
+    req_.prepare_payload();
+    ++seq_;
+    parser_.emplace();
+    parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+    auto self = shared_from_this();
+    http::async_write(socket_, req_, [self](beast::error_code ec, std::size_t) {
+      if (ec) {
+        return self->retry();
+      }
+      http::async_read(self->socket_,
+                       self->buffer_,
+                       *self->parser_,
+                       [self](beast::error_code ec, std::size_t) { self->on_read(ec); });
+    });
+  }
+
+  void on_read(beast::error_code ec) {
+    if (ec || parser_->get().result() != http::status::ok) {
+      return retry();
+    }
+    clock_type::time_point now = clock_type::now();
+    if (due_ >= run_.begin && now <= run_.end) {
+      uint64_t us =
+          std::chrono::duration_cast<std::chrono::microseconds>(now - due_).count();
+      ++histogram.counts[Latency::bucket(us)];
+      histogram.sum_us += us;
+      max_us = std::max(max_us, us);
+      ++completed;
+    }
+    if (run_.options.rate > 0) {
+      due_ += seconds(run_.options.concurrency / run_.options.rate);
+    }
+    if (!parser_->keep_alive()) {
+      return connect();
+    }
+    next();
+  }
+};
+
+struct ProcessUsage {
+  double cpu_seconds{0};
+  long rss_kb{0};
+  long peak_rss_kb{0};
+};
+
+// utime + stime from /proc/<pid>/stat, VmRSS and VmHWM from its status
+static bool process_usage(const std::string & pid, ProcessUsage & usage) {
+  std::ifstream stat("/proc/" + pid + "/stat");
+  std::string line;
+  if (!std::getline(stat, line)) {
+    return false;
+  }
+  // the command name may contain spaces, the fields after it do not
+  std::istringstream fields(line.substr(line.rfind(')') + 2));
+  std::string field;
+  unsigned long utime = 0, stime = 0;
+  for (int i = 3; i <= 15 && fields >> field; ++i) {
+    if (i == 14) {
+      utime = std::stoul(field);
+    }
+    if (i == 15) {
+      stime = std::stoul(field);
+    }
+  }
+  usage.cpu_seconds = static_cast<double>(utime + stime) / ::sysconf(_SC_CLK_TCK);
+  std::ifstream status("/proc/" + pid + "/status");
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      usage.rss_kb = std::atol(line.c_str() + 6);
+    }
+    else if (line.compare(0, 6, "VmHWM:") == 0) {
+      usage.peak_rss_kb = std::atol(line.c_str() + 6);
+    }
+  }
+  return true;
+}
+
+static bool parse_options(int argc, char * argv[], Options & o) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string name = argv[i];
+    std::string value = argv[i + 1];
+    if (name == "--proxy") {
+      size_t colon = value.rfind(':');
+      if (colon == std::string::npos) {
+        return false;
+      }
+      o.proxy_host = value.substr(0, colon);
+      o.proxy_port = value.substr(colon + 1);
+    }
+    else if (name == "--origin") {
+      o.origin = value;
+    }
+    else if (name == "--scenario") {
+      o.scenario = value;
+    }
+    else if (name == "--concurrency") {
+      o.concurrency = std::max(1, std::atoi(value.c_str()));
+    }
+    else if (name == "--rate") {
+      o.rate = std::atof(value.c_str());
+    }
+    else if (name == "--duration") {
+      o.duration = std::atof(value.c_str());
+    }
+    else if (name == "--warmup") {
+      o.warmup = std::atof(value.c_str());
+    }
+    else if (name == "--size") {
+      o.size = std::strtoull(value.c_str(), nullptr, 10);
+    }
+    else if (name == "--keys") {
+      o.keys = std::max(1, std::atoi(value.c_str()));
+    }
+    else if (name == "--threads") {
+      o.threads = std::max(1, std::atoi(value.c_str()));
+    }
+    else if (name == "--pid") {
+      o.pid = std::atoi(value.c_str());
+    }
+    else {
+      return false;
+    }
+  }
+  static const char * const scenarios[] = {
+      "hit", "miss", "post", "connect", "large", "chunked", "slow"};
+  return argc % 2 == 1 && std::find(std::begin(scenarios),
+                                    std::end(scenarios),
+                                    o.scenario) != std::end(scenarios);
+}
+
+int main(int argc, char * argv[]) {
+  Run run;
+  if (!parse_options(argc, argv, run.options)) {
+    std::cerr << "Usage: load_gen --proxy host:port --origin host:port\n"
+                 "  [--scenario hit|miss|post|connect|large|chunked|slow]\n"
+                 "  [--concurrency 16] [--rate 0] [--duration 10] [--warmup 2]\n"
+                 "  [--size 0] [--keys 100] [--threads 1] [--pid 0]\n";
+    return EXIT_FAILURE;
+  }
+  const Options & o = run.options;
+  net::io_context ioc{o.threads};
+  tcp::resolver resolver(ioc);
+  run.proxy = *resolver.resolve(o.proxy_host, o.proxy_port).begin();
+  clock_type::time_point start = clock_type::now();
+  run.begin = start + seconds(o.warmup);
+  run.end = run.begin + seconds(o.duration);
+
+  std::vector<std::shared_ptr<Client> > clients;
+  for (int i = 0; i < o.concurrency; ++i) {
+    clients.push_back(std::make_shared<Client>(ioc, run, i));
+    clients.back()->start();
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < o.threads; ++i) {
+    threads.emplace_back([&ioc] { ioc.run(); });
+  }
+
+  std::string pid = std::to_string(o.pid);
+  ProcessUsage before, after, self_before, self_after;
+  std::this_thread::sleep_until(run.begin);
+  bool have_proxy = o.pid > 0 && process_usage(pid, before);
+  process_usage("self", self_before);
+  std::this_thread::sleep_until(run.end);
+  have_proxy = have_proxy && process_usage(pid, after);
+  process_usage("self", self_after);
+  run.stopping = true;
+  ioc.stop();
+  for (std::thread & t : threads) {
+    t.join();
+  }
+
+  Latency::Histogram total;
+  total.counts.fill(0);
+  total.sum_us = 0;
+  uint64_t completed = 0, errors = 0, max_us = 0;
+  for (const std::shared_ptr<Client> & c : clients) {
+    for (size_t i = 0; i < Latency::num_buckets; ++i) {
+      total.counts[i] += c->histogram.counts[i];
+    }
+    total.sum_us += c->histogram.sum_us;
+    completed += c->completed;
+    errors += c->errors;
+    max_us = std::max(max_us, c->max_us);
+  }
+
+  // a percentile is its bucket's upper bound, it must not pass the slowest request
+  auto pct = [&total, max_us](double q) { return std::min(total.percentile(q), max_us); };
+  std::ostringstream out;
+  out << "{\"scenario\":\"" << o.scenario << "\",\"concurrency\":" << o.concurrency
+      << ",\"rate\":" << o.rate << ",\"duration_s\":" << o.duration
+      << ",\"size\":" << o.size << ",\"requests\":" << completed
+      << ",\"errors\":" << errors << ",\"rps\":" << completed / o.duration
+      << ",\"latency_us\":{\"mean\":" << (completed ? total.sum_us / completed : 0)
+      << ",\"p50\":" << pct(0.5) << ",\"p90\":" << pct(0.9) << ",\"p99\":" << pct(0.99)
+      << ",\"p999\":" << pct(0.999)
+      << ",\"max\":" << max_us << "}";
+  if (have_proxy) {
+    double cpu = after.cpu_seconds - before.cpu_seconds;
+    out << ",\"proxy\":{\"cpu_s\":" << cpu
+        << ",\"cpu_percent\":" << 100 * cpu / o.duration << ",\"rss_kb\":" << after.rss_kb
+        << ",\"peak_rss_kb\":" << after.peak_rss_kb << "}";
+  }
+  out << ",\"loadgen_cpu_s\":" << self_after.cpu_seconds - self_before.cpu_seconds << "}";
+  std::cout << out.str() << std::endl;
+  // the clients may still hold operations of the stopped io_context
+  std::_Exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,30 @@
+#!/bin/bash
+# runs every load_gen scenario against bench_proxy and origin_stub on
+# loopback, one JSON line per scenario on stdout.
+# usage: bench/load_test.sh [concurrency] [duration_s] [rate]
+# PROXY_THREADS, PROXY_THREADING (shared or per-core), PROXY_PORT, ORIGIN_PORT
+# and SCENARIOS override the defaults.
+set -e
+cd "$(dirname "$0")"
+
+CONCURRENCY=${1:-32}
+DURATION=${2:-10}
+RATE=${3:-0}
+PROXY_THREADS=${PROXY_THREADS:-$(nproc)}
+PROXY_THREADING=${PROXY_THREADING:-shared}
+PROXY_PORT=${PROXY_PORT:-23128}
+ORIGIN_PORT=${ORIGIN_PORT:-28080}
+SCENARIOS=${SCENARIOS:-"hit miss post connect chunked large slow"}
+
+./origin_stub 127.0.0.1 "$ORIGIN_PORT" 2 &
+ORIGIN_PID=$!
+./bench_proxy 127.0.0.1 "$PROXY_PORT" "$PROXY_THREADS" 64 /dev/null 0 "$PROXY_THREADING" &
+PROXY_PID=$!
+trap 'kill $PROXY_PID $ORIGIN_PID 2>/dev/null' EXIT
+sleep 0.5
+
+for scenario in $SCENARIOS; do
+  ./load_gen --proxy "127.0.0.1:$PROXY_PORT" --origin "127.0.0.1:$ORIGIN_PORT" \
+             --scenario "$scenario" --concurrency "$CONCURRENCY" --rate "$RATE" \
+             --duration "$DURATION" --pid "$PROXY_PID"
+done
@@ -0,0 +1,244 @@
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;    // from <boost/beast.hpp>
+namespace http = beast::http;      // from <boost/beast/http.hpp>
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * keep-alive origin for the load tests, the first path segment picks the
+ * kind of response:
+ *   /cacheable/...    Cache-Control: max-age=3600 and an ETag
+ *   /uncacheable/...  Cache-Control: no-store
+ *   /chunked/...      uncacheable, chunked in pieces of `chunk` bytes
+ *   /large/...        uncacheable, 1 MiB unless size is given
+ *   /slow/...         uncacheable, answered after `delay` ms (100)
+ * query parameters size (1024), chunk (4096) and delay apply to all of
+ * them. POST and PUT bodies are read and answered with their length.
+ * bodies are served from one shared buffer of 'x', the stub itself should
+ * cost as little as possible next to the proxy.
+ * usage: origin_stub <address> <port> [threads]
+*/
+
+static const size_t max_body = 16 << 20;
+static std::string filler;
+
+struct Reply {
+  std::string kind;
+  size_t size{1024};
+  size_t chunk{4096};
+  int delay_ms{0};
+};
+
+static size_t query_value(beast::string_view query, const char * name, size_t otherwise) {
+  std::string key = std::string(name) + "=";
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = std::min(query.find('&', pos), query.size());
+    beast::string_view param = query.substr(pos, end - pos);
+    if (param.starts_with(key)) {
+      return std::strtoull(std::string(param.substr(key.size())).c_str(), nullptr, 10);
+    }
+    pos = end + 1;
+  }
+  return otherwise;
+}
+
+static Reply parse_target(beast::string_view target) {
+  Reply reply;
+  // the proxy passes absolute-form targets on, which origins must accept
+  size_t scheme = target.find("://");
+  if (scheme != beast::string_view::npos) {
+    target.remove_prefix(std::min(target.find('/', scheme + 3), target.size()));
+  }
+  size_t q = target.find('?');
+  beast::string_view path = target.substr(0, q);
+  beast::string_view query = q == beast::string_view::npos ? "" : target.substr(q + 1);
+  path.remove_prefix(std::min<size_t>(1, path.size()));
+  reply.kind = std::string(path.substr(0, path.find('/')));
+  if (reply.kind == "large") {
+    reply.size = 1 << 20;
+  }
+  if (reply.kind == "slow") {
+    reply.delay_ms = 100;
+  }
+  reply.size = std::min(query_value(query, "size", reply.size), max_body);
+  reply.chunk = std::max<size_t>(1, query_value(query, "chunk", reply.chunk));
+  reply.delay_ms = static_cast<int>(query_value(query, "delay", reply.delay_ms));
+  return reply;
+}
+
+class StubSession : public std::enable_shared_from_this<StubSession> {
+  tcp::socket socket_;
+  beast::flat_buffer buffer_;
+  boost::optional<http::request_parser<http::string_body> > parser_;
+  net::steady_timer delay_;
+  std::string header_;
+  std::string body_;  // POST answers and chunk framing
+  std::vector<net::const_buffer> out_;
+  bool keep_alive_{true};
+
+ public:
+  explicit StubSession(tcp::socket socket) :
+      socket_(std::move(socket)), delay_(socket_.get_executor()) {}
+
+  void run() {
+    beast::error_code ec;
+    socket_.set_option(tcp::no_delay(true), ec);
+    do_read();
+  }
+
+ private:
+  void do_read() {
+    parser_.emplace();
+    parser_->body_limit(max_body);
+    auto self = shared_from_this();
+    http::async_read(socket_,
+                     buffer_,
+                     *parser_,
+                     [self](beast::error_code ec, std::size_t) { self->on_read(ec); });
+  }
+
+  void on_read(beast::error_code ec) {
+    if (ec) {
+      return close();
+    }
+    http::request<http::string_body> & req = parser_->get();
+    keep_alive_ = req.keep_alive();
+    if (req.method() == http::verb::post || req.method() == http::verb::put) {
+      body_ = std::to_string(req.body().size());
+      start_header(200, "no-store");
+      finish_header(body_.size());
+      out_.push_back(net::buffer(body_));
+      return do_write();
+    }
+    Reply reply = parse_target(req.target());
+    if (reply.delay_ms > 0) {
+      delay_.expires_after(std::chrono::milliseconds(reply.delay_ms));
+      auto self = shared_from_this();
+      return delay_.async_wait(
+          [self, reply](beast::error_code) { self->respond(reply); });
+    }
+    respond(reply);
+  }
+
+  void respond(const Reply & reply) {
+    if (reply.kind == "cacheable") {
+      start_header(200, "max-age=3600");
+      header_ += "ETag: \"stub-v1\"\r\n";
+    }
+    else if (reply.kind == "uncacheable" || reply.kind == "chunked" ||
+             reply.kind == "large" || reply.kind == "slow") {
+      start_header(200, "no-store");
+    }
+    else {
+      start_header(404, "no-store");
+      finish_header(0);
+      return do_write();
+    }
+    if (reply.kind != "chunked") {
+      finish_header(reply.size);
+      out_.push_back(net::buffer(filler.data(), reply.size));
+      return do_write();
+    }
+    header_ += "Transfer-Encoding: chunked\r\n\r\n";
+    out_.push_back(net::buffer(header_));
+    // chunk sizes go into body_, reserved up front so the buffers stay put
+    size_t chunks = (reply.size + reply.chunk - 1) / reply.chunk;
+    body_.clear();
+    body_.reserve(chunks * 24 + 8);
+    for (size_t sent = 0; sent < reply.size; sent += reply.chunk) {
+      size_t n = std::min(reply.chunk, reply.size - sent);
+      char line[24];
+      int len = std::snprintf(line, sizeof(line), "%zx\r\n", n);
+      size_t at = body_.size();
+      body_.append(line, len);
+      out_.push_back(net::buffer(body_.data() + at, len));
+      out_.push_back(net::buffer(filler.data(), n));
+      out_.push_back(net::buffer("\r\n", 2));
+    }
+    out_.push_back(net::buffer("0\r\n\r\n", 5));
+    do_write();
+  }
+
+  void start_header(int status, const char * cache_control) {
+    out_.clear();
+    header_ = status == 200 ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n";
+    header_ += "Server: origin-stub\r\nContent-Type: text/plain\r\nCache-Control: ";
+    header_ += cache_control;
+    header_ += "\r\n";
+    if (!keep_alive_) {
+      header_ += "Connection: close\r\n";
+    }
+  }
+
+  void finish_header(size_t content_length) {
+    header_ += "Content-Length: ";
+    header_ += std::to_string(content_length);
+    header_ += "\r\n\r\n";
+    out_.insert(out_.begin(), net::buffer(header_));
+  }
+
+  void do_write() {
+    auto self = shared_from_this();
+    net::async_write(socket_, out_, [self](beast::error_code ec, std::size_t) {
+      if (ec || !self->keep_alive_) {
+        return self->close();
+      }
+      self->do_read();
+    });
+  }
+
+  void close() {
+    beast::error_code ec;
+    socket_.shutdown(tcp::socket::shutdown_send, ec);
+  }
+};
+
+static void do_accept(tcp::acceptor & acceptor) {
+  acceptor.async_accept(net::make_strand(acceptor.get_executor()),
+                        [&acceptor](beast::error_code ec, tcp::socket socket) {
+                          if (!ec) {
+                            std::make_shared<StubSession>(std::move(socket))->run();
+                          }
+                          do_accept(acceptor);
+                        });
+}
+
+int main(int argc, char * argv[]) {
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: origin_stub <address> <port> [threads]\n";
+    return EXIT_FAILURE;
+  }
+  int threads = argc == 4 ? std::max(1, std::atoi(argv[3])) : 1;
+  filler.assign(max_body, 'x');
+
+  net::io_context ioc{threads};
+  tcp::acceptor acceptor(ioc);
+  tcp::endpoint endpoint(net::ip::make_address(argv[1]),
+                         static_cast<unsigned short>(std::atoi(argv[2])));
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(net::socket_base::reuse_address(true));
+  acceptor.bind(endpoint);
+  acceptor.listen(net::socket_base::max_listen_connections);
+  do_accept(acceptor);
+
+  std::vector<std::thread> v;
+  for (int i = threads - 1; i > 0; --i) {
+    v.emplace_back([&ioc] { ioc.run(); });
+  }
+  ioc.run();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#!/bin/bash
+# the shared io_context against one io_context per core: load_test.sh for
+# both thread models at each core count, one JSON line per scenario with the
+# model and core count in front.
+# usage: bench/reactor_bench.sh [concurrency] [duration_s] [rate]
+# CORES and SCENARIOS override the defaults, the other load_test.sh
+# variables are passed on.
+set -e
+cd "$(dirname "$0")"
+
+CORES=${CORES:-"1 4 16 64"}
+export SCENARIOS=${SCENARIOS:-"hit miss connect"}
+
+for threading in shared per-core; do
+  for cores in $CORES; do
+    PROXY_THREADING=$threading PROXY_THREADS=$cores ./load_test.sh "$@" |
+      sed "s/^{/{\"threading\":\"$threading\",\"cores\":$cores,/"
+  done
+done
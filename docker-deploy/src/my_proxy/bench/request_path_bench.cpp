@@ -0,0 +1,303 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cache_handler.hpp"
+#include "../http_parser.hpp"
+
+/**
+ * the per-request building blocks, each over a corpus of request and
+ * response headers as browsers, CDNs and origin servers send them:
+ *   HttpParser get_server_name, get_cache_key, parse_response (Cache-Control
+ *   parsed as the session does) and serialize_header (the wire header a hit
+ *   is written from)
+ *   CacheHandler lookup (a hit, the key built beforehand), can_be_cached and
+ *   cached_response_state
+ * nanoseconds per call, averaged over the corpus. the handlers log through a
+ * pipeline to /dev/null that drops lines it cannot take, so only the
+ * caller's share of logging is timed.
+ * LogWriter throughput is measured end to end (the writer thread writing
+ * to /dev/null) with 1..max_threads producers.
+ * usage: request_path_bench [iterations] [max_threads]
+*/
+
+static const char * const request_corpus[] = {
+    "GET http://www.example.com/ HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n\r\n",
+
+    "GET http://cdn.example.net:8080/static/js/app.3f9c2b1e.js HTTP/1.1\r\n"
+    "Host: cdn.example.net:8080\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 "
+    "(KHTML, like Gecko) Version/17.5 Safari/605.1.15\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Proxy-Connection: keep-alive\r\n\r\n",
+
+    "GET http://api.example.org/v2/items?page=3&per_page=50&sort=-updated HTTP/1.1\r\n"
+    "Host: api.example.org\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: application/json\r\n"
+    "Cache-Control: max-stale=60\r\n\r\n",
+
+    "GET http://images.example.com/photos/2024/06/IMG_2041.jpg HTTP/1.1\r\n"
+    "Host: images.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: de-DE,de;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "If-None-Match: \"5d41402abc4b2a76b9719d911017c592\"\r\n"
+    "Cache-Control: min-fresh=30\r\n\r\n",
+};
+
+static const char * const response_corpus[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx/1.24.0\r\n"
+    "Date: Mon, 10 Jun 2024 12:00:00 GMT\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Content-Length: 1256\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=600\r\n"
+    "ETag: \"666ae3c0-4e8\"\r\n"
+    "Last-Modified: Thu, 13 Jun 2024 12:21:20 GMT\r\n"
+    "Accept-Ranges: bytes\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/javascript\r\n"
+    "Content-Length: 48213\r\n"
+    "Cache-Control: public, max-age=31536000, immutable\r\n"
+    "ETag: W/\"bc4d-18f0a3c7e50\"\r\n"
+    "Server: cloudflare\r\n"
+    "CF-Cache-Status: HIT\r\n"
+    "Age: 86231\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "Server: gunicorn\r\n"
+    "Content-Type: application/json\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Cache-Control: private, no-cache, max-age=0\r\n"
+    "Set-Cookie: csrftoken=Zx8Q2; Path=/; SameSite=Lax\r\n"
+    "X-Request-Id: 2b7c1c6e-8f1f-4a47-9d0a-3c2a8f6b0e11\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "Server: Apache/2.4.58 (Ubuntu)\r\n"
+    "Content-Type: image/jpeg\r\n"
+    "Content-Length: 284113\r\n"
+    "Cache-Control: max-age=3600, must-revalidate\r\n"
+    "ETag: \"455d1-61a9c5d1b6f40\"\r\n"
+    "Last-Modified: Tue, 04 Jun 2024 08:15:02 GMT\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "Server: AmazonS3\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 1048576\r\n"
+    "Cache-Control: no-store\r\n"
+    "x-amz-request-id: 4442587FB7D0A2F9\r\n\r\n",
+};
+
+typedef http::request<http::empty_body, ArenaFields> request_type;
+typedef http::response<http::empty_body, ArenaFields> response_type;
+typedef http::request_parser<http::empty_body, ArenaAllocator<char> > request_parser;
+typedef http::response_parser<http::empty_body, ArenaAllocator<char> > response_parser;
+
+template<class Parser>
+static typename Parser::value_type parse(Arena & arena, const char * text) {
+  Parser parser(std::piecewise_construct,
+                std::make_tuple(),
+                std::make_tuple(ArenaAllocator<char>(arena)));
+  // only the header is there, a response must not wait for its body
+  parser.skip(true);
+  beast::error_code ec;
+  parser.put(net::buffer(text, std::strlen(text)), ec);
+  if (ec || !parser.is_header_done()) {
+    std::cerr << "corpus header does not parse: " << ec.message() << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return parser.release();
+}
+
+// ns per call of fn(item), over iterations passes of the corpus
+template<class T, class Fn>
+static double ns_per_call(const std::vector<T> & corpus, int iterations, Fn fn) {
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (const T & item : corpus) {
+      fn(item);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() /
+         (static_cast<double>(iterations) * corpus.size());
+}
+
+static double log_lines_per_sec(const std::vector<request_type> & requests,
+                                const std::vector<response_type> & responses,
+                                int threads,
+                                int lines_per_thread) {
+  auto begin = std::chrono::steady_clock::now();
+  {
+    LogPipeline pipeline("/dev/null");
+    std::vector<std::thread> v;
+    for (int t = 0; t < threads; ++t) {
+      v.emplace_back([&, t] {
+        LogWriter lw(t, pipeline);
+        const std::string client = "192.168.10." + std::to_string(t);
+        // a cacheable miss writes about this mix of lines
+        for (int n = 0; n < lines_per_thread; n += 4) {
+          const request_type & req = requests[n % requests.size()];
+          const response_type & res = responses[n % responses.size()];
+          lw.log_request_from_client(req, client);
+          lw.log_not_in_cache();
+          lw.log_response_from_server(res, "origin.example.com");
+          lw.log_response_to_client(res);
+        }
+      });
+    }
+    for (auto & th : v) {
+      th.join();
+    }
+    // the destructor writes out what is still queued
+  }
+  auto end = std::chrono::steady_clock::now();
+  return threads * static_cast<double>(lines_per_thread) /
+         std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char * argv[]) {
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+  int max_threads = argc > 2 ? std::atoi(argv[2]) : 4;
+
+  Arena arena;
+  std::vector<request_type> requests;
+  for (const char * text : request_corpus) {
+    requests.push_back(parse<request_parser>(arena, text));
+  }
+  std::vector<response_type> responses;
+  for (const char * text : response_corpus) {
+    responses.push_back(parse<response_parser>(arena, text));
+  }
+
+  LogPipeline quiet("/dev/null",
+                    std::chrono::milliseconds(50),
+                    1 << 18,
+                    LogPipeline::FullPolicy::drop);
+  LogWriter lw(0, quiet);
+  Cache<CacheKey, CachedResponsePtr> cache(64 << 20);
+  // no workers, nothing is compressed in the measured calls
+  CompressionPool compression(cache, 0);
+  CacheHandler handler(cache, compression, lw);
+  HttpParser hp;
+  std::string host, port;
+  CacheKey key;
+  volatile size_t sink = 0;
+
+  std::vector<CacheControl> directives;
+  std::vector<std::shared_ptr<CachedResponse> > entries;
+  for (const response_type & res : responses) {
+    directives.push_back(CacheControl::parse(res[http::field::cache_control]));
+    entries.push_back(hp.parse_response(res, directives.back()));
+    entries.back()->body = std::string(1024, 'x');
+  }
+  std::vector<size_t> response_index;
+  for (size_t i = 0; i < responses.size(); ++i) {
+    response_index.push_back(i);
+  }
+  // every request URL cached, lookups hit
+  std::vector<size_t> request_index;
+  std::vector<CacheKey> request_keys;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    request_index.push_back(i);
+    request_keys.emplace_back();
+    hp.get_cache_key(requests[i], request_keys.back());
+    handler.cache_response(request_keys.back(), entries[i % entries.size()]);
+  }
+
+  std::cout << "benchmark,ns_per_call\n";
+  std::cout << "HttpParser::get_server_name,"
+            << ns_per_call(requests,
+                           iterations,
+                           [&](const request_type & req) {
+                             hp.get_server_name(req, host, port);
+                             sink = sink + host.size();
+                           })
+            << std::endl;
+  std::cout << "HttpParser::get_cache_key,"
+            << ns_per_call(requests,
+                           iterations,
+                           [&](const request_type & req) {
+                             hp.get_cache_key(req, key);
+                             sink = sink + key.size();
+                           })
+            << std::endl;
+  std::cout << "HttpParser::parse_response,"
+            << ns_per_call(response_index,
+                           iterations,
+                           [&](size_t i) {
+                             const response_type & res = responses[i];
+                             CacheControl cc =
+                                 CacheControl::parse(res[http::field::cache_control]);
+                             sink = sink + hp.parse_response(res, cc)->status_code;
+                           })
+            << std::endl;
+  std::cout << "HttpParser::serialize_header,"
+            << ns_per_call(response_index,
+                           iterations / 4,
+                           [&](size_t i) {
+                             hp.serialize_header(*entries[i]);
+                             sink = sink + entries[i]->wire_header.size();
+                           })
+            << std::endl;
+  std::cout << "CacheHandler::lookup,"
+            << ns_per_call(request_index,
+                           iterations,
+                           [&](size_t i) {
+                             key = request_keys[i];
+                             sink = sink + (handler.lookup(key, requests[i]) != nullptr);
+                           })
+            << std::endl;
+  std::cout << "CacheHandler::can_be_cached,"
+            << ns_per_call(response_index,
+                           iterations,
+                           [&](size_t i) {
+                             bool cacheable =
+                                 handler.can_be_cached(responses[i], directives[i]);
+                             sink = sink + cacheable;
+                           })
+            << std::endl;
+  std::cout << "CacheHandler::cached_response_state,"
+            << ns_per_call(requests,
+                           iterations,
+                           [&](const request_type & req) {
+                             for (const auto & entry : entries) {
+                               auto state = handler.cached_response_state(*entry, req);
+                               sink = sink + static_cast<size_t>(state);
+                             }
+                           }) /
+                   entries.size()
+            << std::endl;
+
+  std::cout << "log_threads,lines_per_sec\n";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    std::cout << threads << ","
+              << static_cast<unsigned long long>(
+                     log_lines_per_sec(requests, responses, threads, iterations))
+              << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
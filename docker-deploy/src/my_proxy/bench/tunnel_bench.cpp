@@ -0,0 +1,129 @@
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../splice_relay.hpp"
+
+/**
+ * loopback throughput of one CONNECT tunnel direction:
+ * a source thread writes megabytes into the "client" side, the relay moves
+ * them to the "server" side on an io_context thread and a sink thread reads
+ * them until eof. the relay is either the session's user-space loop
+ * (async_read_some into an 8 KB array, then async_write) or SpliceRelay.
+ * usage: tunnel_bench [megabytes] [rounds]
+*/
+
+// the user-space relay of session::client_do_read / client_on_read
+class CopyRelay : public std::enable_shared_from_this<CopyRelay> {
+  strand_socket & from;
+  strand_socket & to;
+  std::array<uint8_t, 8192> buf;
+
+ public:
+  CopyRelay(strand_socket & from, strand_socket & to) : from(from), to(to) {}
+  void start() {
+    auto self = shared_from_this();
+    from.async_read_some(net::buffer(buf),
+                         [self](boost::system::error_code ec, std::size_t n) {
+                           if (ec) {
+                             self->to.shutdown(tcp::socket::shutdown_send, ec);
+                             return;
+                           }
+                           net::async_write(
+                               self->to,
+                               net::buffer(self->buf, n),
+                               [self](boost::system::error_code ec, std::size_t) {
+                                 if (!ec) {
+                                   self->start();
+                                 }
+                               });
+                         });
+  }
+};
+
+// seconds to push `bytes` through one relay of the given kind
+double run_tunnel(bool use_splice, size_t bytes) {
+  net::io_context ioc;
+  tcp::endpoint loopback(net::ip::make_address("127.0.0.1"), 0);
+  tcp::acceptor front(ioc, loopback);
+  tcp::acceptor back(ioc, loopback);
+
+  // source -> [client | relay | server] -> sink
+  tcp::socket source(ioc);
+  source.connect(front.local_endpoint());
+  strand_socket client = front.accept(net::make_strand(ioc));
+  strand_socket server(net::make_strand(ioc));
+  server.connect(back.local_endpoint());
+  tcp::socket sink = back.accept();
+
+  if (use_splice) {
+    SpliceRelay::DoneHandler done = [&server](boost::system::error_code) {
+      boost::system::error_code ignored;
+      server.shutdown(tcp::socket::shutdown_send, ignored);
+    };
+    auto relay =
+        SpliceRelay::create(client, server, Metrics::tunnel_bytes_upstream, done);
+    if (!relay) {
+      std::cerr << "splice relay not available" << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    relay->start();
+  }
+  else {
+    std::make_shared<CopyRelay>(client, server)->start();
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  std::thread writer([&] {
+    std::vector<char> chunk(64 * 1024, 'x');
+    size_t left = bytes;
+    while (left > 0) {
+      size_t n = std::min(left, chunk.size());
+      net::write(source, net::buffer(chunk.data(), n));
+      left -= n;
+    }
+    source.shutdown(tcp::socket::shutdown_send);
+  });
+  size_t received = 0;
+  std::thread reader([&] {
+    std::vector<char> chunk(64 * 1024);
+    boost::system::error_code ec;
+    while (!ec) {
+      received += sink.read_some(net::buffer(chunk), ec);
+    }
+  });
+  std::thread relay_thread([&ioc] { ioc.run(); });
+  writer.join();
+  reader.join();
+  auto end = std::chrono::steady_clock::now();
+  relay_thread.join();
+  if (received != bytes) {
+    std::cerr << "relay lost data: " << received << " of " << bytes << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char * argv[]) {
+  size_t megabytes = argc > 1 ? std::atoi(argv[1]) : 512;
+  int rounds = argc > 2 ? std::atoi(argv[2]) : 3;
+  size_t bytes = megabytes << 20;
+
+  std::cout << "relay,round,megabytes,seconds,mb_per_sec\n";
+  for (int round = 0; round < rounds; ++round) {
+    for (int use_splice = 0; use_splice < 2; ++use_splice) {
+      if (use_splice && !SpliceRelay::supported()) {
+        continue;
+      }
+      double secs = run_tunnel(use_splice, bytes);
+      std::cout << (use_splice ? "splice" : "copy") << "," << round << "," << megabytes
+                << "," << secs << "," << megabytes / secs << std::endl;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#include "buffer_pool.hpp"
+
+#include <vector>
+
+std::atomic<size_t> BufferPool::in_use{0};
+std::atomic<size_t> BufferPool::in_use_bytes{0};
+std::atomic<size_t> BufferPool::pooled{0};
+std::atomic<size_t> BufferPool::pooled_bytes{0};
+
+namespace {
+// 2 KB, 4 KB ... 64 KB
+const int num_classes = 6;
+
+int size_class(size_t size) {
+  int c = 0;
+  while (c < num_classes - 1 && (BufferPool::min_size << c) < size) {
+    ++c;
+  }
+  return c;
+}
+
+// free lists of the calling thread, emptied when the thread exits
+struct FreeLists {
+  std::vector<char *> lists[num_classes];
+  std::atomic<size_t> * pooled;
+  std::atomic<size_t> * pooled_bytes;
+  FreeLists(std::atomic<size_t> * pooled, std::atomic<size_t> * pooled_bytes) :
+      pooled(pooled), pooled_bytes(pooled_bytes) {}
+  ~FreeLists() {
+    for (int c = 0; c < num_classes; ++c) {
+      for (char * data : lists[c]) {
+        delete[] data;
+      }
+      pooled->fetch_sub(lists[c].size(), std::memory_order_relaxed);
+      pooled_bytes->fetch_sub(lists[c].size() * (BufferPool::min_size << c),
+                              std::memory_order_relaxed);
+    }
+  }
+};
+
+// the counters are private to BufferPool, the first call of a thread
+// passes them in
+FreeLists & local_free_lists(std::atomic<size_t> * pooled,
+                             std::atomic<size_t> * pooled_bytes) {
+  thread_local FreeLists free_lists(pooled, pooled_bytes);
+  return free_lists;
+}
+}  // namespace
+
+char * BufferPool::acquire(size_t & size) {
+  FreeLists & free_lists = local_free_lists(&pooled, &pooled_bytes);
+  int c = size_class(size);
+  size = min_size << c;
+  in_use.fetch_add(1, std::memory_order_relaxed);
+  in_use_bytes.fetch_add(size, std::memory_order_relaxed);
+  std::vector<char *> & list = free_lists.lists[c];
+  if (list.empty()) {
+    return new char[size];
+  }
+  char * data = list.back();
+  list.pop_back();
+  pooled.fetch_sub(1, std::memory_order_relaxed);
+  pooled_bytes.fetch_sub(size, std::memory_order_relaxed);
+  return data;
+}
+
+void BufferPool::release(char * data, size_t size) {
+  FreeLists & free_lists = local_free_lists(&pooled, &pooled_bytes);
+  in_use.fetch_sub(1, std::memory_order_relaxed);
+  in_use_bytes.fetch_sub(size, std::memory_order_relaxed);
+  std::vector<char *> & list = free_lists.lists[size_class(size)];
+  if (list.size() >= max_free) {
+    delete[] data;
+    return;
+  }
+  list.push_back(data);
+  pooled.fetch_add(1, std::memory_order_relaxed);
+  pooled_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+size_t BufferPool::next_size(size_t current, size_t filled) {
+  if (filled == current && current < max_size) {
+    return current * 2;
+  }
+  if (filled < current / 4 && current > min_size) {
+    return current / 2;
+  }
+  return current;
+}
+
+BufferPool::Stats BufferPool::stats() {
+  Stats s;
+  s.in_use = in_use.load(std::memory_order_relaxed);
+  s.in_use_bytes = in_use_bytes.load(std::memory_order_relaxed);
+  s.pooled = pooled.load(std::memory_order_relaxed);
+  s.pooled_bytes = pooled_bytes.load(std::memory_order_relaxed);
+  return s;
+}
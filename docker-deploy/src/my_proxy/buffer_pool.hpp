@@ -0,0 +1,74 @@
+#ifndef BUFFER_POOL
+#define BUFFER_POOL
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * relay buffers for the user-space tunnel relay and for relayed bodies,
+ * handed out only while data is moving.
+ * sizes are powers of two between min_size and max_size, released buffers
+ * wait in a free list of the releasing thread (a session hops between io
+ * threads, so that need not be the thread that acquired it). each thread
+ * keeps at most max_free buffers per size, the rest go back to the heap.
+*/
+class BufferPool {
+ public:
+  static const size_t min_size = 2 * 1024;
+  static const size_t max_size = 64 * 1024;
+  static const size_t max_free = 32;
+
+  struct Stats {
+    size_t in_use;  // buffers held by relays right now
+    size_t in_use_bytes;
+    size_t pooled;  // buffers waiting in free lists
+    size_t pooled_bytes;
+  };
+
+  // a buffer of at least `size` bytes (rounded up to a pool size)
+  static char * acquire(size_t & size);
+  static void release(char * data, size_t size);
+
+  // grow after a read that filled the buffer, shrink after a small one
+  static size_t next_size(size_t current, size_t filled);
+
+  static Stats stats();
+
+ private:
+  static std::atomic<size_t> in_use;
+  static std::atomic<size_t> in_use_bytes;
+  static std::atomic<size_t> pooled;
+  static std::atomic<size_t> pooled_bytes;
+};
+
+/**
+ * owns one pooled buffer, the buffer goes back to the pool on reset() or
+ * destruction
+*/
+class PooledBuffer {
+  char * data_{nullptr};
+  size_t size_{0};
+
+ public:
+  PooledBuffer() = default;
+  ~PooledBuffer() { reset(); }
+  PooledBuffer(const PooledBuffer &) = delete;
+  PooledBuffer & operator=(const PooledBuffer &) = delete;
+
+  void acquire(size_t size) {
+    reset();
+    size_ = size;
+    data_ = BufferPool::acquire(size_);
+  }
+  void reset() {
+    if (data_) {
+      BufferPool::release(data_, size_);
+      data_ = nullptr;
+      size_ = 0;
+    }
+  }
+  char * data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+#endif  //BUFFER_POOL
@@ -1,8 +1,30 @@
 #include "cache.hpp"
 
+#include <strings.h>
+
 bool CachedResponse::operator==(const CachedResponse & other) const {
-  return must_revalidate == other.must_revalidate && e_tag == other.e_tag &&
-         status_code == other.status_code && status_message == other.status_message &&
-         server == other.server && content_type == other.content_type &&
-         body == other.body && expiration_time == other.expiration_time;
+  return directives.must_revalidate == other.directives.must_revalidate &&
+         e_tag == other.e_tag && last_modified == other.last_modified &&
+         status_code == other.status_code &&
+         status_message == other.status_message && server == other.server &&
+         content_type == other.content_type &&
+         content_encoding == other.content_encoding && vary == other.vary &&
+         variant == other.variant && body == other.body &&
+         gzip_body == other.gzip_body &&
+         expiration_time == other.expiration_time;
+}
+
+
+size_t cache_charge(const CachedResponse & cr) {
+  return sizeof(CachedResponse) + cr.e_tag.size() + cr.last_modified.size() +
+         cr.status_message.size() +
+         cr.server.size() + cr.content_type.size() + cr.content_encoding.size() +
+         cr.vary.size() + cr.variant.size() + cr.body.size() +
+         cr.wire_header.size() + cr.gzip_body.size() + cr.gzip_wire_header.size();
+}
+
+bool CachedResponse::gzip_encoded() const {
+  // x-gzip is the old name of the same coding
+  return strcasecmp(content_encoding.c_str(), "gzip") == 0 ||
+         strcasecmp(content_encoding.c_str(), "x-gzip") == 0;
 }
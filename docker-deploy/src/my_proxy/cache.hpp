@@ -1,86 +1,492 @@
 #ifndef CACHE
 #define CACHE
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
+#include "cache_control.hpp"
+#include "frequency_sketch.hpp"
+#include "rw_lock.hpp"
+
 struct CachedResponse {
-  bool no_cache{false};
-  bool must_revalidate{false};
+  // the response's Cache-Control, parsed when the entry was built
+  CacheControl directives;
   std::string e_tag{""};
+  // the validators are sent back to the origin when the entry is revalidated
+  std::string last_modified{""};
   int status_code{0};
   std::string status_message{""};
   std::string server{""};
   std::string content_type{""};
+  // the coding of body as the origin sent it, empty for identity
+  std::string content_encoding{""};
+  // the request fields the response varies on, lowercased, sorted and comma
+  // separated. an entry without status is only a marker: it stands under the
+  // primary key of a URL whose responses are stored under secondary keys
+  std::string vary{""};
+  // the request's values of those fields (HttpParser::get_variant)
+  std::string variant{""};
   std::string body{""};
+  // status line and headers exactly as written to the client, so a hit is
+  // sent as wire_header + body without building a beast response
+  std::string wire_header{""};
+  // body gzipped by the proxy (CompressionPool) and its header, empty until
+  // the entry has been compressed, and for entries that are not worth it
+  std::string gzip_body{""};
+  std::string gzip_wire_header{""};
   std::chrono::steady_clock::time_point expiration_time;
 
-  std::chrono::steady_clock::time_point get_expiration_time() { return expiration_time; }
+  std::chrono::steady_clock::time_point get_expiration_time() const {
+    return expiration_time;
+  }
+  bool vary_marker() const { return status_code == 0; }
+  // body is gzip as received, clients not accepting that get it inflated
+  bool gzip_encoded() const;
   bool operator==(const CachedResponse & other) const;
   bool operator!=(const CachedResponse & other) const { return !(*this == other); }
 };
 
+/**
+ * entries are immutable once built and shared between the cache and every
+ * session writing them out, the memory goes away with the last reader
+*/
+typedef std::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+// bytes a cached response is charged against the cache capacity
+size_t cache_charge(const CachedResponse & cr);
+inline size_t cache_charge(const CachedResponsePtr & cr) {
+  return cr ? cache_charge(*cr) : 0;
+}
+
+struct CacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};
+  uint64_t rejections{0};  // candidates the admission filter turned away
+  size_t entries{0};
+  size_t bytes_used{0};
+  size_t capacity_bytes{0};
+
+  double hit_ratio() const {
+    return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+  }
+};
+
+/**
+ * a slower tier behind a Cache (see DiskCache). every entry put into the
+ * cache is stored there too, misses of the cache are looked up there.
+ * every call may come from any io thread and must not block on I/O. the
+ * stores and erases of one key arrive in the order the cache applied them
+*/
+template<typename K, typename V>
+class CacheTier {
+ public:
+  virtual ~CacheTier() {}
+  virtual void store(const K & key, const V & value) = 0;
+  // V() when the tier does not hold the key, a found entry is copied back
+  // into the cache and stays in the tier
+  virtual V load(const K & key) = 0;
+  virtual void erase(const K & key) = 0;
+};
+
 /**
  * this is a cahce implement LRU principle
- * response cache: let K be std::string, let V be CachedResponse
+ * response cache: let K be std::string, let V be CachedResponsePtr
+ *
+ * the cache is split into shards selected by key hash, each shard has its own
+ * lock, so threads working on different keys do not serialize on one mutex.
+ * capacity is a byte budget: every entry is charged key size plus
+ * cache_charge(value) plus a fixed bookkeeping overhead.
+ *
+ * each shard follows W-TinyLFU: new entries land in a small window (1% of the
+ * budget), entries pushed out of the window must beat the main region's
+ * victim in the frequency sketch to be admitted, so one-hit-wonders cannot
+ * flush frequently used entries.
+ * recency is tracked CLOCK style in both regions: a hit only sets the
+ * entry's referenced bit under the shard's shared lock, victim selection
+ * (under the exclusive lock) gives referenced entries a second chance.
+ *
+ * with a tier attached, the cache writes through: every put is stored in
+ * the tier as well (whether or not the cache keeps it), a remove erases it
+ * there, and a miss is looked up there and promoted. the tier is called
+ * after the shard lock is released: the writes are queued in the shard's
+ * outbox under the lock and handed over in that order under tier_mutex.
 */
 template<typename K, typename V>
 class Cache {
  private:
-  size_t capacity;
-  std::mutex cache_mutex;
-  std::unordered_map<K, std::pair<V, typename std::list<K>::iterator> > cache;
-  std::list<K> lru;
+  static const size_t entry_overhead = 96;
 
- public:
-  Cache(size_t capacity) : capacity(capacity) {}
-  void put(const K & key, const V & value) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
-    auto it = cache.find(key);
-    if (it != cache.end()) {
-      // Key already exists, update value and move to front of LRU list
-      lru.erase(it->second.second);
-      lru.push_front(key);
-      it->second = {value, lru.begin()};
+  struct Entry {
+    V value;
+    size_t hash;
+    size_t charge;
+    bool in_window;
+    // put without write-through, the tier gets it when it leaves the cache
+    bool unwritten{false};
+    typename std::list<K>::iterator pos;
+    std::atomic<bool> referenced;
+    Entry(const V & value, size_t hash, size_t charge, typename std::list<K>::iterator pos) :
+        value(value),
+        hash(hash),
+        charge(charge),
+        in_window(true),
+        pos(pos),
+        referenced(false) {}
+  };
+
+  typedef typename std::unordered_map<K, Entry>::iterator entry_iterator;
+
+  struct Shard {
+    RWLock shard_lock;
+    size_t window_capacity{0};
+    size_t main_capacity{0};
+    size_t window_bytes{0};
+    size_t main_bytes{0};
+    std::unordered_map<K, Entry> cache;
+    // front is the newest entry, back is where the clock hand points
+    std::list<K> window;
+    std::list<K> ring;
+    FrequencySketch sketch;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    uint64_t evictions{0};
+    uint64_t rejections{0};
+    // bumped by every insert and remove of the shard. a promotion
+    // racing one may carry an older copy, it is served but not cached
+    uint64_t updates{0};
+    // writes for the tier in the order they were made, V() erases the key.
+    // filled under the shard lock, drained under tier_mutex (draining keeps
+    // its capacity between rounds)
+    std::mutex outbox_mutex;
+    std::vector<std::pair<K, V> > outbox;
+    std::mutex tier_mutex;
+    std::vector<std::pair<K, V> > draining;
+    // keep neighbouring shards off the same cache line
+    char pad[64];
+  };
+
+  size_t num_shards;
+  size_t capacity_bytes;
+  std::unique_ptr<Shard[]> shards;
+  CacheTier<K, V> * tier{nullptr};
+
+  static size_t mix(size_t h) {
+    // the shard index and the bucket index use the same hash, mix high bits in
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    return h;
+  }
+
+  // the low bits index the frequency sketch, pick the shard from the high half
+  Shard & shard_for(size_t hash) {
+    return shards[(hash >> (sizeof(size_t) * 4)) % num_shards];
+  }
+
+  // caller holds the shard's exclusive lock for all of the helpers below
+  entry_iterator select_victim(Shard & shard, std::list<K> & order) {
+    while (true) {
+      auto it = shard.cache.find(order.back());
+      if (!it->second.referenced.exchange(false, std::memory_order_relaxed)) {
+        return it;
+      }
+      // Referenced since the hand last passed, give it a second chance
+      order.splice(order.begin(), order, it->second.pos);
+    }
+  }
+
+  // forget an entry the cache has no room for, one the tier has not been
+  // given yet is queued for it
+  void drop(Shard & shard, entry_iterator it) {
+    if (it->second.unwritten) {
+      queue_for_tier(shard, it->first, it->second.value);
+    }
+    shard.cache.erase(it);
+  }
+
+  // push a victim out of the main region
+  void evict(Shard & shard, entry_iterator victim) {
+    shard.ring.erase(victim->second.pos);
+    shard.main_bytes -= victim->second.charge;
+    drop(shard, victim);
+    ++shard.evictions;
+  }
+
+  void unlink(Shard & shard, entry_iterator it) {
+    if (it->second.in_window) {
+      shard.window.erase(it->second.pos);
+      shard.window_bytes -= it->second.charge;
+    }
+    else {
+      shard.ring.erase(it->second.pos);
+      shard.main_bytes -= it->second.charge;
+    }
+    shard.cache.erase(it);
+  }
+
+  // move an entry that fell out of the window into the main region, or drop it
+  void admit(Shard & shard, entry_iterator cand) {
+    shard.window.erase(cand->second.pos);
+    shard.window_bytes -= cand->second.charge;
+    if (cand->second.charge > shard.main_capacity) {
+      drop(shard, cand);
+      ++shard.rejections;
+      return;
+    }
+    uint8_t cand_freq = shard.sketch.frequency(cand->second.hash);
+    while (shard.main_bytes + cand->second.charge > shard.main_capacity) {
+      entry_iterator victim = select_victim(shard, shard.ring);
+      if (shard.sketch.frequency(victim->second.hash) >= cand_freq) {
+        drop(shard, cand);
+        ++shard.rejections;
+        return;
+      }
+      evict(shard, victim);
+    }
+    shard.ring.push_front(cand->first);
+    cand->second.pos = shard.ring.begin();
+    cand->second.in_window = false;
+    shard.main_bytes += cand->second.charge;
+  }
+
+  // unwritten: the tier has not been given value, it is when value leaves
+  void insert(
+      Shard & shard, const K & key, const V & value, size_t hash, bool unwritten) {
+    ++shard.updates;
+    size_t charge = key.size() + cache_charge(value) + entry_overhead;
+    auto it = shard.cache.find(key);
+    if (charge > shard.window_capacity + shard.main_capacity) {
+      // Bigger than the whole shard, never cache it (and drop a stale copy)
+      if (it != shard.cache.end()) {
+        unlink(shard, it);
+      }
+      ++shard.rejections;
+      if (unwritten) {
+        queue_for_tier(shard, key, value);
+      }
+      return;
+    }
+    if (it != shard.cache.end()) {
+      // Key already exists, update value and mark it recently used
+      size_t & used = it->second.in_window ? shard.window_bytes : shard.main_bytes;
+      used = used - it->second.charge + charge;
+      it->second.value = value;
+      it->second.charge = charge;
+      it->second.unwritten = unwritten;
+      it->second.referenced.store(true, std::memory_order_relaxed);
     }
     else {
-      // Key does not exist, add to cache and front of LRU list
-      if (cache.size() == capacity) {
-        // Cache is full, remove least recently used item
-        cache.erase(lru.back());
-        lru.pop_back();
+      // Key does not exist, add to the front of the window
+      shard.window.push_front(key);
+      it = shard.cache
+               .emplace(std::piecewise_construct,
+                        std::forward_as_tuple(key),
+                        std::forward_as_tuple(value, hash, charge, shard.window.begin()))
+               .first;
+      it->second.unwritten = unwritten;
+      shard.window_bytes += charge;
+    }
+    rebalance(shard);
+  }
+
+  void rebalance(Shard & shard) {
+    while (shard.window_bytes > shard.window_capacity) {
+      admit(shard, select_victim(shard, shard.window));
+    }
+    // an entry updated in place may have grown past the main budget
+    while (shard.main_bytes > shard.main_capacity) {
+      evict(shard, select_victim(shard, shard.ring));
+    }
+  }
+
+  // caller holds the shard's exclusive lock
+  void queue_for_tier(Shard & shard, const K & key, const V & value) {
+    std::lock_guard<std::mutex> lock(shard.outbox_mutex);
+    shard.outbox.emplace_back(key, value);
+  }
+
+  // hand the queued writes to the tier, without the shard lock. a caller
+  // finding the outbox drained already had its write applied by another
+  void flush_to_tier(Shard & shard) {
+    if (tier == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> order(shard.tier_mutex);
+    {
+      std::lock_guard<std::mutex> lock(shard.outbox_mutex);
+      shard.draining.swap(shard.outbox);
+    }
+    for (auto & write : shard.draining) {
+      if (write.second == V()) {
+        tier->erase(write.first);
+      }
+      else {
+        tier->store(write.first, write.second);
+      }
+    }
+    shard.draining.clear();
+  }
+
+  // cache what the tier found on a miss, unless the key got a value or was
+  // removed since: that is newer than the tier's copy, which stays out
+  V promote(const K & key, const V & value, size_t hash, uint64_t updates) {
+    Shard & shard = shard_for(hash);
+    {
+      std::lock_guard<RWLock> lock(shard.shard_lock);
+      auto it = shard.cache.find(key);
+      if (it != shard.cache.end()) {
+        return it->second.value;
       }
-      lru.push_front(key);
-      cache[key] = {value, lru.begin()};
+      if (shard.updates != updates) {
+        return value;
+      }
+      insert(shard, key, value, hash, false);
+    }
+    // what the promotion pushed out
+    flush_to_tier(shard);
+    return value;
+  }
+
+ public:
+  Cache(size_t capacity_bytes, size_t num_shards = 16) :
+      num_shards(std::max<size_t>(1, num_shards)),
+      capacity_bytes(capacity_bytes),
+      shards(new Shard[this->num_shards]) {
+    size_t per_shard = std::max<size_t>(1, capacity_bytes / this->num_shards);
+    for (size_t i = 0; i < this->num_shards; ++i) {
+      Shard & shard = shards[i];
+      shard.window_capacity = std::max<size_t>(1, per_shard / 100);
+      shard.main_capacity = per_shard - std::min(per_shard, shard.window_capacity);
+      // size the sketch for roughly one counter per 1 KB of budget
+      shard.sketch.resize(per_shard / 1024);
     }
   }
 
+  // attach the tier before the cache is used, it has to outlive the cache
+  void set_tier(CacheTier<K, V> * tier) { this->tier = tier; }
+
+  void put(const K & key, const V & value) { put(key, value, true); }
+
+  // write_through false holds the entry back from the tier until a
+  // replace() writes it through or the cache lets go of it, for a caller
+  // about to replace it
+  void put(const K & key, const V & value, bool write_through) {
+    size_t hash = mix(std::hash<K>()(key));
+    Shard & shard = shard_for(hash);
+    {
+      std::lock_guard<RWLock> lock(shard.shard_lock);
+      if (write_through && tier != nullptr) {
+        queue_for_tier(shard, key, value);
+      }
+      insert(shard, key, value, hash, !write_through && tier != nullptr);
+    }
+    flush_to_tier(shard);
+  }
+
   V get(const K & key) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
-    auto it = cache.find(key);
-    if (it != cache.end()) {
-      // Key found, move to front of LRU list and return value
-      lru.erase(it->second.second);
-      lru.push_front(key);
-      it->second.second = lru.begin();
-      return it->second.first;
+    size_t hash = mix(std::hash<K>()(key));
+    Shard & shard = shard_for(hash);
+    // every lookup counts towards the key's popularity, hit or miss
+    shard.sketch.increment(hash);
+    uint64_t updates;
+    {
+      SharedLockGuard lock(shard.shard_lock);
+      auto it = shard.cache.find(key);
+      if (it != shard.cache.end()) {
+        // Key found, set the referenced bit (skip the store if already set so
+        // hot entries do not bounce their cache line between readers)
+        std::atomic<bool> & ref = it->second.referenced;
+        if (!ref.load(std::memory_order_relaxed)) {
+          ref.store(true, std::memory_order_relaxed);
+        }
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second.value;
+      }
+      updates = shard.updates;
+    }
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+    if (tier != nullptr) {
+      // promote what the tier has, it comes back through the window (and
+      // is not written to the tier again)
+      V value = tier->load(key);
+      if (!(value == V())) {
+        return promote(key, value, hash, updates);
+      }
+      return value;
     }
     // Key not found, return default value
     return V();
   }
 
-  void remove(K key) {
-    // Assume we want to remove the element with key "key_to_remove"
-    auto it = cache.find(key);
-    if (it != cache.end()) {
-      // Erase the corresponding list iterator from the LRU list
-      lru.erase(it->second.second);
-      // Erase the element from the cache map
-      cache.erase(it);
+  // put value under key only while key still holds expected, for updates
+  // computed off a copy of an entry that may have been replaced meanwhile
+  bool replace(const K & key, const V & expected, const V & value) {
+    size_t hash = mix(std::hash<K>()(key));
+    Shard & shard = shard_for(hash);
+    {
+      std::lock_guard<RWLock> lock(shard.shard_lock);
+      auto it = shard.cache.find(key);
+      if (it == shard.cache.end() || !(it->second.value == expected)) {
+        return false;
+      }
+      if (tier != nullptr) {
+        queue_for_tier(shard, key, value);
+      }
+      insert(shard, key, value, hash, false);
+    }
+    flush_to_tier(shard);
+    return true;
+  }
+
+  void remove(const K & key) {
+    Shard & shard = shard_for(mix(std::hash<K>()(key)));
+    {
+      std::lock_guard<RWLock> lock(shard.shard_lock);
+      auto it = shard.cache.find(key);
+      if (it != shard.cache.end()) {
+        unlink(shard, it);
+      }
+      ++shard.updates;
+      if (tier != nullptr) {
+        queue_for_tier(shard, key, V());
+      }
+    }
+    flush_to_tier(shard);
+  }
+
+  size_t size() { return stats().entries; }
+
+  // put() turns away anything charged more than this
+  size_t max_entry_bytes() const {
+    return shards[0].window_capacity + shards[0].main_capacity - entry_overhead;
+  }
+
+  CacheStats stats() {
+    CacheStats st;
+    st.capacity_bytes = capacity_bytes;
+    for (size_t i = 0; i < num_shards; ++i) {
+      Shard & shard = shards[i];
+      SharedLockGuard lock(shard.shard_lock);
+      st.hits += shard.hits.load(std::memory_order_relaxed);
+      st.misses += shard.misses.load(std::memory_order_relaxed);
+      st.evictions += shard.evictions;
+      st.rejections += shard.rejections;
+      st.entries += shard.cache.size();
+      st.bytes_used += shard.window_bytes + shard.main_bytes;
     }
+    return st;
   }
 };
 
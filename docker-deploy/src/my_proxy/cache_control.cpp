@@ -0,0 +1,104 @@
+#include "cache_control.hpp"
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+
+const int32_t CacheControl::max_delta;
+
+beast::string_view trim(beast::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+namespace {
+// delta-seconds, -1 if arg is not a number
+int32_t parse_delta(beast::string_view arg) {
+  if (arg.empty()) {
+    return -1;
+  }
+  int64_t value = 0;
+  for (char c : arg) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    value = value * 10 + (c - '0');
+    if (value > CacheControl::max_delta) {
+      value = CacheControl::max_delta;
+    }
+  }
+  return static_cast<int32_t>(value);
+}
+
+void apply(CacheControl & cc, beast::string_view directive) {
+  beast::string_view name = directive;
+  beast::string_view arg;
+  bool has_arg = false;
+  size_t eq = directive.find('=');
+  if (eq != beast::string_view::npos) {
+    name = trim(directive.substr(0, eq));
+    arg = trim(directive.substr(eq + 1));
+    has_arg = true;
+    if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"') {
+      arg = arg.substr(1, arg.size() - 2);
+    }
+  }
+  if (beast::iequals(name, "max-age")) {
+    int32_t delta = parse_delta(arg);
+    cc.max_age = delta < 0 ? 0 : delta;
+  }
+  else if (beast::iequals(name, "no-store")) {
+    cc.no_store = true;
+  }
+  else if (beast::iequals(name, "no-cache")) {
+    // a field list (no-cache="Set-Cookie") is treated like plain no-cache
+    cc.no_cache = true;
+  }
+  else if (beast::iequals(name, "private")) {
+    cc.is_private = true;
+  }
+  else if (beast::iequals(name, "must-revalidate")) {
+    cc.must_revalidate = true;
+  }
+  else if (beast::iequals(name, "max-stale")) {
+    cc.max_stale = has_arg ? parse_delta(arg) : CacheControl::max_delta;
+  }
+  else if (beast::iequals(name, "min-fresh")) {
+    cc.min_fresh = parse_delta(arg);
+  }
+  else if (beast::iequals(name, "stale-while-revalidate")) {
+    cc.stale_while_revalidate = parse_delta(arg);
+  }
+  else if (beast::iequals(name, "stale-if-error")) {
+    cc.stale_if_error = parse_delta(arg);
+  }
+}
+}  // namespace
+
+CacheControl CacheControl::parse(beast::string_view value) {
+  CacheControl cc;
+  const char * p = value.data();
+  const char * end = p + value.size();
+  while (p < end) {
+    // one directive runs up to the next comma outside a quoted string
+    const char * start = p;
+    bool quoted = false;
+    for (; p < end && (quoted || *p != ','); ++p) {
+      if (*p == '"') {
+        quoted = !quoted;
+      }
+      else if (*p == '\\' && quoted && p + 1 < end) {
+        ++p;
+      }
+    }
+    beast::string_view directive = trim(beast::string_view(start, p - start));
+    if (!directive.empty()) {
+      apply(cc, directive);
+    }
+    ++p;
+  }
+  return cc;
+}
@@ -0,0 +1,42 @@
+#ifndef CACHE_CONTROL
+#define CACHE_CONTROL
+
+#include <boost/beast/core/string.hpp>
+
+#include <cstdint>
+
+/**
+ * the directives of one Cache-Control value (request or response), read in
+ * a single pass over the header without copying it.
+ * directive names are case-insensitive and may be surrounded by whitespace,
+ * arguments may be quoted. delta-seconds are -1 when absent and saturate at
+ * max_delta, an unparsable max-age counts as 0 (stale). a bare max-stale
+ * accepts any staleness. stale-while-revalidate and stale-if-error are the
+ * RFC 5861 extensions.
+*/
+struct CacheControl {
+  static const int32_t max_delta = INT32_MAX;
+
+  bool no_store{false};
+  bool no_cache{false};
+  bool is_private{false};
+  bool must_revalidate{false};
+  int32_t max_age{-1};
+  int32_t max_stale{-1};
+  int32_t min_fresh{-1};
+  // how long past expiry a response may be served while it is refreshed
+  int32_t stale_while_revalidate{-1};
+  // how long past expiry a response may be served when the origin fails
+  int32_t stale_if_error{-1};
+
+  static CacheControl parse(boost::beast::string_view value);
+};
+
+// s without leading and trailing spaces and tabs (optional whitespace)
+boost::beast::string_view trim(boost::beast::string_view s);
+
+// what a cached entry is good for, given the request asking for it. stale:
+// expired, but may be served while it is refreshed in the background
+enum class Freshness { valid, stale, expired, must_revalidate };
+
+#endif  //CACHE_CONTROL
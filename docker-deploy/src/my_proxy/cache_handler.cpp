@@ -1,157 +1,238 @@
 #include "cache_handler.hpp"
 
-void CacheHandler::cache_response(std::string cache_key, CachedResponse cache_value) {
-  http_cache.put(cache_key, cache_value);
+#include <algorithm>
+#include <ctime>
+
+#include "http_parser.hpp"
+
+namespace {
+// past its expiry, still servable while it is refreshed if the response
+// allows that
+Freshness expired_state(const CachedResponse & cr) {
+  int32_t window = cr.directives.stale_while_revalidate;
+  auto past_expiry = std::chrono::steady_clock::now() - cr.expiration_time;
+  if (window >= 0 && past_expiry < std::chrono::seconds(window)) {
+    return Freshness::stale;
+  }
+  return Freshness::expired;
+}
+
+// the opaque part of an entity tag, weak and strong tags compare alike
+beast::string_view opaque_tag(beast::string_view tag) {
+  if (tag.starts_with("W/")) {
+    tag.remove_prefix(2);
+  }
+  return tag;
+}
+
+// Vary: * says the request alone never decides the response
+bool varies_on_everything(const http::response_header<ArenaFields> & resp) {
+  for (auto range = resp.equal_range(http::field::vary); range.first != range.second;
+       ++range.first) {
+    beast::string_view list = range.first->value();
+    while (!list.empty()) {
+      size_t comma = std::min(list.find(','), list.size());
+      if (trim(list.substr(0, comma)) == "*") {
+        return true;
+      }
+      list.remove_prefix(std::min(comma + 1, list.size()));
+    }
+  }
+  return false;
+}
+
+// IMF-fixdate, the only format senders may generate, false for others
+bool parse_http_date(beast::string_view value, std::time_t & out) {
+  std::string text(value);
+  std::tm tm = {};
+  const char * end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == nullptr || *end != '\0') {
+    return false;
+  }
+  out = timegm(&tm);
+  return true;
 }
+}  // namespace
 
-CachedResponse CacheHandler::get(std::string key) {
+void CacheHandler::cache_response(const CacheKey & cache_key,
+                                  CachedResponsePtr cache_value) {
+  CacheKey primary = cache_key.primary();
+  if (cache_value->vary.empty()) {
+    // the URL does not vary (any more), its one entry replaces a marker
+    compression_.put(primary, cache_value);
+    return;
+  }
+  std::shared_ptr<CachedResponse> marker = std::make_shared<CachedResponse>();
+  marker->vary = cache_value->vary;
+  marker->expiration_time = cache_value->expiration_time;
+  http_cache.put(primary, marker);
+  CacheKey variant = primary.variant(cache_value->variant);
+  compression_.put(variant, cache_value);
+}
+
+CachedResponsePtr CacheHandler::get(const CacheKey & key) {
+  return http_cache.get(key);
+}
+
+CachedResponsePtr CacheHandler::lookup(CacheKey & key,
+                                       const http::request_header<ArenaFields> & req) {
+  CachedResponsePtr entry = http_cache.get(key);
+  if (!entry || !entry->vary_marker()) {
+    return entry;
+  }
+  std::string values;
+  HttpParser::get_variant(entry->vary, req, values);
+  key = key.variant(values);
   return http_cache.get(key);
 }
 
-void CacheHandler::remove(std::string key) {
+void CacheHandler::remove(const CacheKey & key) {
   http_cache.remove(key);
 }
 
-bool CacheHandler::can_be_cached(const http::response<http::string_body> & resp) {
+bool CacheHandler::can_be_cached(const http::response_header<ArenaFields> & resp,
+                                 const CacheControl & directives) {
   // log: ID: not cacheable because REASON
   // ID: cached, expires at EXPIRES
   // ID: cached, but requires re-validation
-  const auto & headers = resp.base();
-  if (resp.chunked() == true) {
-    lw_.log_not_cacheable("response.chunked() = true");
+  // chunked bodies are reassembled while they are relayed, so they cache too
+  // Check if the response has a Cache-Control header
+  if (resp.find(http::field::cache_control) == resp.end()) {
     return false;
   }
-  // Check if the response has a Cache-Control header
-  if (headers.find(boost::beast::http::field::cache_control) != headers.end()) {
-    // Get the value of the Cache-Control header
-    const auto & cache_control = headers[boost::beast::http::field::cache_control];
-    // Split the value of the Cache-Control header into individual directives
-    std::vector<std::string> directives;
-    boost::split(directives, std::string(cache_control), boost::is_any_of(","));
-    // Find the max-age directive in the Cache-Control header
-    auto it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return directive == "no-store";
-        });
-    if (it != directives.end()) {
-      // The response has the must-revalidate directive
-      lw_.log_not_cacheable("no-store in the header");
-      return false;
-    }
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return directive == "private";
-        });
-    if (it != directives.end()) {
-      // The response has the must-revalidate directive
-      lw_.log_not_cacheable("private in the header");
-      return false;
-    }
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return directive == "no-cache";
-        });
-    if (it != directives.end()) {
-      // The response has the must-revalidate directive
-      lw_.log_cached_with_revalidation();
-      return true;
-    }
-    std::chrono::steady_clock::time_point expiration_time;
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return boost::starts_with(directive, "max-age=");
-        });
-    if (it != directives.end()) {
-      // Get the value of the max-age directive
-      std::string max_age_str = it->substr(std::string("max-age=").size());
-      int max_age_sec = std::stoi(max_age_str);
-
-      // Calculate the maximum age in seconds
-      std::chrono::seconds max_age(max_age_sec);
-
-      // Calculate the expiration time of the response
-      expiration_time = std::chrono::steady_clock::now() + max_age;
-    }
-    lw_.log_cached_with_expire_time(expiration_time);
-    return true;
+  if (directives.no_store) {
+    lw_.log_not_cacheable("no-store in the header");
+    return false;
   }
-  else {
+  if (directives.is_private) {
+    lw_.log_not_cacheable("private in the header");
+    return false;
+  }
+  if (varies_on_everything(resp)) {
+    lw_.log_not_cacheable("Vary: * in the header");
     return false;
   }
+  if (directives.no_cache) {
+    lw_.log_cached_with_revalidation();
+    return true;
+  }
+  std::chrono::steady_clock::time_point expiration_time;
+  if (directives.max_age != -1) {
+    expiration_time =
+        std::chrono::steady_clock::now() + std::chrono::seconds(directives.max_age);
+  }
+  lw_.log_cached_with_expire_time(expiration_time);
+  return true;
 }
 
-CachedResponse CacheHandler::get_cached_response(std::string cache_key) {
-  CachedResponse cache_value = get(cache_key);
+CachedResponsePtr CacheHandler::get_cached_response(const CacheKey & cache_key) {
+  CachedResponsePtr cache_value = get(cache_key);
   return cache_value;
 }
 
-std::string CacheHandler::cached_response_state(
+Freshness CacheHandler::cached_response_state(
     const CachedResponse & cr,
-    const http::request<http::string_body> & req) {
-  if (cr.no_cache == true) {
-    return "must-revalidate";
+    const http::request_header<ArenaFields> & req) {
+  if (cr.directives.no_cache) {
+    return Freshness::must_revalidate;
   }
-  if (cr.must_revalidate == true &&
+  if (cr.directives.must_revalidate &&
       std::chrono::steady_clock::now() > cr.expiration_time) {
-    return "must-revalidate";
-  }
-
-  int min_fresh_sec = -1;
-  int max_stale_sec = -1;
-  //get the time
-  const auto & headers = req.base();
-  const auto & cache_control = headers[boost::beast::http::field::cache_control];
-  // Split the value of the Cache-Control header into individual directives
-  std::vector<std::string> directives;
-  boost::split(directives, std::string(cache_control), boost::is_any_of(","));
-  // Find the min-fresh directive in the Cache-Control header
-  auto it = std::find_if(
-      directives.begin(), directives.end(), [](const std::string & directive) {
-        return boost::starts_with(directive, "min-fresh=");
-      });
-  if (it != directives.end()) {
-    // Get the value of the max-age directive
-    std::string min_fresh_str = it->substr(std::string("min-fresh=").size());
-    min_fresh_sec = std::stoi(min_fresh_str);
-  }
-  // Find the max-stale directive in the Cache-Control header
-  it = std::find_if(
-      directives.begin(), directives.end(), [](const std::string & directive) {
-        return boost::starts_with(directive, "max-stale=");
-      });
-  if (it != directives.end()) {
-    // Get the value of the max-age directive
-    std::string max_stale_str = it->substr(std::string("max-stale=").size());
-    max_stale_sec = std::stoi(max_stale_str);
+    return Freshness::must_revalidate;
   }
 
+  // most requests carry no Cache-Control, parsing an empty value is free
+  CacheControl request = CacheControl::parse(req[http::field::cache_control]);
+  int min_fresh_sec = request.min_fresh;
+  int max_stale_sec = request.max_stale;
+
   if (min_fresh_sec != -1) {
     if (cr.expiration_time - std::chrono::steady_clock::now() >
         std::chrono::seconds(min_fresh_sec)) {
-      return "valid";
+      return Freshness::valid;
     }
     else {
       if (cr.expiration_time > std::chrono::steady_clock::now()) {
-        return "must-revalidate";
+        return Freshness::must_revalidate;
       }
       else {
-        return "expired";
+        return expired_state(cr);
       }
     }
   }
   if (max_stale_sec != -1) {
     if (std::chrono::steady_clock::now() - cr.expiration_time <
         std::chrono::seconds(max_stale_sec)) {
-      return "valid";
+      return Freshness::valid;
     }
     else {
-      return "expired";
+      return expired_state(cr);
     }
   }
   if (cr.expiration_time > std::chrono::steady_clock::now()) {
-    return "valid";
+    return Freshness::valid;
   }
   else {
-    return "expired";
+    return expired_state(cr);
+  }
+}
+
+bool CacheHandler::usable_on_error(const CachedResponse & cr,
+                                   const http::request_header<ArenaFields> & req) {
+  // must-revalidate forbids serving the entry stale, for any reason
+  if (cr.directives.must_revalidate || cr.directives.no_cache) {
+    return false;
+  }
+  int32_t window = cr.directives.stale_if_error;
+  auto field = req.find(http::field::cache_control);
+  if (field != req.end()) {
+    window = std::max(window, CacheControl::parse(field->value()).stale_if_error);
+  }
+  auto past_expiry = std::chrono::steady_clock::now() - cr.expiration_time;
+  return window >= 0 && past_expiry < std::chrono::seconds(window);
+}
+
+bool CacheHandler::not_modified(const CachedResponse & cr,
+                                beast::string_view if_none_match,
+                                beast::string_view if_modified_since) {
+  if (!if_none_match.empty()) {
+    if (trim(if_none_match) == "*") {
+      return true;
+    }
+    if (cr.e_tag.empty()) {
+      return false;
+    }
+    beast::string_view ours = opaque_tag(cr.e_tag);
+    // tags are quoted and contain no commas
+    while (!if_none_match.empty()) {
+      size_t comma = std::min(if_none_match.find(','), if_none_match.size());
+      if (opaque_tag(trim(if_none_match.substr(0, comma))) == ours) {
+        return true;
+      }
+      if_none_match.remove_prefix(std::min(comma + 1, if_none_match.size()));
+    }
+    return false;
   }
-}
\ No newline at end of file
+  std::time_t since;
+  std::time_t modified;
+  return !if_modified_since.empty() && !cr.last_modified.empty() &&
+         parse_http_date(if_modified_since, since) &&
+         parse_http_date(cr.last_modified, modified) && modified <= since;
+}
+
+bool CacheHandler::range_validates(const CachedResponse & cr,
+                                   beast::string_view if_range) {
+  if_range = trim(if_range);
+  if (if_range.empty()) {
+    return true;
+  }
+  if (if_range.front() == '"' || if_range.starts_with("W/")) {
+    // a weak tag never matches, the bytes behind it may differ
+    return !cr.e_tag.empty() && !beast::string_view(cr.e_tag).starts_with("W/") &&
+           if_range == cr.e_tag;
+  }
+  std::time_t date;
+  std::time_t modified;
+  return !cr.last_modified.empty() && parse_http_date(if_range, date) &&
+         parse_http_date(cr.last_modified, modified) && modified == date;
+}
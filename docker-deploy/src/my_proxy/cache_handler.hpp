@@ -1,34 +1,83 @@
 #ifndef CACHE_HANDLER
 #define CACHE_HANDLER
 
-#include <boost/algorithm/string.hpp>
 #include <boost/beast.hpp>
 
+#include "arena.hpp"
 #include "cache.hpp"
+#include "cache_control.hpp"
+#include "cache_key.hpp"
+#include "compression.hpp"
 #include "log_writer.hpp"
 
 namespace beast = boost::beast;  // from <boost/beast.hpp>
 namespace http = beast::http;    // from <boost/beast/http.hpp>
 class CacheHandler {
-  Cache<std::string, CachedResponse> & http_cache;
+  Cache<CacheKey, CachedResponsePtr> & http_cache;
+  CompressionPool & compression_;
   LogWriter & lw_;
 
  public:
-  explicit CacheHandler(Cache<std::string, CachedResponse> & cache, LogWriter & lw) :
-      http_cache(cache), lw_(lw) {}
+  CacheHandler(Cache<CacheKey, CachedResponsePtr> & cache,
+               CompressionPool & compression,
+               LogWriter & lw) :
+      http_cache(cache), compression_(compression), lw_(lw) {}
 
-  void cache_response(std::string cache_key, CachedResponse cache_value);
+  // under the entry's secondary key when it varies, a marker naming the
+  // fields goes under the primary key then. cache_key may be either.
+  // the entry is queued for gzip, a copy with both bodies replaces it later
+  void cache_response(const CacheKey & cache_key, CachedResponsePtr cache_value);
 
-  CachedResponse get(std::string key);
+  CachedResponsePtr get(const CacheKey & key);
 
-  void remove(std::string key);
+  /**
+   * the entry for req, key being the primary key of its URL. when the URL's
+   * responses vary, key becomes the secondary key of req's variant and the
+   * variant stored under it (or null) is returned
+  */
+  CachedResponsePtr lookup(CacheKey & key, const http::request_header<ArenaFields> & req);
 
-  bool can_be_cached(const http::response<http::string_body> & resp);
+  void remove(const CacheKey & key);
 
-  std::string cached_response_state(const CachedResponse & cr,
-                                    const http::request<http::string_body> & req);
+  // decided on the header alone, the body is still being streamed.
+  // directives is the response's parsed Cache-Control
+  bool can_be_cached(const http::response_header<ArenaFields> & resp,
+                     const CacheControl & directives);
 
-  CachedResponse get_cached_response(std::string cache_key);
+  /**
+   * the client's copy is the entry (RFC 9110 13.1): one of the tags in
+   * if_none_match matches the entry's weakly, or, without If-None-Match,
+   * the entry was not modified after if_modified_since. the values are the
+   * client's header fields, empty when absent
+  */
+  static bool not_modified(const CachedResponse & cr,
+                           beast::string_view if_none_match,
+                           beast::string_view if_modified_since);
+
+  /**
+   * the client's If-Range still names the entry, so its ranges may be
+   * served (RFC 9110 13.1.5): an entity tag equal to the entry's by the
+   * strong comparison, or a date equal to its Last-Modified. true without
+   * If-Range, if_range being empty then
+  */
+  static bool range_validates(const CachedResponse & cr, beast::string_view if_range);
+
+  Cache<CacheKey, CachedResponsePtr> & cache() { return http_cache; }
+
+  CompressionPool & compression() { return compression_; }
+
+  // largest entry the cache would accept at all
+  size_t max_entry_bytes() const { return http_cache.max_entry_bytes(); }
+
+  Freshness cached_response_state(const CachedResponse & cr,
+                                  const http::request_header<ArenaFields> & req);
+
+  // the entry may stand in for an origin that failed (stale-if-error of the
+  // response or of the request)
+  bool usable_on_error(const CachedResponse & cr,
+                       const http::request_header<ArenaFields> & req);
+
+  CachedResponsePtr get_cached_response(const CacheKey & cache_key);
 };
 
 #endif  // CACHE_HANDLER
\ No newline at end of file
@@ -0,0 +1,33 @@
+#include "cache_key.hpp"
+
+#include <algorithm>
+
+CacheKey::CacheKey(const std::string & text) : text_(text) {
+  primary_size_ = std::min(text_.find('\n'), text_.size());
+  hash_ = hash_bytes(text_.data(), text_.size());
+}
+
+void CacheKey::seal() {
+  primary_size_ = text_.size();
+  hash_ = hash_bytes(text_.data(), text_.size());
+}
+
+CacheKey CacheKey::variant(const std::string & values) const {
+  CacheKey key = primary();
+  key.text_.reserve(key.text_.size() + 1 + values.size());
+  key.text_ += '\n';
+  key.text_ += values;
+  // FNV-1a goes byte by byte, the primary key's hash is carried on
+  key.hash_ = hash_bytes(values.data(), values.size(), hash_bytes("\n", 1, key.hash_));
+  return key;
+}
+
+CacheKey CacheKey::primary() const {
+  if (!is_variant()) {
+    return *this;
+  }
+  CacheKey key;
+  key.text_.assign(text_, 0, primary_size_);
+  key.seal();
+  return key;
+}
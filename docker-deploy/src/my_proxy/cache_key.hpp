@@ -0,0 +1,72 @@
+#ifndef CACHE_KEY
+#define CACHE_KEY
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/**
+ * key of a cache entry. the primary key is the method and the normalized
+ * URL (see HttpParser::get_cache_key). a response with Vary is stored under
+ * a secondary key: the primary key, '\n', and the request's values of the
+ * varying fields (see HttpParser::get_variant).
+ * the 64-bit FNV-1a hash of the text is computed once, when the key is
+ * built, and every table the key goes into uses it as is. it does not
+ * depend on the build, the disk tier keeps it
+*/
+class CacheKey {
+  std::string text_;
+  size_t primary_size_{0};
+  uint64_t hash_{0};
+
+ public:
+  static const uint64_t hash_seed = 0xcbf29ce484222325ULL;
+
+  static uint64_t hash_bytes(const char * data, size_t size, uint64_t h = hash_seed) {
+    for (size_t i = 0; i < size; ++i) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  CacheKey() : hash_(hash_seed) {}
+  // a key as str() returned it, the secondary part starts at the first '\n'
+  explicit CacheKey(const std::string & text);
+
+  // empty the key and hand out its text to write a primary key into, the
+  // buffer's capacity is reused. seal() when done
+  std::string & reset() {
+    text_.clear();
+    return text_;
+  }
+  void seal();
+
+  // the secondary key of the variant whose field values are values
+  CacheKey variant(const std::string & values) const;
+  // this key without its secondary part
+  CacheKey primary() const;
+  bool is_variant() const { return primary_size_ != text_.size(); }
+
+  const std::string & str() const { return text_; }
+  size_t size() const { return text_.size(); }
+  uint64_t hash() const { return hash_; }
+
+  bool operator==(const CacheKey & other) const {
+    return hash_ == other.hash_ && text_ == other.text_;
+  }
+  bool operator!=(const CacheKey & other) const { return !(*this == other); }
+};
+
+namespace std {
+// the precomputed hash, hash tables keyed by CacheKey never rehash the text
+template<>
+struct hash<CacheKey> {
+  size_t operator()(const CacheKey & key) const {
+    return static_cast<size_t>(key.hash());
+  }
+};
+}  // namespace std
+
+#endif  //CACHE_KEY
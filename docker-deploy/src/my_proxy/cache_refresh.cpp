@@ -0,0 +1,162 @@
+#include "cache_refresh.hpp"
+
+#include <algorithm>
+
+// a refresh nobody waits for still should not linger
+static const std::chrono::seconds refresh_timeout(15);
+
+CacheRefresh::CacheRefresh(strand_executor executor,
+                           int id,
+                           LogPipeline & log_pipeline,
+                           Cache<CacheKey, CachedResponsePtr> & cache,
+                           CompressionPool & compression,
+                           DnsCache & dns,
+                           CollapsedForwarding & collapsing,
+                           CachedResponsePtr stale) :
+    stream_(executor),
+    req_(std::piecewise_construct,
+         std::make_tuple(),
+         std::make_tuple(ArenaAllocator<char>(arena_))),
+    lw_(id, log_pipeline),
+    cache_handler_(cache, compression, lw_),
+    dns_(dns),
+    collapsing_(collapsing),
+    stale_(std::move(stale)) {}
+
+CacheRefresh::~CacheRefresh() {
+  if (!finished_) {
+    // dropped with its io_context, the waiters must not wait for it
+    collapsing_.finish(key_, nullptr);
+  }
+}
+
+void CacheRefresh::start(strand_executor executor,
+                         int id,
+                         LogPipeline & log_pipeline,
+                         Cache<CacheKey, CachedResponsePtr> & cache,
+                         CompressionPool & compression,
+                         DnsCache & dns,
+                         CollapsedForwarding & collapsing,
+                         const CacheKey & key,
+                         const std::string & host,
+                         const std::string & port,
+                         beast::string_view target,
+                         CachedResponsePtr stale) {
+  if (!collapsing.try_lead(key)) {
+    // a refresh or a miss is fetching the key already
+    return;
+  }
+  std::shared_ptr<CacheRefresh> refresh(new CacheRefresh(executor,
+                                                         id,
+                                                         log_pipeline,
+                                                         cache,
+                                                         compression,
+                                                         dns,
+                                                         collapsing,
+                                                         std::move(stale)));
+  refresh->key_ = key;
+  refresh->host_ = host;
+  refresh->port_ = port;
+  http::request<http::empty_body, ArenaFields> & req = refresh->req_;
+  req.method(http::verb::get);
+  req.target(target);
+  req.version(11);
+  req.set(http::field::host, port == "80" ? host : host + ":" + port);
+  // the origin picks the same variant again
+  beast::string_view variant(refresh->stale_->variant);
+  while (!variant.empty()) {
+    size_t end = std::min(variant.find('\n'), variant.size());
+    beast::string_view line = variant.substr(0, end);
+    size_t colon = line.find(':');
+    if (colon != beast::string_view::npos && colon + 1 < line.size()) {
+      req.set(line.substr(0, colon), line.substr(colon + 1));
+    }
+    variant.remove_prefix(std::min(end + 1, variant.size()));
+  }
+  if (!refresh->stale_->e_tag.empty()) {
+    req.set(http::field::if_none_match, refresh->stale_->e_tag);
+  }
+  if (!refresh->stale_->last_modified.empty()) {
+    req.set(http::field::if_modified_since, refresh->stale_->last_modified);
+  }
+  req.keep_alive(false);
+  dns.async_resolve(host,
+                    port,
+                    refresh->stream_.get_executor(),
+                    [refresh](beast::error_code ec, Endpoints endpoints) {
+                      refresh->on_resolve(ec, endpoints);
+                    });
+}
+
+void CacheRefresh::on_resolve(beast::error_code ec, const Endpoints & endpoints) {
+  if (ec) {
+    return finish("background refresh failed to resolve the origin", nullptr);
+  }
+  stream_.expires_after(refresh_timeout);
+  stream_.async_connect(
+      endpoints,
+      beast::bind_front_handler(&CacheRefresh::on_connect, shared_from_this()));
+}
+
+void CacheRefresh::on_connect(beast::error_code ec, tcp::endpoint) {
+  if (ec) {
+    return finish("background refresh failed to connect", nullptr);
+  }
+  lw_.log_request_to_server(req_, host_);
+  stream_.expires_after(refresh_timeout);
+  auto self = shared_from_this();
+  http::async_write(
+      stream_, req_, beast::bind_front_handler(&CacheRefresh::on_write, self));
+}
+
+void CacheRefresh::on_write(beast::error_code ec, std::size_t) {
+  if (ec) {
+    return finish("background refresh failed to send", nullptr);
+  }
+  parser_.emplace(std::piecewise_construct,
+                  std::make_tuple(),
+                  std::make_tuple(ArenaAllocator<char>(arena_)));
+  // a body the cache would not take is not worth reading
+  parser_->body_limit(cache_handler_.max_entry_bytes());
+  stream_.expires_after(refresh_timeout);
+  http::async_read(stream_,
+                   buffer_,
+                   *parser_,
+                   beast::bind_front_handler(&CacheRefresh::on_read, shared_from_this()));
+}
+
+void CacheRefresh::on_read(beast::error_code ec, std::size_t) {
+  if (ec) {
+    return finish("background refresh failed to read the response", nullptr);
+  }
+  http::response<http::string_body, ArenaFields> & res = parser_->get();
+  lw_.log_response_from_server(res, host_);
+  if (res.result() == http::status::not_modified) {
+    // the stored response is still current, it only gets a new lifetime
+    CachedResponsePtr renewed = hp_.renew(*stale_, res);
+    cache_handler_.cache_response(key_, renewed);
+    return finish("background refresh revalidated the entry", renewed);
+  }
+  if (res.result() != http::status::ok) {
+    return finish("background refresh got an error, entry kept", nullptr);
+  }
+  CacheControl directives = CacheControl::parse(res[http::field::cache_control]);
+  if (!cache_handler_.can_be_cached(res, directives)) {
+    cache_handler_.remove(key_);
+    return finish("background refresh got an uncacheable response", nullptr);
+  }
+  std::shared_ptr<CachedResponse> entry = hp_.parse_response(res, directives);
+  HttpParser::get_variant(entry->vary, req_, entry->variant);
+  entry->body = std::move(res.body());
+  hp_.serialize_header(*entry);
+  cache_handler_.cache_response(key_, entry);
+  finish("background refresh replaced the entry", entry);
+}
+
+void CacheRefresh::finish(beast::string_view note, CachedResponsePtr entry) {
+  lw_.log_note(note);
+  finished_ = true;
+  collapsing_.finish(key_, std::move(entry));
+  beast::error_code ec;
+  stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+}
@@ -0,0 +1,95 @@
+#ifndef CACHE_REFRESH
+#define CACHE_REFRESH
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
+
+#include <memory>
+#include <string>
+
+#include "arena.hpp"
+#include "cache.hpp"
+#include "cache_handler.hpp"
+#include "collapsed_forwarding.hpp"
+#include "compression.hpp"
+#include "dns_cache.hpp"
+#include "http_parser.hpp"
+#include "io_types.hpp"
+#include "log_writer.hpp"
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+
+/**
+ * brings an expired entry up to date in the background while sessions go on
+ * serving it stale (stale-while-revalidate). the request is conditional when
+ * the entry has validators: a 304 renews a copy of the entry, a cacheable 200
+ * replaces it, an uncacheable one removes it. a failed refresh leaves the
+ * stale entry alone, it expires for good when its window closes.
+ * a refresh leads the fetch of its key in CollapsedForwarding: there is one
+ * per key at a time, and misses arriving meanwhile wait for its entry.
+*/
+class CacheRefresh : public std::enable_shared_from_this<CacheRefresh> {
+  beast::basic_stream<tcp, strand_executor> stream_;
+  beast::flat_buffer buffer_;
+  // declared before the messages, it holds their fields
+  Arena arena_;
+  http::request<http::empty_body, ArenaFields> req_;
+  boost::optional<http::response_parser<http::string_body, ArenaAllocator<char> > >
+      parser_;
+  LogWriter lw_;
+  CacheHandler cache_handler_;
+  HttpParser hp_;
+  DnsCache & dns_;
+  CollapsedForwarding & collapsing_;
+  CacheKey key_;
+  std::string host_;
+  std::string port_;
+  CachedResponsePtr stale_;
+  bool finished_{false};
+
+  CacheRefresh(strand_executor executor,
+               int id,
+               LogPipeline & log_pipeline,
+               Cache<CacheKey, CachedResponsePtr> & cache,
+               CompressionPool & compression,
+               DnsCache & dns,
+               CollapsedForwarding & collapsing,
+               CachedResponsePtr stale);
+
+  void on_resolve(beast::error_code ec, const Endpoints & endpoints);
+
+  void on_connect(beast::error_code ec, tcp::endpoint);
+
+  void on_write(beast::error_code ec, std::size_t bytes_transferred);
+
+  void on_read(beast::error_code ec, std::size_t bytes_transferred);
+
+  // the refresh is over, followers of the key get entry (or fetch themselves)
+  void finish(beast::string_view note, CachedResponsePtr entry);
+
+ public:
+  ~CacheRefresh();
+
+  /**
+   * refresh the entry stored under key, fetched with GET target from
+   * host:port, with the request fields it varies on set to the values it
+   * was fetched with. does nothing when the key is being fetched already.
+   * id is the log id of the refresh
+  */
+  static void start(strand_executor executor,
+                    int id,
+                    LogPipeline & log_pipeline,
+                    Cache<CacheKey, CachedResponsePtr> & cache,
+                    CompressionPool & compression,
+                    DnsCache & dns,
+                    CollapsedForwarding & collapsing,
+                    const CacheKey & key,
+                    const std::string & host,
+                    const std::string & port,
+                    beast::string_view target,
+                    CachedResponsePtr stale);
+};
+
+#endif  //CACHE_REFRESH
@@ -0,0 +1,36 @@
+#include "collapsed_forwarding.hpp"
+
+bool CollapsedForwarding::try_lead(const CacheKey & key) {
+  std::lock_guard<std::mutex> lock(flight_mutex);
+  return in_flight.emplace(key, std::vector<Waiter>()).second;
+}
+
+void CollapsedForwarding::finish(const CacheKey & key, CachedResponsePtr entry) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> lock(flight_mutex);
+    auto flight = in_flight.find(key);
+    if (flight == in_flight.end()) {
+      return;
+    }
+    waiters.swap(flight->second);
+    in_flight.erase(flight);
+  }
+  for (auto & waiter : waiters) {
+    net::post(waiter.executor, std::bind(waiter.callback, entry));
+  }
+}
+
+void CollapsedForwarding::abandon() {
+  // destroyed once the lock is released, a waiter may hold the last
+  // reference to a session that finishes a fetch of its own
+  std::vector<Waiter> waiters;
+  std::lock_guard<std::mutex> lock(flight_mutex);
+  for (auto & flight : in_flight) {
+    // leaders still finish their key, nobody waits for it any more
+    for (auto & waiter : flight.second) {
+      waiters.push_back(std::move(waiter));
+    }
+    flight.second.clear();
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef COLLAPSED_FORWARDING
+#define COLLAPSED_FORWARDING
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.hpp"
+#include "cache_key.hpp"
+#include "io_types.hpp"
+
+// the leader's entry, null when it got nothing the followers can be sent
+typedef std::function<void(CachedResponsePtr)> FetchCallback;
+
+/**
+ * origin fetches in progress, keyed by cache key and shared by every
+ * session of a proxy. the first miss on a key leads and fetches, the misses
+ * arriving meanwhile follow: they wait for the leader's entry instead of
+ * asking the origin themselves, and fetch on their own when the leader's
+ * response cannot be cached or takes longer than wait_timeout.
+*/
+class CollapsedForwarding {
+ public:
+  struct Waiter {
+    strand_executor executor;
+    FetchCallback callback;
+  };
+
+ private:
+  std::chrono::milliseconds wait_timeout_;
+  std::mutex flight_mutex;
+  std::unordered_map<CacheKey, std::vector<Waiter> > in_flight;
+
+ public:
+  // a zero timeout turns collapsing off
+  explicit CollapsedForwarding(
+      std::chrono::milliseconds wait_timeout = std::chrono::milliseconds(5000)) :
+      wait_timeout_(wait_timeout) {}
+
+  bool enabled() const { return wait_timeout_.count() > 0; }
+
+  // how long a follower waits before it fetches on its own
+  std::chrono::milliseconds wait_timeout() const { return wait_timeout_; }
+
+  /**
+   * true if nobody fetches key yet, the caller leads and has to finish()
+   * it. false if the caller follows, follow() then makes its Waiter (under
+   * the lock, a leader builds none) and the callback is posted to the
+   * executor once the leader finishes, never invoked inline
+  */
+  template<class Follow>
+  bool lead_or_follow(const CacheKey & key, Follow follow) {
+    std::lock_guard<std::mutex> lock(flight_mutex);
+    auto flight = in_flight.find(key);
+    if (flight == in_flight.end()) {
+      // the waiter list exists while the leader fetches
+      in_flight.emplace(key, std::vector<Waiter>());
+      return true;
+    }
+    flight->second.push_back(follow());
+    return false;
+  }
+
+  // lead the fetch of key if nobody does yet, without waiting otherwise
+  bool try_lead(const CacheKey & key);
+
+  // the leader is done, hand entry (or null) to the followers of key
+  void finish(const CacheKey & key, CachedResponsePtr entry);
+
+  // forget every follower without calling it, for shutdown
+  void abandon();
+};
+
+#endif  //COLLAPSED_FORWARDING
@@ -0,0 +1,201 @@
+#include "compression.hpp"
+
+#include <strings.h>
+
+#include <cstring>
+
+#include "http_parser.hpp"
+
+namespace {
+// below this the gzip framing eats most of the gain
+const size_t min_compressible_bytes = 256;
+
+bool has_prefix(const std::string & s, const char * prefix) {
+  return strncasecmp(s.c_str(), prefix, std::strlen(prefix)) == 0;
+}
+
+// text/*, and the structured text types sent as application/*
+bool text_type(const std::string & content_type) {
+  std::string type = content_type.substr(0, content_type.find(';'));
+  while (!type.empty() && (type.back() == ' ' || type.back() == '\t')) {
+    type.pop_back();
+  }
+  static const char * const types[] = {"application/json",
+                                       "application/javascript",
+                                       "application/x-javascript",
+                                       "application/xml",
+                                       "image/svg+xml"};
+  for (const char * t : types) {
+    if (strcasecmp(type.c_str(), t) == 0) {
+      return true;
+    }
+  }
+  size_t plus = type.rfind('+');
+  return has_prefix(type, "text/") ||
+         (plus != std::string::npos && (strcasecmp(type.c_str() + plus, "+json") == 0 ||
+                                        strcasecmp(type.c_str() + plus, "+xml") == 0));
+}
+}  // namespace
+
+GzipInflater::GzipInflater(const std::string & body) {
+  std::memset(&stream, 0, sizeof(stream));
+  // 16 + MAX_WBITS: a gzip wrapper around the deflate stream
+  ok = inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK;
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+  stream.avail_in = static_cast<uInt>(body.size());
+}
+
+GzipInflater::~GzipInflater() {
+  if (ok) {
+    inflateEnd(&stream);
+  }
+}
+
+bool GzipInflater::read(char * out, size_t size, size_t & got) {
+  if (!ok) {
+    return false;
+  }
+  stream.next_out = reinterpret_cast<Bytef *>(out);
+  stream.avail_out = static_cast<uInt>(size);
+  while (true) {
+    int rc = inflate(&stream, Z_NO_FLUSH);
+    got = size - stream.avail_out;
+    if (rc == Z_STREAM_END) {
+      finished = true;
+      return true;
+    }
+    // Z_BUF_ERROR means no progress was possible: the input ran out early
+    if (rc != Z_OK) {
+      return false;
+    }
+    if (got > 0 || stream.avail_out == 0) {
+      return true;
+    }
+  }
+}
+
+CompressionPool::CompressionPool(Cache<CacheKey, CachedResponsePtr> & cache,
+                                 size_t threads,
+                                 size_t max_queued_bytes) :
+    cache(cache), max_queued_bytes(max_queued_bytes) {
+  for (size_t i = 0; i < threads; ++i) {
+    workers.emplace_back(&CompressionPool::run_worker, this);
+  }
+}
+
+CompressionPool::~CompressionPool() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto & worker : workers) {
+    worker.join();
+  }
+  // what was never compressed still goes to the tier, as it is
+  for (auto & job : queue) {
+    cache.replace(job.key, job.entry, job.entry);
+  }
+}
+
+bool CompressionPool::compressible(const CachedResponse & cr) {
+  return cr.status_code == 200 && cr.content_encoding.empty() && cr.gzip_body.empty() &&
+         cr.body.size() >= min_compressible_bytes && text_type(cr.content_type);
+}
+
+void CompressionPool::put(const CacheKey & key, const CachedResponsePtr & entry) {
+  bool compress = enabled() && compressible(*entry);
+  // the worker's replace writes the entry through, once
+  cache.put(key, entry, !compress);
+  if (compress && !submit(key, entry)) {
+    cache.replace(key, entry, entry);
+  }
+}
+
+bool CompressionPool::submit(const CacheKey & key, const CachedResponsePtr & entry) {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (counters.queued_bytes + entry->body.size() > max_queued_bytes) {
+      // the workers are behind, the entry stays identity only
+      ++counters.dropped;
+      return false;
+    }
+    counters.queued_bytes += entry->body.size();
+    queue.push_back(Job{key, entry});
+  }
+  wake.notify_one();
+  return true;
+}
+
+bool CompressionPool::gzip(const std::string & in, std::string & out) {
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream,
+                   Z_DEFAULT_COMPRESSION,
+                   Z_DEFLATED,
+                   16 + MAX_WBITS,
+                   8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  out.resize(deflateBound(&stream, in.size()));
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  stream.avail_in = static_cast<uInt>(in.size());
+  stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  stream.avail_out = static_cast<uInt>(out.size());
+  // the bound leaves room for everything in one call
+  int rc = deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return rc == Z_STREAM_END;
+}
+
+void CompressionPool::compress(const Job & job) {
+  std::string gzipped;
+  bool ok = gzip(job.entry->body, gzipped);
+  std::shared_ptr<CachedResponse> both;
+  // a gain under 10% is not worth a second body
+  if (ok && gzipped.size() < job.entry->body.size() / 10 * 9) {
+    both = std::make_shared<CachedResponse>(*job.entry);
+    both->gzip_body.swap(gzipped);
+    HttpParser().serialize_header(*both);
+    if (job.key.size() + cache_charge(*both) > cache.max_entry_bytes()) {
+      both.reset();
+    }
+  }
+  // the entry reaches the tier only now, with both bodies or as it is
+  bool replaced = cache.replace(job.key, job.entry, both ? both : job.entry);
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  counters.bytes_in += job.entry->body.size();
+  if (!both) {
+    ++counters.skipped;
+  }
+  else if (!replaced) {
+    ++counters.dropped;
+  }
+  else {
+    ++counters.compressed;
+    counters.bytes_out += both->gzip_body.size();
+  }
+}
+
+void CompressionPool::run_worker() {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (stopping) {
+      return;
+    }
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    compress(job);
+    lock.lock();
+    counters.queued_bytes -= job.entry->body.size();
+  }
+}
+
+CompressionStats CompressionPool::stats() {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  return counters;
+}
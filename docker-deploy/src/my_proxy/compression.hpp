@@ -0,0 +1,105 @@
+#ifndef COMPRESSION
+#define COMPRESSION
+
+#include <zlib.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "cache_key.hpp"
+
+struct CompressionStats {
+  uint64_t compressed{0};
+  uint64_t skipped{0};  // did not shrink enough, or both bodies would not fit
+  uint64_t dropped{0};  // the queue was full, or the entry had been replaced
+  uint64_t bytes_in{0};
+  uint64_t bytes_out{0};
+  size_t queued_bytes{0};
+};
+
+/**
+ * inflates a gzip body piecewise, for a client that does not take the coding
+ * the entry was stored in. the body has to outlive the inflater
+*/
+class GzipInflater {
+  z_stream stream;
+  bool ok;
+  bool finished{false};
+
+ public:
+  explicit GzipInflater(const std::string & body);
+  ~GzipInflater();
+  GzipInflater(const GzipInflater &) = delete;
+  GzipInflater & operator=(const GzipInflater &) = delete;
+
+  // up to size inflated bytes into out, got of them. false when the body is
+  // corrupt or ends early, got is then meaningless
+  bool read(char * out, size_t size, size_t & got);
+  // the whole body has been inflated
+  bool done() const { return finished; }
+};
+
+/**
+ * gzips cacheable text responses once, off the io threads.
+ * cache_response() stores every new entry through put(), which queues the
+ * compressible ones. a worker compresses the body and replaces the entry
+ * with a copy carrying both bodies, provided the key still holds the same
+ * entry and the copy is not larger than the cache takes. sessions then pick
+ * the body by the client's Accept-Encoding.
+ * a queued entry is written through to the cache's tier only by that
+ * replace (with one body or both), so the tier gets one record of it.
+ * the queue is bounded by the bodies waiting in it, past that entries stay
+ * identity only, insertion never waits for a worker.
+*/
+class CompressionPool {
+  struct Job {
+    CacheKey key;
+    CachedResponsePtr entry;
+  };
+
+  Cache<CacheKey, CachedResponsePtr> & cache;
+  size_t max_queued_bytes;
+
+  std::mutex queue_mutex;
+  std::condition_variable wake;
+  std::deque<Job> queue;
+  bool stopping{false};
+  CompressionStats counters;
+  std::vector<std::thread> workers;
+
+  void run_worker();
+  void compress(const Job & job);
+  // false when the entry is not queued
+  bool submit(const CacheKey & key, const CachedResponsePtr & entry);
+
+ public:
+  // no threads: nothing is compressed
+  CompressionPool(Cache<CacheKey, CachedResponsePtr> & cache,
+                  size_t threads,
+                  size_t max_queued_bytes = 16 << 20);
+  ~CompressionPool();
+  CompressionPool(const CompressionPool &) = delete;
+  CompressionPool & operator=(const CompressionPool &) = delete;
+
+  bool enabled() const { return !workers.empty(); }
+
+  // a text response the origin did not encode, long enough to gain from gzip
+  static bool compressible(const CachedResponse & cr);
+
+  // put entry into the cache under key and compress it if it is worth it.
+  // never waits for a worker
+  void put(const CacheKey & key, const CachedResponsePtr & entry);
+
+  // in as one gzip member into out, false when zlib fails
+  static bool gzip(const std::string & in, std::string & out);
+
+  CompressionStats stats();
+};
+
+#endif  //COMPRESSION
@@ -0,0 +1,116 @@
+#include "connection_pool.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+bool ConnectionPool::is_alive(tcp::socket::native_handle_type fd) {
+  char byte;
+  ssize_t n = ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  // 0 is an orderly shutdown, data means the framing went wrong somewhere
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void ConnectionPool::close_handle(tcp::socket::native_handle_type fd) {
+  ::close(fd);
+}
+
+ConnectionPool::~ConnectionPool() {
+  for (auto & host : idle) {
+    for (auto & conn : host.second) {
+      close_handle(conn.fd);
+    }
+  }
+}
+
+bool ConnectionPool::acquire(const std::string & host,
+                             const std::string & port,
+                             strand_socket & socket) {
+  auto now = std::chrono::steady_clock::now();
+  IdleConnection conn(-1, tcp::v4(), now);
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto it = idle.find(make_key(host, port));
+    if (it == idle.end()) {
+      return false;
+    }
+    bool found = false;
+    while (!it->second.empty() && !found) {
+      conn = it->second.back();
+      it->second.pop_back();
+      --total_idle;
+      found = now - conn.idle_since < idle_timeout && is_alive(conn.fd);
+      if (!found) {
+        close_handle(conn.fd);
+      }
+    }
+    // an emptied host keeps its entry until evict_expired(), the release
+    // that follows this acquire reuses it instead of allocating a new one
+    if (!found) {
+      return false;
+    }
+  }
+  boost::system::error_code ec;
+  socket.assign(conn.protocol, conn.fd, ec);
+  if (ec) {
+    close_handle(conn.fd);
+    return false;
+  }
+  return true;
+}
+
+void ConnectionPool::release(const std::string & host,
+                             const std::string & port,
+                             strand_socket & socket) {
+  if (!socket.is_open()) {
+    return;
+  }
+  boost::system::error_code ec;
+  tcp::endpoint::protocol_type protocol = socket.local_endpoint(ec).protocol();
+  if (ec) {
+    socket.close(ec);
+    return;
+  }
+  IdleConnection conn(socket.release(ec), protocol, std::chrono::steady_clock::now());
+  if (ec) {
+    socket.close(ec);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  std::deque<IdleConnection> & conns = idle[make_key(host, port)];
+  if (conns.size() >= max_idle_per_host || total_idle >= max_idle_total) {
+    close_handle(conn.fd);
+    if (conns.empty()) {
+      idle.erase(make_key(host, port));
+    }
+    return;
+  }
+  conns.push_back(conn);
+  ++total_idle;
+}
+
+void ConnectionPool::evict_expired() {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  for (auto it = idle.begin(); it != idle.end();) {
+    std::deque<IdleConnection> & conns = it->second;
+    // oldest at the front
+    while (!conns.empty() && now - conns.front().idle_since >= idle_timeout) {
+      close_handle(conns.front().fd);
+      conns.pop_front();
+      --total_idle;
+    }
+    if (conns.empty()) {
+      it = idle.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+size_t ConnectionPool::size() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  return total_idle;
+}
@@ -0,0 +1,79 @@
+#ifndef CONNECTION_POOL
+#define CONNECTION_POOL
+
+#include <boost/asio.hpp>
+
+#include "io_types.hpp"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * idle keep-alive upstream connections, keyed by "host:port" and shared by
+ * every session of a listener.
+ * the pool holds native handles rather than sockets: a socket is bound to
+ * the strand of the session that opened it, the session reusing it wraps the
+ * handle in a socket of its own.
+*/
+class ConnectionPool {
+  struct IdleConnection {
+    tcp::socket::native_handle_type fd;
+    tcp::endpoint::protocol_type protocol;
+    std::chrono::steady_clock::time_point idle_since;
+    IdleConnection(tcp::socket::native_handle_type fd,
+                   tcp::endpoint::protocol_type protocol,
+                   std::chrono::steady_clock::time_point idle_since) :
+        fd(fd), protocol(protocol), idle_since(idle_since) {}
+  };
+
+  std::mutex pool_mutex;
+  // most recently released connection at the back
+  std::unordered_map<std::string, std::deque<IdleConnection> > idle;
+  size_t total_idle{0};
+  size_t max_idle_per_host;
+  size_t max_idle_total;
+  std::chrono::seconds idle_timeout;
+
+  // "host:port" built in a buffer of the calling thread, lookups allocate
+  // nothing
+  static const std::string & make_key(const std::string & host,
+                                      const std::string & port) {
+    thread_local std::string key;
+    key.assign(host).append(1, ':').append(port);
+    return key;
+  }
+  // true if the peer has not closed the connection or sent anything unasked
+  static bool is_alive(tcp::socket::native_handle_type fd);
+  static void close_handle(tcp::socket::native_handle_type fd);
+
+ public:
+  ConnectionPool(size_t max_idle_per_host = 8,
+                 size_t max_idle_total = 1024,
+                 std::chrono::seconds idle_timeout = std::chrono::seconds(30)) :
+      max_idle_per_host(max_idle_per_host),
+      max_idle_total(max_idle_total),
+      idle_timeout(idle_timeout) {}
+  ~ConnectionPool();
+
+  /**
+   * hand out a live idle connection to host:port, wrapped into `socket`
+   * (which must be closed), returns false when there is none
+  */
+  bool acquire(const std::string & host, const std::string & port, strand_socket & socket);
+
+  // take back a connection whose last response was completely read
+  void release(const std::string & host, const std::string & port, strand_socket & socket);
+
+  // close connections idle for longer than idle_timeout
+  void evict_expired();
+
+  size_t size();
+};
+
+#endif  //CONNECTION_POOL
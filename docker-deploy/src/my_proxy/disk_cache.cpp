@@ -0,0 +1,646 @@
+#include "disk_cache.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+namespace {
+// "PXD3", bump the digit when the record layout changes
+const uint32_t record_magic = 0x33445850;
+
+/**
+ * every record starts with this, followed by the key and the payload (the
+ * response's fields and body). records are padded to 8 bytes
+*/
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t header_sum;   // this header (with header_sum 0) and the key
+  uint32_t payload_sum;  // checked when the record is read back
+  uint32_t key_len;
+  uint32_t payload_len;
+  uint32_t reserved;
+  uint64_t key_hash;
+};
+
+static_assert(std::is_trivially_copyable<CacheControl>::value,
+              "CacheControl is stored byte for byte");
+
+size_t padded(size_t n) {
+  return (n + 7) & ~static_cast<size_t>(7);
+}
+
+uint32_t sum32(const char * p, size_t n, uint32_t h = 0x811c9dc5) {
+  for (size_t i = 0; i < n; ++i) {
+    h ^= static_cast<unsigned char>(p[i]);
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+uint32_t header_sum(const RecordHeader & header, const char * key) {
+  RecordHeader copy = header;
+  copy.header_sum = 0;
+  uint32_t h = sum32(reinterpret_cast<const char *>(&copy), sizeof(copy));
+  return sum32(key, header.key_len, h);
+}
+
+// the steady clock restarts with the machine, records keep wall-clock time
+int64_t to_wall_ms(std::chrono::steady_clock::time_point t) {
+  auto left = t - std::chrono::steady_clock::now();
+  auto wall = std::chrono::system_clock::now() + left;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(wall.time_since_epoch())
+      .count();
+}
+
+std::chrono::steady_clock::time_point from_wall_ms(int64_t ms) {
+  std::chrono::system_clock::time_point wall{std::chrono::milliseconds(ms)};
+  auto left = wall - std::chrono::system_clock::now();
+  return std::chrono::steady_clock::now() +
+         std::chrono::duration_cast<std::chrono::steady_clock::duration>(left);
+}
+
+std::string CachedResponse::*const stored_strings[] = {
+    &CachedResponse::e_tag,
+    &CachedResponse::last_modified,
+    &CachedResponse::status_message,
+    &CachedResponse::server,
+    &CachedResponse::content_type,
+    &CachedResponse::content_encoding,
+    &CachedResponse::vary,
+    &CachedResponse::variant,
+    &CachedResponse::wire_header,
+    &CachedResponse::body,
+    &CachedResponse::gzip_wire_header,
+    &CachedResponse::gzip_body,
+};
+
+size_t payload_size(const CachedResponse & cr) {
+  size_t n = sizeof(int64_t) + sizeof(int32_t) + sizeof(CacheControl);
+  for (auto field : stored_strings) {
+    n += sizeof(uint32_t) + (cr.*field).size();
+  }
+  return n;
+}
+
+void put_bytes(char *& out, const void * src, size_t n) {
+  std::memcpy(out, src, n);
+  out += n;
+}
+
+void encode_payload(const CachedResponse & cr, char * out) {
+  int64_t expires = to_wall_ms(cr.expiration_time);
+  int32_t status = cr.status_code;
+  put_bytes(out, &expires, sizeof(expires));
+  put_bytes(out, &status, sizeof(status));
+  put_bytes(out, &cr.directives, sizeof(cr.directives));
+  for (auto field : stored_strings) {
+    uint32_t len = static_cast<uint32_t>((cr.*field).size());
+    put_bytes(out, &len, sizeof(len));
+    put_bytes(out, (cr.*field).data(), len);
+  }
+}
+
+bool get_bytes(const char *& in, const char * end, void * dst, size_t n) {
+  if (static_cast<size_t>(end - in) < n) {
+    return false;
+  }
+  std::memcpy(dst, in, n);
+  in += n;
+  return true;
+}
+
+bool decode_payload(const char * in, const char * end, CachedResponse & cr) {
+  int64_t expires;
+  int32_t status;
+  if (!get_bytes(in, end, &expires, sizeof(expires)) ||
+      !get_bytes(in, end, &status, sizeof(status)) ||
+      !get_bytes(in, end, &cr.directives, sizeof(cr.directives))) {
+    return false;
+  }
+  cr.expiration_time = from_wall_ms(expires);
+  cr.status_code = status;
+  for (auto field : stored_strings) {
+    uint32_t len;
+    if (!get_bytes(in, end, &len, sizeof(len)) || static_cast<size_t>(end - in) < len) {
+      return false;
+    }
+    (cr.*field).assign(in, len);
+    in += len;
+  }
+  return in == end;
+}
+
+// the header of the record at offset, null past the last complete record
+const RecordHeader * record_at(const char * base, size_t capacity, size_t offset) {
+  if (capacity - offset < sizeof(RecordHeader)) {
+    return nullptr;
+  }
+  const RecordHeader * header = reinterpret_cast<const RecordHeader *>(base + offset);
+  if (header->magic != record_magic ||
+      capacity - offset - sizeof(RecordHeader) <
+          static_cast<uint64_t>(header->key_len) + header->payload_len ||
+      header_sum(*header, base + offset + sizeof(RecordHeader)) != header->header_sum) {
+    return nullptr;
+  }
+  return header;
+}
+
+size_t record_size(const RecordHeader & header) {
+  return padded(sizeof(RecordHeader) + header.key_len + header.payload_len);
+}
+
+const char segment_prefix[] = "segment-";
+}  // namespace
+
+DiskCache::Segment::~Segment() {
+  if (base != nullptr) {
+    ::munmap(base, capacity);
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+DiskCache::DiskCache(const std::string & dir,
+                     size_t capacity_bytes,
+                     size_t segment_bytes,
+                     size_t max_pending_bytes) :
+    dir(dir),
+    segment_bytes(segment_bytes),
+    max_segments(std::max<size_t>(2, capacity_bytes / segment_bytes)),
+    max_pending_bytes(max_pending_bytes) {
+  counters.capacity_bytes = max_segments * segment_bytes;
+  // about one counter per 2 KB of budget, far more than there are entries
+  size_t filter_size = 1 << 16;
+  while (filter_size < counters.capacity_bytes / 2048) {
+    filter_size <<= 1;
+  }
+  filter.reset(new std::atomic<uint8_t>[filter_size]);
+  for (size_t i = 0; i < filter_size; ++i) {
+    filter[i].store(0, std::memory_order_relaxed);
+  }
+  filter_mask = filter_size - 1;
+  if (::mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+    std::cerr << "Failed to create disk cache " << dir << ": " << std::strerror(errno)
+              << "\n";
+    this->dir.clear();
+    return;
+  }
+  recover();
+  active = open_segment(next_segment_id++, true);
+  if (!active) {
+    this->dir.clear();
+    return;
+  }
+  segments[active->id] = active;
+  writer = std::thread(&DiskCache::run_writer, this);
+}
+
+DiskCache::~DiskCache() {
+  if (!writer.joinable()) {
+    return;
+  }
+  // the writer's last pass appends what is still queued
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+DiskCache::SegmentPtr DiskCache::open_segment(uint32_t id, bool create) {
+  char name[sizeof(segment_prefix) + 8];
+  std::snprintf(name, sizeof(name), "%s%08x", segment_prefix, id);
+  SegmentPtr segment = std::make_shared<Segment>(id, dir + "/" + name, segment_bytes);
+  int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+  segment->fd = ::open(segment->path.c_str(), flags, 0644);
+  struct stat st;
+  if (segment->fd < 0 ||
+      (create && ::ftruncate(segment->fd, static_cast<off_t>(segment_bytes)) < 0) ||
+      ::fstat(segment->fd, &st) < 0 || st.st_size <= 0) {
+    std::cerr << "Failed to open " << segment->path << ": " << std::strerror(errno)
+              << "\n";
+    return SegmentPtr();
+  }
+  segment->capacity = static_cast<size_t>(st.st_size);
+  void * base = ::mmap(
+      nullptr, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+  if (base == MAP_FAILED) {
+    std::cerr << "Failed to map " << segment->path << ": " << std::strerror(errno)
+              << "\n";
+    return SegmentPtr();
+  }
+  segment->base = static_cast<char *>(base);
+  return segment;
+}
+
+void DiskCache::recover() {
+  DIR * d = ::opendir(dir.c_str());
+  if (d == nullptr) {
+    return;
+  }
+  std::map<uint32_t, std::string> found;
+  const size_t prefix_len = sizeof(segment_prefix) - 1;
+  while (struct dirent * entry = ::readdir(d)) {
+    if (std::strncmp(entry->d_name, segment_prefix, prefix_len) == 0) {
+      char * end;
+      unsigned long id = std::strtoul(entry->d_name + prefix_len, &end, 16);
+      if (*end == '\0') {
+        found[static_cast<uint32_t>(id)] = entry->d_name;
+      }
+    }
+  }
+  ::closedir(d);
+  // oldest first, so a newer record of a key replaces the older one
+  for (auto & file : found) {
+    SegmentPtr segment = open_segment(file.first, false);
+    if (segment) {
+      segments[segment->id] = segment;
+      scan(segment);
+    }
+    next_segment_id = file.first + 1;
+  }
+}
+
+void DiskCache::scan(const SegmentPtr & segment) {
+  size_t offset = 0;
+  while (const RecordHeader * header =
+             record_at(segment->base, segment->capacity, offset)) {
+    size_t length = record_size(*header);
+    remember(header->key_hash,
+             Location{segment->id, static_cast<uint32_t>(length), offset});
+    offset += length;
+  }
+  segment->used = offset;
+}
+
+char * DiskCache::reserve(size_t length, Location & where) {
+  if (length > segment_bytes) {
+    return nullptr;
+  }
+  if (active->capacity - active->used < length) {
+    // seal the active segment, a new one takes the records from here on
+    SegmentPtr next = open_segment(next_segment_id++, true);
+    if (!next) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(index_mutex);
+    segments[next->id] = next;
+    active = next;
+  }
+  where = Location{active->id, static_cast<uint32_t>(length), active->used};
+  std::lock_guard<std::mutex> lock(index_mutex);
+  active->used += length;
+  return active->base + where.offset;
+}
+
+void DiskCache::filter_add(uint64_t hash) {
+  for (uint64_t probe : {hash, hash >> 32}) {
+    std::atomic<uint8_t> & counter = filter[probe & filter_mask];
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    while (count != 255 &&
+           !counter.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+    }
+  }
+}
+
+void DiskCache::filter_remove(uint64_t hash) {
+  for (uint64_t probe : {hash, hash >> 32}) {
+    std::atomic<uint8_t> & counter = filter[probe & filter_mask];
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    while (count != 255 &&
+           !counter.compare_exchange_weak(count, count - 1, std::memory_order_relaxed)) {
+    }
+  }
+}
+
+bool DiskCache::filter_may_hold(uint64_t hash) const {
+  return filter[hash & filter_mask].load(std::memory_order_relaxed) != 0 &&
+         filter[(hash >> 32) & filter_mask].load(std::memory_order_relaxed) != 0;
+}
+
+void DiskCache::remember(uint64_t hash, const Location & where) {
+  // counted before the old record is forgotten, the filter never drops to
+  // zero for a hash that stays
+  filter_add(hash);
+  auto it = index.find(hash);
+  if (it != index.end()) {
+    forget(it);
+  }
+  index.emplace(hash, where);
+  segments[where.segment]->live_bytes += where.length;
+}
+
+void DiskCache::forget(std::unordered_map<uint64_t, Location>::iterator it) {
+  auto segment = segments.find(it->second.segment);
+  if (segment != segments.end()) {
+    segment->second->live_bytes -= it->second.length;
+  }
+  filter_remove(it->first);
+  index.erase(it);
+}
+
+void DiskCache::store(const CacheKey & key, const CachedResponsePtr & value) {
+  if (!usable() || !value) {
+    return;
+  }
+  size_t charge = cache_charge(value);
+  uint64_t hash = key.hash();
+  bool was_idle;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    // a newer entry of a queued key takes its place (and its filter count)
+    auto it = pending.find(key);
+    bool queued = it != pending.end();
+    if (queued) {
+      pending_bytes -= cache_charge(it->second);
+      pending.erase(it);
+    }
+    if (pending_bytes + charge > max_pending_bytes) {
+      // the disk is behind, an entry it never gets only costs a miss after
+      // the RAM cache lets go of it
+      if (queued) {
+        filter_remove(hash);
+      }
+      ++dropped;
+      return;
+    }
+    was_idle = pending.empty();
+    if (!queued) {
+      filter_add(hash);
+    }
+    pending.emplace(key, value);
+    pending_bytes += charge;
+  }
+  if (was_idle) {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      work_queued = true;
+    }
+    wake.notify_one();
+  }
+}
+
+CachedResponsePtr DiskCache::load(const CacheKey & key) {
+  if (!usable()) {
+    return CachedResponsePtr();
+  }
+  uint64_t hash = key.hash();
+  if (!filter_may_hold(hash)) {
+    ++misses;
+    return CachedResponsePtr();
+  }
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    auto queued = pending.find(key);
+    if (queued != pending.end()) {
+      // still written, the record outlives the copy in RAM
+      ++hits;
+      return queued->second;
+    }
+  }
+  SegmentPtr segment;
+  Location where;
+  {
+    // an entry leaving the queue is indexed first, under both locks
+    std::lock_guard<std::mutex> lock(index_mutex);
+    auto it = index.find(hash);
+    if (it == index.end()) {
+      ++misses;
+      return CachedResponsePtr();
+    }
+    where = it->second;
+    segment = segments[where.segment];
+  }
+  // the record is complete and immutable once indexed, read it unlocked. the
+  // segment stays mapped while we hold it, even if compaction drops it
+  const char * record = segment->base + where.offset;
+  const RecordHeader * header = reinterpret_cast<const RecordHeader *>(record);
+  const char * stored_key = record + sizeof(RecordHeader);
+  const char * payload = stored_key + header->key_len;
+  bool same_key = header->key_len == key.size() &&
+                  std::memcmp(stored_key, key.str().data(), key.size()) == 0;
+  std::shared_ptr<CachedResponse> value;
+  bool intact = sum32(payload, header->payload_len) == header->payload_sum;
+  if (same_key && intact) {
+    value = std::make_shared<CachedResponse>();
+    intact = decode_payload(payload, payload + header->payload_len, *value);
+  }
+  std::lock_guard<std::mutex> lock(index_mutex);
+  auto it = index.find(hash);
+  bool unmoved = it != index.end() && it->second.segment == where.segment &&
+                 it->second.offset == where.offset;
+  if (!same_key) {
+    // another key with the same hash, it keeps its place
+    ++misses;
+    return CachedResponsePtr();
+  }
+  if (!intact) {
+    // it never will be readable, the record keeps no entry
+    if (unmoved) {
+      forget(it);
+    }
+    ++misses;
+    return CachedResponsePtr();
+  }
+  ++hits;
+  return value;
+}
+
+void DiskCache::erase(const CacheKey & key) {
+  if (!usable()) {
+    return;
+  }
+  uint64_t hash = key.hash();
+  std::lock_guard<std::mutex> queue_lock(pending_mutex);
+  std::lock_guard<std::mutex> lock(index_mutex);
+  auto queued = pending.find(key);
+  if (queued != pending.end()) {
+    pending_bytes -= cache_charge(queued->second);
+    pending.erase(queued);
+    filter_remove(hash);
+  }
+  // may forget another key of the same hash, that only costs a miss
+  auto it = index.find(hash);
+  if (it != index.end()) {
+    forget(it);
+  }
+}
+
+void DiskCache::write_pending() {
+  std::vector<std::pair<CacheKey, CachedResponsePtr> > batch;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    batch.assign(pending.begin(), pending.end());
+  }
+  // entries stay in pending (and can be found there) until they are indexed
+  for (auto & entry : batch) {
+    const std::string & key = entry.first.str();
+    const CachedResponse & cr = *entry.second;
+    size_t payload_len = payload_size(cr);
+    Location where;
+    size_t length = padded(sizeof(RecordHeader) + key.size() + payload_len);
+    char * record = reserve(length, where);
+    bool written = record != nullptr;
+    if (written) {
+      RecordHeader header;
+      header.magic = record_magic;
+      header.key_len = static_cast<uint32_t>(key.size());
+      header.payload_len = static_cast<uint32_t>(payload_len);
+      header.reserved = 0;
+      header.key_hash = entry.first.hash();
+      char * payload = record + sizeof(RecordHeader) + key.size();
+      std::memcpy(record + sizeof(RecordHeader), key.data(), key.size());
+      encode_payload(cr, payload);
+      header.payload_sum = sum32(payload, payload_len);
+      header.header_sum = header_sum(header, key.data());
+      std::memcpy(record, &header, sizeof(header));
+    }
+    std::lock_guard<std::mutex> queue_lock(pending_mutex);
+    std::lock_guard<std::mutex> lock(index_mutex);
+    auto queued = pending.find(entry.first);
+    if (queued == pending.end() || queued->second != entry.second) {
+      // removed or replaced meanwhile, the record is dead
+      continue;
+    }
+    uint64_t hash = entry.first.hash();
+    if (written) {
+      remember(hash, where);
+      ++counters.written;
+    }
+    else {
+      ++dropped;
+    }
+    pending_bytes -= cache_charge(queued->second);
+    pending.erase(queued);
+    filter_remove(hash);
+  }
+}
+
+void DiskCache::compact() {
+  SegmentPtr victim;
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    for (auto & entry : segments) {
+      Segment & segment = *entry.second;
+      if (entry.second == active || segment.live_bytes * 2 >= segment.used) {
+        continue;
+      }
+      // the lowest share of live bytes
+      if (!victim ||
+          segment.live_bytes * victim->used < victim->live_bytes * segment.used) {
+        victim = entry.second;
+      }
+    }
+  }
+  if (victim) {
+    // copy the live records to the active segment, the rest goes with the file
+    size_t offset = 0;
+    while (const RecordHeader * header =
+               record_at(victim->base, victim->used, offset)) {
+      size_t length = record_size(*header);
+      bool live;
+      {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        auto it = index.find(header->key_hash);
+        live = it != index.end() && it->second.segment == victim->id &&
+               it->second.offset == offset;
+      }
+      Location where;
+      char * copy = live ? reserve(length, where) : nullptr;
+      if (copy != nullptr) {
+        std::memcpy(copy, victim->base + offset, length);
+        std::lock_guard<std::mutex> lock(index_mutex);
+        auto it = index.find(header->key_hash);
+        if (it != index.end() && it->second.segment == victim->id &&
+            it->second.offset == offset) {
+          remember(header->key_hash, where);
+        }
+      }
+      offset += length;
+    }
+    drop(victim);
+    std::lock_guard<std::mutex> lock(index_mutex);
+    ++counters.compactions;
+  }
+  // past the budget the oldest entries go, a whole segment at a time
+  while (true) {
+    SegmentPtr oldest;
+    {
+      std::lock_guard<std::mutex> lock(index_mutex);
+      if (segments.size() <= max_segments) {
+        break;
+      }
+      oldest = segments.begin()->second;
+    }
+    if (oldest == active) {
+      break;
+    }
+    drop(oldest);
+  }
+}
+
+void DiskCache::drop(const SegmentPtr & segment) {
+  // a sealed segment does not change, walk it before taking the lock
+  std::vector<std::pair<uint64_t, size_t> > records;
+  size_t offset = 0;
+  while (const RecordHeader * header =
+             record_at(segment->base, segment->used, offset)) {
+    records.emplace_back(header->key_hash, offset);
+    offset += record_size(*header);
+  }
+  std::lock_guard<std::mutex> lock(index_mutex);
+  for (auto & record : records) {
+    auto it = index.find(record.first);
+    if (it != index.end() && it->second.segment == segment->id &&
+        it->second.offset == record.second) {
+      forget(it);
+    }
+  }
+  segments.erase(segment->id);
+  // loads still reading it keep the mapping, the file is gone already
+  ::unlink(segment->path.c_str());
+}
+
+void DiskCache::run_writer() {
+  std::unique_lock<std::mutex> lock(wake_mutex);
+  while (true) {
+    // compaction runs at least once a second, appends as soon as they queue
+    wake.wait_for(lock, std::chrono::seconds(1), [this] {
+      return stopping || work_queued;
+    });
+    bool stop = stopping;
+    work_queued = false;
+    lock.unlock();
+    write_pending();
+    compact();
+    lock.lock();
+    if (stop) {
+      return;
+    }
+  }
+}
+
+DiskCacheStats DiskCache::stats() {
+  std::lock_guard<std::mutex> lock(index_mutex);
+  DiskCacheStats st = counters;
+  st.hits = hits;
+  st.misses = misses;
+  st.dropped = dropped;
+  st.entries = index.size();
+  st.segments = segments.size();
+  for (auto & entry : segments) {
+    st.bytes_used += entry.second->used;
+    st.live_bytes += entry.second->live_bytes;
+  }
+  return st;
+}
@@ -0,0 +1,146 @@
+#ifndef DISK_CACHE
+#define DISK_CACHE
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.hpp"
+#include "cache_key.hpp"
+
+struct DiskCacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t written{0};
+  uint64_t dropped{0};  // writes lost to a full queue or an oversized entry
+  uint64_t compactions{0};
+  size_t entries{0};
+  size_t segments{0};
+  size_t bytes_used{0};  // appended to the segments, live or not
+  size_t live_bytes{0};
+  size_t capacity_bytes{0};
+};
+
+/**
+ * second cache tier on local disk, behind the RAM Cache, written through:
+ * it holds every entry the cache was given, not only what RAM evicted.
+ * entries are appended as records to fixed-size segment files, each mapped
+ * into memory, so a hit is read straight from the page cache. the index in
+ * RAM keeps 24 bytes per entry: the key's 64-bit hash (CacheKey::hash) and
+ * where the record lives, the key itself is only in the record and compared
+ * on a hit.
+ *
+ * store() only queues the entry, a background thread appends it. the same
+ * thread compacts: a sealed segment that is mostly dead is rewritten into
+ * the active one, and past the byte budget the oldest segment is dropped.
+ * a found entry is copied back to the RAM cache and keeps its record, only
+ * erase() or a newer record of the key forgets it. the destructor writes
+ * what is still queued before it returns.
+ * a counting bloom filter over the hashes indexed or queued answers most
+ * misses without a lock, the queue and the index have a mutex each.
+ *
+ * segments outlive the process. on startup every segment's record headers
+ * are scanned (bodies are not read) to rebuild the index, a later record of
+ * a key wins. a record that was torn by a crash ends the scan of its segment.
+*/
+class DiskCache : public CacheTier<CacheKey, CachedResponsePtr> {
+  struct Segment {
+    uint32_t id;
+    std::string path;
+    int fd{-1};
+    char * base{nullptr};
+    size_t capacity;
+    // appended bytes, grows on the writer thread under index_mutex
+    size_t used{0};
+    size_t live_bytes{0};  // guarded by index_mutex
+    Segment(uint32_t id, const std::string & path, size_t capacity) :
+        id(id), path(path), capacity(capacity) {}
+    ~Segment();
+  };
+  typedef std::shared_ptr<Segment> SegmentPtr;
+
+  struct Location {
+    uint32_t segment;
+    uint32_t length;
+    uint64_t offset;
+  };
+
+  std::string dir;
+  size_t segment_bytes;
+  size_t max_segments;
+  size_t max_pending_bytes;
+
+  // the index and the segments
+  std::mutex index_mutex;
+  std::unordered_map<uint64_t, Location> index;
+  std::map<uint32_t, SegmentPtr> segments;  // oldest first
+  DiskCacheStats counters;  // written and compactions
+  // the entries waiting to be written, taken before index_mutex
+  std::mutex pending_mutex;
+  std::unordered_map<CacheKey, CachedResponsePtr> pending;
+  size_t pending_bytes{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> dropped{0};
+
+  // one counter per key hash probe, two probes per hash. a counter that
+  // reaches 255 stays there
+  std::unique_ptr<std::atomic<uint8_t>[]> filter;
+  size_t filter_mask;
+
+  SegmentPtr active;  // written by the writer thread only
+  uint32_t next_segment_id{0};
+
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  bool stopping{false};
+  bool work_queued{false};
+  std::thread writer;
+
+  SegmentPtr open_segment(uint32_t id, bool create);
+  void recover();
+  void scan(const SegmentPtr & segment);
+  // room for a record of length bytes in the active segment, a new segment
+  // when it is full. null when no segment can take it
+  char * reserve(size_t length, Location & where);
+  void filter_add(uint64_t hash);
+  void filter_remove(uint64_t hash);
+  // false when neither the index nor the queue holds hash
+  bool filter_may_hold(uint64_t hash) const;
+  // caller holds index_mutex
+  void remember(uint64_t hash, const Location & where);
+  void forget(std::unordered_map<uint64_t, Location>::iterator it);
+  void write_pending();
+  void compact();
+  // delete a sealed segment and forget the entries still in it
+  void drop(const SegmentPtr & segment);
+  void run_writer();
+
+ public:
+  DiskCache(const std::string & dir,
+            size_t capacity_bytes,
+            size_t segment_bytes = 16 << 20,
+            size_t max_pending_bytes = 32 << 20);
+  ~DiskCache();
+  DiskCache(const DiskCache &) = delete;
+  DiskCache & operator=(const DiskCache &) = delete;
+
+  // false when the directory could not be used, the tier then stores nothing
+  bool usable() const { return !dir.empty(); }
+
+  void store(const CacheKey & key, const CachedResponsePtr & value) override;
+  CachedResponsePtr load(const CacheKey & key) override;
+  void erase(const CacheKey & key) override;
+
+  DiskCacheStats stats();
+};
+
+#endif  //DISK_CACHE
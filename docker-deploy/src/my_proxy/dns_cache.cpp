@@ -0,0 +1,131 @@
+#include "dns_cache.hpp"
+
+#include <cstdlib>
+
+void AsioDnsBackend::resolve(const std::string & host,
+                             const std::string & port,
+                             ResolveCallback callback) {
+  // the resolver has to outlive the lookup, the handler keeps it
+  std::shared_ptr<tcp::resolver> resolver = std::make_shared<tcp::resolver>(ioc);
+  resolver->async_resolve(
+      host,
+      port,
+      [resolver, callback](boost::system::error_code ec,
+                           tcp::resolver::results_type results) {
+        Endpoints endpoints;
+        for (const auto & entry : results) {
+          endpoints.push_back(entry.endpoint());
+        }
+        callback(ec, std::move(endpoints));
+      });
+}
+
+void StaticDnsBackend::add(const std::string & host, const net::ip::address & address) {
+  std::lock_guard<std::mutex> lock(table_mutex);
+  table[host].push_back(address);
+}
+
+void StaticDnsBackend::resolve(const std::string & host,
+                               const std::string & port,
+                               ResolveCallback callback) {
+  Endpoints endpoints;
+  boost::system::error_code ec;
+  unsigned short port_num = static_cast<unsigned short>(std::atoi(port.c_str()));
+  {
+    std::lock_guard<std::mutex> lock(table_mutex);
+    auto it = table.find(host);
+    if (it != table.end()) {
+      for (const auto & address : it->second) {
+        endpoints.push_back(tcp::endpoint(address, port_num));
+      }
+    }
+  }
+  if (endpoints.empty()) {
+    // literal addresses resolve to themselves
+    net::ip::address address = net::ip::make_address(host, ec);
+    if (ec) {
+      ec = net::error::host_not_found;
+    }
+    else {
+      endpoints.push_back(tcp::endpoint(address, port_num));
+    }
+  }
+  callback(ec, std::move(endpoints));
+}
+
+void DnsCache::async_resolve(const std::string & host,
+                             const std::string & port,
+                             strand_executor executor,
+                             ResolveCallback callback) {
+  std::string key = host + ":" + port;
+  auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(dns_mutex);
+    auto it = answers.find(key);
+    if (it != answers.end()) {
+      if (it->second.expires > now) {
+        net::post(executor, std::bind(callback, it->second.ec, it->second.endpoints));
+        return;
+      }
+      answers.erase(it);
+    }
+    auto flight = in_flight.find(key);
+    if (flight != in_flight.end()) {
+      // somebody is already looking this up, wait for its answer
+      flight->second.push_back(Waiter{executor, callback});
+      return;
+    }
+    in_flight[key].push_back(Waiter{executor, callback});
+  }
+  backend->resolve(host,
+                   port,
+                   std::bind(&DnsCache::on_resolved,
+                             this,
+                             key,
+                             std::placeholders::_1,
+                             std::placeholders::_2));
+}
+
+void DnsCache::on_resolved(const std::string & key,
+                           boost::system::error_code ec,
+                           Endpoints endpoints) {
+  if (!ec && endpoints.empty()) {
+    ec = net::error::host_not_found;
+  }
+  std::vector<Waiter> waiters;
+  {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(dns_mutex);
+    make_room(now);
+    Entry & entry = answers[key];
+    entry.ec = ec;
+    entry.endpoints = endpoints;
+    entry.expires = now + (ec ? negative_ttl : positive_ttl);
+    auto flight = in_flight.find(key);
+    if (flight != in_flight.end()) {
+      waiters.swap(flight->second);
+      in_flight.erase(flight);
+    }
+  }
+  for (auto & waiter : waiters) {
+    net::post(waiter.executor, std::bind(waiter.callback, ec, endpoints));
+  }
+}
+
+void DnsCache::make_room(std::chrono::steady_clock::time_point now) {
+  if (answers.size() < max_entries) {
+    return;
+  }
+  for (auto it = answers.begin(); it != answers.end();) {
+    if (it->second.expires <= now) {
+      it = answers.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+  // still full of live answers, forget an arbitrary one
+  if (answers.size() >= max_entries) {
+    answers.erase(answers.begin());
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef DNS_CACHE
+#define DNS_CACHE
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "io_types.hpp"
+
+typedef std::vector<tcp::endpoint> Endpoints;
+typedef std::function<void(boost::system::error_code, Endpoints)> ResolveCallback;
+
+/**
+ * where DnsCache sends its lookups, the callback may run on any thread
+*/
+class DnsBackend {
+ public:
+  virtual ~DnsBackend() {}
+  virtual void resolve(const std::string & host,
+                       const std::string & port,
+                       ResolveCallback callback) = 0;
+};
+
+// system resolver through asio's async_resolve (never blocks an io thread)
+class AsioDnsBackend : public DnsBackend {
+  net::io_context & ioc;
+
+ public:
+  explicit AsioDnsBackend(net::io_context & ioc) : ioc(ioc) {}
+  void resolve(const std::string & host,
+               const std::string & port,
+               ResolveCallback callback) override;
+};
+
+// fixed host table, answers immediately, for tests and loopback benchmarks
+class StaticDnsBackend : public DnsBackend {
+  std::mutex table_mutex;
+  std::unordered_map<std::string, std::vector<net::ip::address> > table;
+
+ public:
+  void add(const std::string & host, const net::ip::address & address);
+  void resolve(const std::string & host,
+               const std::string & port,
+               ResolveCallback callback) override;
+};
+
+/**
+ * shared resolver cache in front of a DnsBackend.
+ * answers (and failures) are kept for a fixed positive (negative) ttl,
+ * getaddrinfo does not report record ttls.
+ * concurrent lookups of the same host:port are merged, every waiter gets the
+ * one answer posted to the executor it asked from.
+*/
+class DnsCache {
+  struct Entry {
+    boost::system::error_code ec;
+    Endpoints endpoints;
+    std::chrono::steady_clock::time_point expires;
+  };
+  struct Waiter {
+    strand_executor executor;
+    ResolveCallback callback;
+  };
+
+  std::shared_ptr<DnsBackend> backend;
+  std::chrono::seconds positive_ttl;
+  std::chrono::seconds negative_ttl;
+  size_t max_entries;
+  std::mutex dns_mutex;
+  std::unordered_map<std::string, Entry> answers;
+  std::unordered_map<std::string, std::vector<Waiter> > in_flight;
+
+  void on_resolved(const std::string & key,
+                   boost::system::error_code ec,
+                   Endpoints endpoints);
+  // caller holds dns_mutex
+  void make_room(std::chrono::steady_clock::time_point now);
+
+ public:
+  DnsCache(std::shared_ptr<DnsBackend> backend,
+           std::chrono::seconds positive_ttl = std::chrono::seconds(60),
+           std::chrono::seconds negative_ttl = std::chrono::seconds(5),
+           size_t max_entries = 4096) :
+      backend(backend),
+      positive_ttl(positive_ttl),
+      negative_ttl(negative_ttl),
+      max_entries(max_entries) {}
+
+  // callback is posted to executor, never invoked inline
+  void async_resolve(const std::string & host,
+                     const std::string & port,
+                     strand_executor executor,
+                     ResolveCallback callback);
+};
+
+#endif  //DNS_CACHE
@@ -0,0 +1,84 @@
+#ifndef FREQUENCY_SKETCH
+#define FREQUENCY_SKETCH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * count-min sketch with 4 rows of saturating 4-bit counters (stored one per
+ * byte), used by the cache as the TinyLFU admission filter.
+ * counters are relaxed atomics so readers can record accesses while only
+ * holding a shared lock, lost increments just make the estimate a bit lower.
+ * after sample_size increments every counter is halved, so old popularity
+ * fades out.
+*/
+class FrequencySketch {
+  static const int depth = 4;
+  static const uint8_t max_count = 15;
+  size_t width{0};  // power of two
+  size_t sample_size{0};
+  std::unique_ptr<std::atomic<uint8_t>[]> table;
+  std::atomic<size_t> additions{0};
+
+  size_t index(size_t hash, int row) const {
+    // double hashing, the second hash is forced odd so rows differ
+    uint64_t h2 = (static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL) | 1;
+    return row * width + ((hash + row * h2) & (width - 1));
+  }
+
+  void age() {
+    for (size_t i = 0; i < width * depth; ++i) {
+      uint8_t c = table[i].load(std::memory_order_relaxed);
+      table[i].store(c >> 1, std::memory_order_relaxed);
+    }
+  }
+
+ public:
+  explicit FrequencySketch(size_t expected_entries = 256) { resize(expected_entries); }
+
+  void resize(size_t expected_entries) {
+    width = 64;
+    while (width < expected_entries && width < (1u << 20)) {
+      width <<= 1;
+    }
+    sample_size = 10 * width;
+    table.reset(new std::atomic<uint8_t>[width * depth]);
+    for (size_t i = 0; i < width * depth; ++i) {
+      table[i].store(0, std::memory_order_relaxed);
+    }
+    additions.store(0, std::memory_order_relaxed);
+  }
+
+  // conservative update: only the smallest counters are bumped
+  void increment(size_t hash) {
+    uint8_t min = frequency(hash);
+    if (min == max_count) {
+      return;
+    }
+    for (int row = 0; row < depth; ++row) {
+      std::atomic<uint8_t> & c = table[index(hash, row)];
+      if (c.load(std::memory_order_relaxed) == min) {
+        c.store(min + 1, std::memory_order_relaxed);
+      }
+    }
+    if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size) {
+      additions.store(0, std::memory_order_relaxed);
+      age();
+    }
+  }
+
+  uint8_t frequency(size_t hash) const {
+    uint8_t min = max_count;
+    for (int row = 0; row < depth; ++row) {
+      uint8_t c = table[index(hash, row)].load(std::memory_order_relaxed);
+      if (c < min) {
+        min = c;
+      }
+    }
+    return min;
+  }
+};
+
+#endif  //FREQUENCY_SKETCH
@@ -0,0 +1,24 @@
+#include "handler_memory.hpp"
+
+#include <new>
+
+void * HandlerMemory::allocate(size_t size) {
+  if (size <= slot_size) {
+    for (Slot & slot : slots_) {
+      if (!slot.in_use.exchange(true, std::memory_order_acquire)) {
+        return &slot.data;
+      }
+    }
+  }
+  return ::operator new(size);
+}
+
+void HandlerMemory::deallocate(void * pointer) {
+  for (Slot & slot : slots_) {
+    if (pointer == &slot.data) {
+      slot.in_use.store(false, std::memory_order_release);
+      return;
+    }
+  }
+  ::operator delete(pointer);
+}
@@ -0,0 +1,92 @@
+#ifndef HANDLER_MEMORY
+#define HANDLER_MEMORY
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+/**
+ * storage for the asynchronous operations one session has in flight.
+ * asio keeps a single spare block per thread for operations, a session
+ * with a read, a write and their timeouts pending at once goes past it and
+ * to the heap. a few fixed slots per session cover that, larger or surplus
+ * operations still get heap memory.
+ * a slot is freed by whichever io thread completes the operation, the
+ * in_use flags make that safe outside the session's strand.
+*/
+class HandlerMemory {
+  static const size_t slot_size = 1024;
+  static const int num_slots = 4;
+
+  struct Slot {
+    std::aligned_storage<slot_size>::type data;
+    std::atomic<bool> in_use{false};
+  };
+  Slot slots_[num_slots];
+
+ public:
+  HandlerMemory() = default;
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory & operator=(const HandlerMemory &) = delete;
+
+  void * allocate(size_t size);
+  void deallocate(void * pointer);
+};
+
+// the associated allocator of handlers whose operations use HandlerMemory
+template<class T>
+class HandlerAllocator {
+  template<class U>
+  friend class HandlerAllocator;
+
+  HandlerMemory * memory_;
+
+ public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemory & memory) noexcept : memory_(&memory) {}
+
+  template<class U>
+  HandlerAllocator(const HandlerAllocator<U> & other) noexcept : memory_(other.memory_) {}
+
+  T * allocate(std::size_t n) {
+    return static_cast<T *>(memory_->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T * p, std::size_t) noexcept { memory_->deallocate(p); }
+
+  template<class U>
+  bool operator==(const HandlerAllocator<U> & other) const noexcept {
+    return memory_ == other.memory_;
+  }
+
+  template<class U>
+  bool operator!=(const HandlerAllocator<U> & other) const noexcept {
+    return memory_ != other.memory_;
+  }
+};
+
+/**
+ * completion handler calling a member function of a shared object (which it
+ * keeps alive), its operation is allocated from the object's HandlerMemory
+*/
+template<class T, class... Args>
+class MemberHandler {
+  std::shared_ptr<T> self_;
+  void (T::*fn_)(Args...);
+  HandlerMemory * memory_;
+
+ public:
+  typedef HandlerAllocator<void> allocator_type;
+
+  MemberHandler(void (T::*fn)(Args...), std::shared_ptr<T> self, HandlerMemory & memory) :
+      self_(std::move(self)), fn_(fn), memory_(&memory) {}
+
+  allocator_type get_allocator() const noexcept { return allocator_type(*memory_); }
+
+  void operator()(Args... args) { ((*self_).*fn_)(std::forward<Args>(args)...); }
+};
+
+#endif  //HANDLER_MEMORY
@@ -1,57 +1,318 @@
 #include "http_parser.hpp"
 
-http::response<http::string_body> HttpParser::parse_cached_response(
-    CachedResponse & cached_resp) {
-  http::response<http::string_body> res{beast::http::status::ok, 11};
-  res.result(static_cast<beast::http::status>(cached_resp.status_code));
-  res.reason(cached_resp.status_message);
-  res.set(beast::http::field::server, cached_resp.server);
-  res.set(beast::http::field::content_type, cached_resp.content_type);
-  res.body() = cached_resp.body;
-  res.prepare_payload();
-  return res;
-}
-
-std::pair<std::string, std::string> HttpParser::get_server_name(
-    http::request<http::string_body> & request) {
-  std::string host;
-  std::string port = "80";
-  const auto & headers = request.base();
-  const auto & host_field = headers[boost::beast::http::field::host];
-  // Split the value of the Cache-Control header into individual directives
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <vector>
+
+namespace {
+void append_lower(std::string & out, beast::string_view s) {
+  for (char c : s) {
+    out += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+}
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool is_unreserved(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' ||
+         c == '_' || c == '~';
+}
+
+// a path or query part with its percent-encodings normalized (RFC 3986
+// 6.2.2): unreserved characters decoded, the hex digits of the rest upper case
+void append_normalized(std::string & out, beast::string_view part) {
+  for (size_t i = 0; i < part.size(); ++i) {
+    int high = i + 2 < part.size() && part[i] == '%' ? hex_value(part[i + 1]) : -1;
+    int low = high >= 0 ? hex_value(part[i + 2]) : -1;
+    if (low < 0) {
+      out += part[i];
+      continue;
+    }
+    char decoded = static_cast<char>(high * 16 + low);
+    if (is_unreserved(decoded)) {
+      out += decoded;
+    }
+    else {
+      out += '%';
+      out += static_cast<char>(std::toupper(static_cast<unsigned char>(part[i + 1])));
+      out += static_cast<char>(std::toupper(static_cast<unsigned char>(part[i + 2])));
+    }
+    i += 2;
+  }
+}
+
+// host in lower case, without userinfo and without the scheme's default port
+void append_authority(std::string & out,
+                      beast::string_view authority,
+                      beast::string_view default_port) {
+  size_t at = authority.rfind('@');
+  if (at != beast::string_view::npos) {
+    authority.remove_prefix(at + 1);
+  }
+  size_t colon = authority.rfind(':');
+  size_t bracket = authority.rfind(']');
+  if (colon != beast::string_view::npos &&
+      (bracket == beast::string_view::npos || colon > bracket)) {
+    beast::string_view port = authority.substr(colon + 1);
+    if (port.empty() || port == default_port) {
+      authority = authority.substr(0, colon);
+    }
+  }
+  append_lower(out, authority);
+}
+
+beast::string_view param_name(beast::string_view param) {
+  return param.substr(0, param.find('='));
+}
+
+// parameters sorted by name, repeated names keep their order, empty ones go
+void append_query(std::string & out, beast::string_view query) {
+  std::vector<beast::string_view> params;
+  while (true) {
+    size_t amp = std::min(query.find('&'), query.size());
+    if (amp > 0) {
+      params.push_back(query.substr(0, amp));
+    }
+    if (amp == query.size()) {
+      break;
+    }
+    query.remove_prefix(amp + 1);
+  }
+  std::stable_sort(params.begin(),
+                   params.end(),
+                   [](beast::string_view a, beast::string_view b) {
+                     return param_name(a) < param_name(b);
+                   });
+  char separator = '?';
+  for (beast::string_view param : params) {
+    out += separator;
+    append_normalized(out, param);
+    separator = '&';
+  }
+}
+
+// calls f with every member of the comma separated lists in the fields
+template<typename Range, typename F>
+void for_each_member(Range range, F f) {
+  for (auto it = range.first; it != range.second; ++it) {
+    beast::string_view list = it->value();
+    while (!list.empty()) {
+      size_t comma = std::min(list.find(','), list.size());
+      beast::string_view member = trim(list.substr(0, comma));
+      if (!member.empty()) {
+        f(member);
+      }
+      list.remove_prefix(std::min(comma + 1, list.size()));
+    }
+  }
+}
+
+// the weight among the parameters after a coding is 0, "q=0" or "q=0.000"
+bool zero_weight(beast::string_view params) {
+  while (!params.empty()) {
+    // drop the ';' in front of the parameter
+    params.remove_prefix(1);
+    size_t semi = std::min(params.find(';'), params.size());
+    beast::string_view param = trim(params.substr(0, semi));
+    if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+      return param.substr(2).find_first_not_of("0.") == beast::string_view::npos;
+    }
+    params.remove_prefix(semi);
+  }
+  return false;
+}
+
+std::string weak_tag(const std::string & tag) {
+  return tag.compare(0, 2, "W/") == 0 ? tag : "W/" + tag;
+}
+
+// vary with accept-encoding added
+std::string vary_on_coding(const std::string & vary) {
+  beast::string_view names(vary);
+  while (!names.empty()) {
+    size_t comma = std::min(names.find(','), names.size());
+    if (names.substr(0, comma) == "accept-encoding") {
+      return vary;
+    }
+    names.remove_prefix(std::min(comma + 1, names.size()));
+  }
+  return vary.empty() ? "accept-encoding" : vary + ",accept-encoding";
+}
+
+// a client asking for more ranges than this gets the whole body
+const size_t max_ranges = 16;
+
+// a range position, saturating instead of overflowing
+bool parse_position(beast::string_view digits, uint64_t & out) {
+  if (digits.empty()) {
+    return false;
+  }
+  out = 0;
+  for (char c : digits) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    uint64_t digit = static_cast<uint64_t>(c - '0');
+    out = out > (UINT64_MAX - digit) / 10 ? UINT64_MAX : out * 10 + digit;
+  }
+  return true;
+}
+
+std::string content_range(const ByteRange & range, size_t size) {
+  return "bytes " + std::to_string(range.first) + '-' + std::to_string(range.last) +
+         '/' + std::to_string(size);
+}
+
+// the multipart delimiter, random so that no body contains it by chance
+std::string make_boundary() {
+  thread_local std::mt19937_64 random{std::random_device{}()};
+  static const char digits[] = "0123456789abcdef";
+  std::string boundary(16, '0');
+  uint64_t bits = random();
+  for (char & c : boundary) {
+    c = digits[bits & 15];
+    bits >>= 4;
+  }
+  return boundary;
+}
+
+/**
+ * the stored fields of an entry as a header, the caller adds the coding and
+ * the framing. when the proxy picks the coding by Accept-Encoding, caches
+ * after us have to know, and a body in a coding the origin did not send
+ * (recoded) is another representation, its tag is weak
+*/
+http::response<http::empty_body> cached_header(const CachedResponse & cr, bool recoded) {
+  http::response<http::empty_body> header{static_cast<http::status>(cr.status_code), 11};
+  header.reason(cr.status_message);
+  header.set(http::field::server, cr.server);
+  header.set(http::field::content_type, cr.content_type);
+  // clients revalidate their copy against these
+  if (!cr.e_tag.empty()) {
+    header.set(http::field::etag, recoded ? weak_tag(cr.e_tag) : cr.e_tag);
+  }
+  if (!cr.last_modified.empty()) {
+    header.set(http::field::last_modified, cr.last_modified);
+  }
+  // caches after us must tell the variants apart as well
+  std::string vary =
+      !cr.gzip_body.empty() || cr.gzip_encoded() ? vary_on_coding(cr.vary) : cr.vary;
+  if (!vary.empty()) {
+    header.set(http::field::vary, vary);
+  }
+  return header;
+}
+}  // namespace
+
+void HttpParser::get_server_name(const http::request_header<ArenaFields> & request,
+                                 std::string & host,
+                                 std::string & port) {
+  const auto & host_field = request[boost::beast::http::field::host];
   std::size_t colon_pos = host_field.find(":");
   if (colon_pos != std::string::npos) {
-    port = std::string(host_field.substr(colon_pos + 1));
-    host = std::string(host_field.substr(0, colon_pos));
+    port.assign(host_field.data() + colon_pos + 1, host_field.size() - colon_pos - 1);
+    host.assign(host_field.data(), colon_pos);
+  }
+  else {
+    port = "80";
+    host.assign(host_field.data(), host_field.size());
+  }
+}
+
+void HttpParser::get_cache_key(const http::request_header<ArenaFields> & req,
+                               CacheKey & key) {
+  std::string & text = key.reset();
+  text.append(req.method_string().data(), req.method_string().size());
+  text += ' ';
+  beast::string_view target = req.target();
+  beast::string_view scheme = "http";
+  beast::string_view authority;
+  size_t scheme_end = target.find("://");
+  if (!target.empty() && target.front() == '/') {
+    // origin-form, the Host field names the origin
+    authority = req[http::field::host];
+  }
+  else if (scheme_end != beast::string_view::npos) {
+    scheme = target.substr(0, scheme_end);
+    target.remove_prefix(scheme_end + 3);
+    size_t authority_end = std::min(target.find_first_of("/?#"), target.size());
+    authority = target.substr(0, authority_end);
+    target.remove_prefix(authority_end);
+  }
+  else {
+    // authority-form or asterisk-form, nothing to normalize
+    text.append(target.data(), target.size());
+    return key.seal();
+  }
+  append_lower(text, scheme);
+  text += "://";
+  append_authority(text, authority, beast::iequals(scheme, "https") ? "443" : "80");
+  // the fragment never reaches the origin
+  target = target.substr(0, target.find('#'));
+  size_t query = std::min(target.find('?'), target.size());
+  if (query == 0) {
+    text += '/';
   }
   else {
-    host = std::string(host_field);
+    append_normalized(text, target.substr(0, query));
   }
-  return std::make_pair(host, port);
+  if (query < target.size()) {
+    append_query(text, target.substr(query + 1));
+  }
+  key.seal();
 }
 
-std::string HttpParser::get_cache_key(const http::request<http::string_body> & req) {
-  std::string cache_key = req.method_string().data();
-  cache_key.append(req.target().data(), req.target().size());
-  return cache_key;
+void HttpParser::get_variant(const std::string & vary,
+                             const http::request_header<ArenaFields> & req,
+                             std::string & values) {
+  values.clear();
+  beast::string_view names(vary);
+  while (!names.empty()) {
+    size_t comma = std::min(names.find(','), names.size());
+    beast::string_view name = names.substr(0, comma);
+    values.append(name.data(), name.size());
+    values += ':';
+    // list members without the whitespace around them, "gzip, br" is "gzip,br"
+    bool first = true;
+    for_each_member(req.equal_range(name), [&](beast::string_view member) {
+      if (!first) {
+        values += ',';
+      }
+      values.append(member.data(), member.size());
+      first = false;
+    });
+    values += '\n';
+    names.remove_prefix(std::min(comma + 1, names.size()));
+  }
 }
 
-CachedResponse HttpParser::parse_response(
-    const http::response<http::string_body> & resp) {
-  CachedResponse cached_resp;
+std::shared_ptr<CachedResponse> HttpParser::parse_response(
+    const http::response_header<ArenaFields> & resp,
+    const CacheControl & directives) {
+  std::shared_ptr<CachedResponse> entry = std::make_shared<CachedResponse>();
+  CachedResponse & cached_resp = *entry;
   //store status_code
   cached_resp.status_code = resp.result_int();
   //store the message
   cached_resp.status_message = std::string(resp.reason());
-  //store body
-  cached_resp.body = resp.body();
   //store e-tag
-  const auto & headers = resp.base();
+  const auto & headers = resp;
   auto it = headers.find(http::field::etag);
   if (it != headers.end()) {
     cached_resp.e_tag = std::string(it->value());
     // use the e_tag value as needed
   }
+  auto last_modified = resp.find(http::field::last_modified);
+  if (last_modified != resp.end()) {
+    cached_resp.last_modified = std::string(last_modified->value());
+  }
   //store content type
   auto content_type = resp.find(http::field::content_type);
   if (content_type != resp.end()) {
@@ -60,80 +321,246 @@ CachedResponse HttpParser::parse_response(
   else {
     cached_resp.content_type = "";
   }
+  auto content_encoding = resp.find(http::field::content_encoding);
+  if (content_encoding != resp.end()) {
+    cached_resp.content_encoding = std::string(content_encoding->value());
+  }
   //store server
   auto server = resp.find(http::field::server);
-  if (content_type != resp.end()) {
+  if (server != resp.end()) {
     cached_resp.server = std::string(server->value());
   }
   else {
     cached_resp.server = "";
   }
+  // the request fields the response varies on, lowercased and sorted so
+  // that equal lists compare equal
+  std::vector<std::string> vary;
+  for_each_member(resp.equal_range(http::field::vary), [&](beast::string_view name) {
+    vary.emplace_back();
+    append_lower(vary.back(), name);
+  });
+  std::sort(vary.begin(), vary.end());
+  vary.erase(std::unique(vary.begin(), vary.end()), vary.end());
+  for (const std::string & name : vary) {
+    if (!cached_resp.vary.empty()) {
+      cached_resp.vary += ',';
+    }
+    cached_resp.vary += name;
+  }
   //store fresh time and expiration time
-  // Check if the response has a Cache-Control header
-  if (headers.find(boost::beast::http::field::cache_control) != headers.end()) {
-    // Get the value of the Cache-Control header
-    const auto & cache_control = headers[boost::beast::http::field::cache_control];
-    // Split the value of the Cache-Control header into individual directives
-    std::vector<std::string> directives;
-    boost::split(directives, std::string(cache_control), boost::is_any_of(","));
-    // Find the max-age directive in the Cache-Control header
-    auto it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return boost::starts_with(directive, "max-age=");
-        });
-    if (it != directives.end()) {
-      // Get the value of the max-age directive
-      std::string max_age_str = it->substr(std::string("max-age=").size());
-      int max_age_sec = std::stoi(max_age_str);
-
-      // Calculate the maximum age in seconds
-      std::chrono::seconds max_age(max_age_sec);
-
-      // Calculate the expiration time of the response
-      cached_resp.expiration_time = std::chrono::steady_clock::now() + max_age;
-    }
-    //fint the must-revalidate directive in the Cache-Control header
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return directive == "must-revalidate";
-        });
-
-    if (it != directives.end()) {
-      // The response has the must-revalidate directive
-      cached_resp.must_revalidate = true;
+  set_freshness(cached_resp, directives);
+  return entry;
+}
+
+void HttpParser::set_freshness(CachedResponse & cached_resp,
+                               const CacheControl & directives) {
+  cached_resp.directives = directives;
+  if (directives.max_age != -1) {
+    cached_resp.expiration_time =
+        std::chrono::steady_clock::now() + std::chrono::seconds(directives.max_age);
+  }
+  if (directives.max_stale != -1) {
+    cached_resp.expiration_time =
+        std::chrono::steady_clock::now() + std::chrono::seconds(directives.max_stale);
+  }
+}
+
+std::shared_ptr<CachedResponse> HttpParser::renew(
+    const CachedResponse & cached_resp,
+    const http::response_header<ArenaFields> & not_modified) {
+  std::shared_ptr<CachedResponse> entry = std::make_shared<CachedResponse>(cached_resp);
+  auto e_tag = not_modified.find(http::field::etag);
+  if (e_tag != not_modified.end()) {
+    entry->e_tag = std::string(e_tag->value());
+  }
+  auto last_modified = not_modified.find(http::field::last_modified);
+  if (last_modified != not_modified.end()) {
+    entry->last_modified = std::string(last_modified->value());
+  }
+  auto cache_control = not_modified.find(http::field::cache_control);
+  set_freshness(*entry,
+                cache_control == not_modified.end()
+                    ? cached_resp.directives
+                    : CacheControl::parse(cache_control->value()));
+  serialize_header(*entry);
+  return entry;
+}
+
+void HttpParser::serialize_header(CachedResponse & cached_resp) {
+  //serialize the status line and headers once, hits are written as is
+  http::response<http::empty_body> header = cached_header(cached_resp, false);
+  if (!cached_resp.content_encoding.empty()) {
+    header.set(http::field::content_encoding, cached_resp.content_encoding);
+  }
+  // ranges are served from the body as the origin sent it
+  header.set(http::field::accept_ranges, "bytes");
+  header.content_length(cached_resp.body.size());
+  std::ostringstream os;
+  os << header.base();
+  cached_resp.wire_header = os.str();
+  cached_resp.gzip_wire_header.clear();
+  if (!cached_resp.gzip_body.empty()) {
+    http::response<http::empty_body> gzip_header = cached_header(cached_resp, true);
+    gzip_header.set(http::field::content_encoding, "gzip");
+    gzip_header.content_length(cached_resp.gzip_body.size());
+    std::ostringstream gzip_os;
+    gzip_os << gzip_header.base();
+    cached_resp.gzip_wire_header = gzip_os.str();
+  }
+}
+
+void HttpParser::serialize_decoded_header(const CachedResponse & cached_resp,
+                                          bool keep_alive,
+                                          std::string & out) {
+  http::response<http::empty_body> header = cached_header(cached_resp, true);
+  // the inflated length is not known up front
+  header.keep_alive(keep_alive);
+  if (keep_alive) {
+    header.chunked(true);
+  }
+  std::ostringstream os;
+  os << header.base();
+  out = os.str();
+}
+
+RangeResult HttpParser::parse_range(beast::string_view value,
+                                    uint64_t size,
+                                    std::vector<ByteRange> & ranges) {
+  ranges.clear();
+  value = trim(value);
+  if (value.size() < 6 || !beast::iequals(value.substr(0, 6), "bytes=")) {
+    return RangeResult::ignored;
+  }
+  value.remove_prefix(6);
+  size_t specs = 0;
+  uint64_t total = 0;
+  while (!value.empty()) {
+    size_t comma = std::min(value.find(','), value.size());
+    beast::string_view spec = trim(value.substr(0, comma));
+    value.remove_prefix(std::min(comma + 1, value.size()));
+    if (spec.empty()) {
+      continue;
     }
-    else {
-      cached_resp.must_revalidate = false;
+    size_t dash = spec.find('-');
+    if (++specs > max_ranges || dash == beast::string_view::npos) {
+      return RangeResult::ignored;
     }
-    //fint the no_cache directive in the Cache-Control header
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return directive == "no-cache";
-        });
-
-    if (it != directives.end()) {
-      // The response has the must-revalidate directive
-      cached_resp.no_cache = true;
+    beast::string_view from = trim(spec.substr(0, dash));
+    beast::string_view to = trim(spec.substr(dash + 1));
+    ByteRange range;
+    if (from.empty()) {
+      // the last n bytes
+      uint64_t n;
+      if (!parse_position(to, n)) {
+        return RangeResult::ignored;
+      }
+      if (n == 0 || size == 0) {
+        continue;
+      }
+      range.first = n < size ? size - n : 0;
+      range.last = size - 1;
     }
     else {
-      cached_resp.no_cache = false;
+      if (!parse_position(from, range.first)) {
+        return RangeResult::ignored;
+      }
+      range.last = UINT64_MAX;
+      if (!to.empty() && (!parse_position(to, range.last) || range.last < range.first)) {
+        return RangeResult::ignored;
+      }
+      if (range.first >= size) {
+        continue;
+      }
+      range.last = std::min(range.last, size - 1);
     }
-    //fint the max-stale directive in the Cache-Control header
-    it = std::find_if(
-        directives.begin(), directives.end(), [](const std::string & directive) {
-          return boost::starts_with(directive, "max-stale=");
-        });
-    if (it != directives.end()) {
-      // Get the value of the max-stale directive
-      std::string max_stale_str = it->substr(std::string("max-stale=").size());
-      int max_stale_sec = std::stoi(max_stale_str);
-
-      // Calculate the maximum stale in seconds
-      std::chrono::seconds max_stale(max_stale_sec);
+    uint64_t length = range.last - range.first + 1;
+    if (length > size - total) {
+      return RangeResult::ignored;
+    }
+    total += length;
+    ranges.push_back(range);
+  }
+  if (specs == 0) {
+    return RangeResult::ignored;
+  }
+  return ranges.empty() ? RangeResult::unsatisfiable : RangeResult::satisfiable;
+}
 
-      // Calculate the expiration time of the response
-      cached_resp.expiration_time = std::chrono::steady_clock::now() + max_stale;
+void HttpParser::serialize_partial(const CachedResponse & cached_resp,
+                                   const std::vector<ByteRange> & ranges,
+                                   bool keep_alive,
+                                   std::string & text,
+                                   std::vector<size_t> & ends) {
+  http::response<http::empty_body> header = cached_header(cached_resp, false);
+  header.result(http::status::partial_content);
+  // the default reason of 206
+  header.reason("");
+  if (!cached_resp.content_encoding.empty()) {
+    header.set(http::field::content_encoding, cached_resp.content_encoding);
+  }
+  header.set(http::field::accept_ranges, "bytes");
+  header.keep_alive(keep_alive);
+  size_t size = cached_resp.body.size();
+  ends.clear();
+  if (ranges.size() == 1) {
+    header.set(http::field::content_range, content_range(ranges[0], size));
+    header.content_length(ranges[0].last - ranges[0].first + 1);
+    std::ostringstream os;
+    os << header.base();
+    text = os.str();
+    ends.assign(2, text.size());
+    return;
+  }
+  // each slice follows its part header, the closing delimiter ends the body
+  std::string boundary = make_boundary();
+  std::string parts;
+  std::vector<size_t> part_ends;
+  uint64_t length = 0;
+  for (const ByteRange & range : ranges) {
+    parts += "\r\n--";
+    parts += boundary;
+    if (!cached_resp.content_type.empty()) {
+      parts += "\r\nContent-Type: ";
+      parts += cached_resp.content_type;
     }
+    parts += "\r\nContent-Range: ";
+    parts += content_range(range, size);
+    parts += "\r\n\r\n";
+    part_ends.push_back(parts.size());
+    length += range.last - range.first + 1;
   }
-  return cached_resp;
+  parts += "\r\n--";
+  parts += boundary;
+  parts += "--\r\n";
+  header.set(http::field::content_type, "multipart/byteranges; boundary=" + boundary);
+  header.content_length(length + parts.size());
+  std::ostringstream os;
+  os << header.base();
+  text = os.str();
+  for (size_t end : part_ends) {
+    ends.push_back(text.size() + end);
+  }
+  text += parts;
+  ends.push_back(text.size());
+}
+
+bool HttpParser::accepts_gzip(const http::request_header<ArenaFields> & req) {
+  // -1 not listed, 0 refused, 1 accepted
+  int gzip = -1;
+  int any = -1;
+  for_each_member(req.equal_range(http::field::accept_encoding),
+                  [&](beast::string_view member) {
+                    size_t semi = std::min(member.find(';'), member.size());
+                    beast::string_view coding = trim(member.substr(0, semi));
+                    int accepted = zero_weight(member.substr(semi)) ? 0 : 1;
+                    if (beast::iequals(coding, "gzip") ||
+                        beast::iequals(coding, "x-gzip")) {
+                      gzip = std::max(gzip, accepted);
+                    }
+                    else if (coding == "*") {
+                      any = std::max(any, accepted);
+                    }
+                  });
+  return gzip == -1 ? any == 1 : gzip == 1;
 }
\ No newline at end of file
@@ -1,21 +1,100 @@
 #ifndef HTTP_HANDLER
 #define HTTP_HANDLER
-#include <boost/algorithm/string.hpp>
 #include <boost/beast.hpp>
 
+#include <cstdint>
+#include <sstream>
+#include <vector>
+
+#include "arena.hpp"
 #include "cache.hpp"
+#include "cache_control.hpp"
+#include "cache_key.hpp"
 namespace beast = boost::beast;  // from <boost/beast.hpp>
 namespace http = beast::http;    // from <boost/beast/http.hpp>
 
+// a satisfiable range of a body, both positions inclusive
+struct ByteRange {
+  uint64_t first;
+  uint64_t last;
+};
+
+enum class RangeResult {
+  ignored,        // not a byte range set we serve, the full body goes out
+  satisfiable,    // at least one range lies within the body
+  unsatisfiable,  // none does, 416
+};
+
 class HttpParser {
  public:
-  http::response<http::string_body> parse_cached_response(CachedResponse & cached_resp);
+  // host and port are overwritten in place, their capacity is reused
+  void get_server_name(const http::request_header<ArenaFields> & request,
+                       std::string & host,
+                       std::string & port);
+
+  /**
+   * the primary key of req: method, then the URL with scheme and host in
+   * lower case, the default port dropped, "/" for an empty path, the
+   * percent-encodings normalized, the query parameters sorted by name and
+   * the fragment cut off. an origin-form target takes the host from Host.
+   * the key's buffer is reused
+  */
+  void get_cache_key(const http::request_header<ArenaFields> & req, CacheKey & key);
+
+  // the secondary part of req's key for a response varying on vary (as in
+  // CachedResponse::vary): a "name:value\n" line per field, the value the
+  // field's list members joined by ','. empty when the field is missing
+  static void get_variant(const std::string & vary,
+                          const http::request_header<ArenaFields> & req,
+                          std::string & values);
+
+  // fields of a cacheable response whose Cache-Control was parsed into
+  // directives, the caller fills in the body and then calls serialize_header
+  std::shared_ptr<CachedResponse> parse_response(
+      const http::response_header<ArenaFields> & resp,
+      const CacheControl & directives);
+
+  // the entry's directives and expiry, counted from now
+  void set_freshness(CachedResponse & cached_resp, const CacheControl & directives);
+
+  // a copy of cached_resp brought up to date by the origin's 304: fresh
+  // again, with the validators and Cache-Control the 304 carries
+  std::shared_ptr<CachedResponse> renew(
+      const CachedResponse & cached_resp,
+      const http::response_header<ArenaFields> & not_modified);
+
+  // wire_header, and gzip_wire_header when the entry has a gzip_body
+  void serialize_header(CachedResponse & cached_resp);
+
+  // the header of cached_resp with its body inflated: no Content-Encoding,
+  // chunked unless this is the last response on the connection
+  void serialize_decoded_header(const CachedResponse & cached_resp,
+                                bool keep_alive,
+                                std::string & out);
 
-  std::pair<std::string, std::string> get_server_name(
-      http::request<http::string_body> & request);
+  /**
+   * the ranges of a body of size bytes that a Range field value asks for,
+   * clipped to the body, in the client's order. a malformed value, more
+   * than a few ranges, or ranges adding up to more than the body (the
+   * overlapping ones a client can use to amplify a response) are ignored
+  */
+  static RangeResult parse_range(beast::string_view value,
+                                 uint64_t size,
+                                 std::vector<ByteRange> & ranges);
 
-  std::string get_cache_key(const http::request<http::string_body> & req);
+  /**
+   * the 206 of ranges of cached_resp's body, everything but the body slices:
+   * the slice of ranges[i] goes after text up to ends[i], ends.back() is the
+   * end of text. more than one range makes a multipart/byteranges body
+  */
+  void serialize_partial(const CachedResponse & cached_resp,
+                         const std::vector<ByteRange> & ranges,
+                         bool keep_alive,
+                         std::string & text,
+                         std::vector<size_t> & ends);
 
-  CachedResponse parse_response(const http::response<http::string_body> & resp);
+  // the client takes gzip bodies. without Accept-Encoding any coding would
+  // do (RFC 9110 12.5.3), clients that send none get identity all the same
+  static bool accepts_gzip(const http::request_header<ArenaFields> & req);
 };
 #endif  //HTTP_HANDLER
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef IO_TYPES
+#define IO_TYPES
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * every connection runs on a strand of its own. the I/O objects of a
+ * connection name the strand type: behind the type-erased any_io_executor
+ * of tcp::socket it would be copied to the heap for the work guard of
+ * every single operation
+*/
+typedef net::strand<net::io_context::executor_type> strand_executor;
+typedef net::basic_stream_socket<tcp, strand_executor> strand_socket;
+typedef net::basic_waitable_timer<std::chrono::steady_clock,
+                                  net::wait_traits<std::chrono::steady_clock>,
+                                  strand_executor>
+    strand_timer;
+
+#endif  //IO_TYPES
@@ -0,0 +1,238 @@
+#include "latency.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+const int Latency::sub_bucket_bits;
+const int Latency::max_bits;
+const size_t Latency::num_buckets;
+
+namespace {
+struct ThreadHistograms;
+
+// the histograms of running threads and the totals of exited ones
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadHistograms *> live;
+  Latency::Snapshot retired;
+
+  Registry() {
+    for (Latency::Histogram & h : retired) {
+      h.counts.fill(0);
+      h.sum_us = 0;
+    }
+  }
+};
+
+// never destroyed, threads may still exit while statics are torn down
+Registry & registry() {
+  static Registry * instance = new Registry;
+  return *instance;
+}
+
+struct alignas(64) ThreadHistograms {
+  std::atomic<uint64_t> counts[Latency::num_phases][Latency::num_buckets];
+  std::atomic<uint64_t> sum_us[Latency::num_phases];
+
+  ThreadHistograms() {
+    for (int p = 0; p < Latency::num_phases; ++p) {
+      for (std::atomic<uint64_t> & count : counts[p]) {
+        count.store(0, std::memory_order_relaxed);
+      }
+      sum_us[p].store(0, std::memory_order_relaxed);
+    }
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.live.push_back(this);
+  }
+
+  ~ThreadHistograms() {
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    add_to(r.retired);
+    r.live.erase(std::find(r.live.begin(), r.live.end(), this));
+  }
+
+  void add_to(Latency::Snapshot & totals) const {
+    for (int p = 0; p < Latency::num_phases; ++p) {
+      for (size_t i = 0; i < Latency::num_buckets; ++i) {
+        totals[p].counts[i] += counts[p][i].load(std::memory_order_relaxed);
+      }
+      totals[p].sum_us += sum_us[p].load(std::memory_order_relaxed);
+    }
+  }
+};
+
+ThreadHistograms & local_histograms() {
+  thread_local ThreadHistograms histograms;
+  return histograms;
+}
+
+// only the owning thread writes, no read-modify-write needed
+void bump(std::atomic<uint64_t> & value, uint64_t n) {
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+const double quantiles[] = {0.5, 0.99, 0.999};
+const size_t num_quantiles = sizeof(quantiles) / sizeof(quantiles[0]);
+const char * const quantile_names[] = {"p50", "p99", "p999"};
+const char * const quantile_labels[] = {"0.5", "0.99", "0.999"};
+}  // namespace
+
+uint64_t Latency::Histogram::count() const {
+  uint64_t total = 0;
+  for (uint64_t c : counts) {
+    total += c;
+  }
+  return total;
+}
+
+uint64_t Latency::Histogram::percentile(double q) const {
+  uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < num_buckets; ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return bucket_limit(i);
+    }
+  }
+  return bucket_limit(num_buckets - 1);
+}
+
+Latency::Histogram & Latency::Histogram::operator-=(const Histogram & earlier) {
+  for (size_t i = 0; i < num_buckets; ++i) {
+    counts[i] -= earlier.counts[i];
+  }
+  sum_us -= earlier.sum_us;
+  return *this;
+}
+
+size_t Latency::bucket(uint64_t us) {
+  const uint64_t sub_buckets = 1 << sub_bucket_bits;
+  us = std::min<uint64_t>(us, (uint64_t(1) << max_bits) - 1);
+  if (us < 2 * sub_buckets) {
+    return us;
+  }
+  // the top sub_bucket_bits + 1 bits select the bucket
+  int magnitude = 63 - __builtin_clzll(us);
+  int shift = magnitude - sub_bucket_bits;
+  return shift * sub_buckets + (us >> shift);
+}
+
+uint64_t Latency::bucket_limit(size_t index) {
+  const uint64_t sub_buckets = 1 << sub_bucket_bits;
+  if (index < 2 * sub_buckets) {
+    return index;
+  }
+  int shift = static_cast<int>(index >> sub_bucket_bits) - 1;
+  uint64_t lowest = (index % sub_buckets + sub_buckets) << shift;
+  return lowest + (uint64_t(1) << shift) - 1;
+}
+
+void Latency::record(Phase phase, clock::duration elapsed) {
+  int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  uint64_t value = us < 0 ? 0 : static_cast<uint64_t>(us);
+  ThreadHistograms & local = local_histograms();
+  bump(local.counts[phase][bucket(value)], 1);
+  bump(local.sum_us[phase], value);
+}
+
+void Latency::snapshot(Snapshot & out) {
+  Registry & r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  out = r.retired;
+  for (ThreadHistograms * histograms : r.live) {
+    histograms->add_to(out);
+  }
+}
+
+const char * Latency::name(Phase phase) {
+  static const char * const names[num_phases] = {"request_parsed",
+                                                  "resolve",
+                                                  "connect",
+                                                  "upstream_ttfb",
+                                                  "upstream_body",
+                                                  "client_write"};
+  return names[phase];
+}
+
+void Latency::render_table(const Snapshot & snapshot, std::string & out) {
+  out += "phase count mean_us p50_us p99_us p999_us\n";
+  for (int p = 0; p < num_phases; ++p) {
+    const Histogram & h = snapshot[p];
+    uint64_t n = h.count();
+    out += name(static_cast<Phase>(p));
+    out += ' ';
+    out += std::to_string(n);
+    out += ' ';
+    out += std::to_string(n == 0 ? 0 : h.sum_us / n);
+    for (double q : quantiles) {
+      out += ' ';
+      out += std::to_string(h.percentile(q));
+    }
+    out += '\n';
+  }
+}
+
+void Latency::render_summary(const Snapshot & snapshot, std::string & out) {
+  for (int p = 0; p < num_phases; ++p) {
+    const Histogram & h = snapshot[p];
+    if (p > 0) {
+      out += "; ";
+    }
+    out += name(static_cast<Phase>(p));
+    out += " n=";
+    out += std::to_string(h.count());
+    for (size_t q = 0; q < num_quantiles; ++q) {
+      out += ' ';
+      out += quantile_names[q];
+      out += '=';
+      out += std::to_string(h.percentile(quantiles[q]));
+      out += "us";
+    }
+  }
+}
+
+void Latency::render(std::string & out) {
+  Snapshot totals;
+  snapshot(totals);
+  static const char * const family = "proxy_phase_duration_seconds";
+  out += "# HELP ";
+  out += family;
+  out += " Time spent in each phase of a request.\n# TYPE ";
+  out += family;
+  out += " summary\n";
+  for (int p = 0; p < num_phases; ++p) {
+    const Histogram & h = totals[p];
+    std::string phase = std::string("phase=\"") + name(static_cast<Phase>(p)) + '"';
+    for (size_t q = 0; q < num_quantiles; ++q) {
+      out += family;
+      out += '{';
+      out += phase;
+      out += ",quantile=\"";
+      out += quantile_labels[q];
+      out += "\"} ";
+      out += std::to_string(h.percentile(quantiles[q]) / 1e6);
+      out += '\n';
+    }
+    out += family;
+    out += "_sum{";
+    out += phase;
+    out += "} ";
+    out += std::to_string(h.sum_us / 1e6);
+    out += '\n';
+    out += family;
+    out += "_count{";
+    out += phase;
+    out += "} ";
+    out += std::to_string(h.count());
+    out += '\n';
+  }
+}
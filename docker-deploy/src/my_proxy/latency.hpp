@@ -0,0 +1,69 @@
+#ifndef LATENCY
+#define LATENCY
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * where the time of a request goes, phase by phase.
+ * durations are kept in microseconds in log-linear histograms (HDR style:
+ * 16 linear sub-buckets per power of two, so a percentile is off by at most
+ * 1/16 of its value). every thread records into histograms of its own
+ * without a lock, like Metrics, reading sums the histograms of all threads.
+*/
+class Latency {
+ public:
+  enum Phase {
+    request_parsed,  // accepted until the first request header is parsed
+    resolve,
+    connect,
+    upstream_ttfb,  // request sent until the response header is parsed
+    upstream_body,  // response header until the last body byte is read
+    client_write,   // until the response is written to the client
+    num_phases
+  };
+
+  typedef std::chrono::steady_clock clock;
+
+  static const int sub_bucket_bits = 4;
+  // durations are clamped to 2^max_bits - 1 microseconds (about 71 minutes)
+  static const int max_bits = 32;
+  static const size_t num_buckets = (max_bits - sub_bucket_bits + 1)
+                                    << sub_bucket_bits;
+
+  struct Histogram {
+    std::array<uint64_t, num_buckets> counts;
+    uint64_t sum_us;
+
+    uint64_t count() const;
+    // the smallest recorded value (rounded up to its bucket) that a fraction
+    // q of the samples do not exceed, 0 when there are none
+    uint64_t percentile(double q) const;
+    // what was recorded since `earlier`
+    Histogram & operator-=(const Histogram & earlier);
+  };
+
+  typedef std::array<Histogram, num_phases> Snapshot;
+
+  static void record(Phase phase, clock::duration elapsed);
+
+  // totals over all threads
+  static void snapshot(Snapshot & out);
+
+  static const char * name(Phase phase);
+
+  static size_t bucket(uint64_t us);
+  // the largest value falling into bucket `index`
+  static uint64_t bucket_limit(size_t index);
+
+  // one line per phase: name, count, mean, p50, p99 and p999 in microseconds
+  static void render_table(const Snapshot & snapshot, std::string & out);
+  // the same on a single line, for the log
+  static void render_summary(const Snapshot & snapshot, std::string & out);
+  // Prometheus summaries in seconds
+  static void render(std::string & out);
+};
+
+#endif  //LATENCY
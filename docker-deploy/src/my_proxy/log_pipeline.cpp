@@ -0,0 +1,172 @@
+#include "log_pipeline.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+static std::atomic<uint64_t> pipeline_instances{0};
+
+LogPipeline::LogPipeline(const std::string & path,
+                         std::chrono::milliseconds flush_interval,
+                         size_t ring_bytes,
+                         FullPolicy policy) :
+    instance(++pipeline_instances),
+    ring_bytes(1),
+    flush_interval(flush_interval),
+    policy(policy) {
+  while (this->ring_bytes < ring_bytes) {
+    this->ring_bytes <<= 1;
+  }
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to open log file " << path << ": " << std::strerror(errno)
+              << "\n";
+  }
+  writer = std::thread(&LogPipeline::run_writer, this);
+}
+
+LogPipeline::~LogPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+LogPipeline::Ring & LogPipeline::local_ring() {
+  // one ring per (thread, pipeline), rings live as long as the pipeline
+  thread_local uint64_t owner = 0;
+  thread_local Ring * ring = nullptr;
+  if (owner != instance) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new Ring(ring_bytes));
+    ring = rings.back().get();
+    owner = instance;
+  }
+  return *ring;
+}
+
+void LogPipeline::copy_in(Ring & ring, size_t pos, const void * src, size_t len) {
+  size_t start = pos & (ring.capacity - 1);
+  size_t first = std::min(len, ring.capacity - start);
+  std::memcpy(ring.data.get() + start, src, first);
+  std::memcpy(ring.data.get(), static_cast<const char *>(src) + first, len - first);
+}
+
+void LogPipeline::copy_out(Ring & ring, size_t pos, void * dst, size_t len) {
+  size_t start = pos & (ring.capacity - 1);
+  size_t first = std::min(len, ring.capacity - start);
+  std::memcpy(dst, ring.data.get() + start, first);
+  std::memcpy(static_cast<char *>(dst) + first, ring.data.get(), len - first);
+}
+
+bool LogPipeline::try_push(Ring & ring, const std::string & line) {
+  size_t head = ring.head.load(std::memory_order_relaxed);
+  size_t tail = ring.tail.load(std::memory_order_acquire);
+  if (ring.capacity - (head - tail) < record_header + line.size()) {
+    return false;
+  }
+  uint64_t seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+  uint32_t len = static_cast<uint32_t>(line.size());
+  copy_in(ring, head, &seq, sizeof(seq));
+  copy_in(ring, head + sizeof(seq), &len, sizeof(len));
+  copy_in(ring, head + record_header, line.data(), line.size());
+  ring.head.store(head + record_header + line.size(), std::memory_order_release);
+  return true;
+}
+
+void LogPipeline::submit(const std::string & line) {
+  Ring & ring = local_ring();
+  if (record_header + line.size() > ring.capacity) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  while (!try_push(ring, line)) {
+    if (policy == FullPolicy::drop) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // block: get the writer going and wait for it to make room
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      flush_requested = true;
+    }
+    wake.notify_one();
+    std::this_thread::yield();
+  }
+}
+
+void LogPipeline::drain(std::vector<Record> & pending) {
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (auto & ring : rings) {
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t head = ring->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      Record rec;
+      uint32_t len;
+      copy_out(*ring, tail, &rec.seq, sizeof(rec.seq));
+      copy_out(*ring, tail + sizeof(rec.seq), &len, sizeof(len));
+      rec.line.resize(len);
+      copy_out(*ring, tail + record_header, &rec.line[0], len);
+      pending.push_back(std::move(rec));
+      tail += record_header + len;
+    }
+    ring->tail.store(head, std::memory_order_release);
+  }
+}
+
+void LogPipeline::write_batch(const std::string & batch) {
+  if (fd < 0) {
+    return;
+  }
+  size_t written = 0;
+  while (written < batch.size()) {
+    ssize_t n = ::write(fd, batch.data() + written, batch.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    written += n;
+  }
+}
+
+void LogPipeline::run_writer() {
+  std::vector<Record> pending;
+  std::string batch;
+  // lines numbered below this were handed out a whole interval ago
+  uint64_t settled = 0;
+  bool done = false;
+  while (!done) {
+    {
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      wake.wait_for(
+          lock, flush_interval, [this] { return stopping || flush_requested; });
+      done = stopping;
+      flush_requested = false;
+    }
+    uint64_t issued = next_seq.load(std::memory_order_relaxed);
+    drain(pending);
+    std::sort(pending.begin(), pending.end());
+    size_t n = 0;
+    while (n < pending.size() && (done || pending[n].seq < settled)) {
+      batch += pending[n].line;
+      ++n;
+    }
+    pending.erase(pending.begin(), pending.begin() + n);
+    settled = issued;
+    if (!batch.empty()) {
+      write_batch(batch);
+      batch.clear();
+    }
+  }
+}
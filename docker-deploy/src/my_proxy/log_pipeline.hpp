@@ -0,0 +1,91 @@
+#ifndef LOG_PIPELINE
+#define LOG_PIPELINE
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * asynchronous log sink shared by every LogWriter.
+ * each producing thread appends finished lines to its own single-producer
+ * ring buffer without taking a lock, a dedicated writer thread drains all
+ * rings every flush_interval and appends the batch to the file with one
+ * write(2) (group commit).
+ * a session hops between io threads, so every line carries a global sequence
+ * number and the writer restores that order. a line is held back for one
+ * extra interval, until every line numbered before it has surely landed in
+ * its ring.
+ * when a ring is full the line is either dropped (counted) or the producer
+ * waits for the writer, depending on the policy.
+*/
+class LogPipeline {
+ public:
+  enum class FullPolicy { drop, block };
+
+ private:
+  struct Ring {
+    std::unique_ptr<char[]> data;
+    size_t capacity;  // power of two
+    char pad0[64];
+    std::atomic<size_t> head{0};  // advanced by the producer
+    char pad1[64];
+    std::atomic<size_t> tail{0};  // advanced by the writer thread
+    char pad2[64];
+    explicit Ring(size_t capacity) : data(new char[capacity]), capacity(capacity) {}
+  };
+
+  struct Record {
+    uint64_t seq;
+    std::string line;
+    bool operator<(const Record & other) const { return seq < other.seq; }
+  };
+  // ring framing: sequence number and length in front of every line
+  static const size_t record_header = sizeof(uint64_t) + sizeof(uint32_t);
+
+  uint64_t instance;  // tells thread_local ring pointers of old pipelines apart
+  int fd{-1};
+  size_t ring_bytes;
+  std::chrono::milliseconds flush_interval;
+  FullPolicy policy;
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> next_seq{0};
+
+  std::mutex rings_mutex;  // guards registration, not the rings themselves
+  std::vector<std::unique_ptr<Ring> > rings;
+
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  bool stopping{false};
+  bool flush_requested{false};
+  std::thread writer;
+
+  Ring & local_ring();
+  static void copy_in(Ring & ring, size_t pos, const void * src, size_t len);
+  static void copy_out(Ring & ring, size_t pos, void * dst, size_t len);
+  bool try_push(Ring & ring, const std::string & line);
+  void drain(std::vector<Record> & pending);
+  void write_batch(const std::string & batch);
+  void run_writer();
+
+ public:
+  LogPipeline(const std::string & path,
+              std::chrono::milliseconds flush_interval = std::chrono::milliseconds(50),
+              size_t ring_bytes = 1 << 18,
+              FullPolicy policy = FullPolicy::block);
+  ~LogPipeline();
+  LogPipeline(const LogPipeline &) = delete;
+  LogPipeline & operator=(const LogPipeline &) = delete;
+
+  // queue one finished line (including its '\n')
+  void submit(const std::string & line);
+
+  uint64_t dropped_lines() const { return dropped.load(std::memory_order_relaxed); }
+};
+
+#endif  //LOG_PIPELINE
@@ -1,13 +1,23 @@
 #include "log_writer.hpp"
 
-std::string LogWriter::current_utc_time() {
+const std::string & LogWriter::current_utc_time() {
+  // formatting once per second is enough, every thread keeps its own copy
+  thread_local std::time_t cached_second = 0;
+  thread_local std::string cached;
   std::time_t now = std::time(nullptr);
-  char buf[128];
-  std::strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", std::gmtime(&now));
-  return buf;
+  if (now != cached_second) {
+    char buf[128];
+    std::tm tm_utc;
+    gmtime_r(&now, &tm_utc);
+    std::strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", &tm_utc);
+    cached = buf;
+    cached_second = now;
+  }
+  return cached;
 }
 
-std::string LogWriter::to_utc_string(const std::chrono::steady_clock::time_point & tp) {
+void LogWriter::append_utc(std::string & line,
+                           const std::chrono::steady_clock::time_point & tp) {
   // Convert steady_clock::time_point to system_clock::time_point
   auto sys_tp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
       tp - std::chrono::steady_clock::now() + std::chrono::system_clock::now());
@@ -16,81 +26,129 @@ std::string LogWriter::to_utc_string(const std::chrono::steady_clock::time_point
   auto time = std::chrono::system_clock::to_time_t(sys_tp);
 
   // Convert time_t to struct tm
-  std::tm * tm_utc = std::gmtime(&time);
+  std::tm tm_utc;
+  gmtime_r(&time, &tm_utc);
 
   // Format struct tm as ISO 8601 string
   char buf[30];
-  std::strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", tm_utc);
+  std::strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", &tm_utc);
 
-  return std::string(buf, std::strlen(buf));
+  line += buf;
 }
 
-void LogWriter::log_response_from_server(const http::response<http::string_body> & response,
-                              std::string server_name) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": Receiving \""
-          << "HTTP/" << response.version() << " " << response.result_int() << " "
-          << response.reason() << "\" from " << server_name << std::endl;
+void LogWriter::log_response_from_server(
+    const http::response_header<ArenaFields> & response,
+    const std::string & server_name) {
+  std::string & line = begin_line();
+  line += "Receiving \"HTTP/";
+  line += std::to_string(response.version());
+  line += ' ';
+  line += std::to_string(response.result_int());
+  line += ' ';
+  append(line, response.reason());
+  line += "\" from ";
+  line += server_name;
+  emit(line);
 }
 
-void LogWriter::log_response_to_client(const http::response<http::string_body> & response) {
-    std::lock_guard<std::mutex> lock(log_mutex);
-    logfile << id << ": Responding \""
-            << "HTTP/" << response.version() << " " << response.result_int() << " "
-            << response.reason() << "\"" << std::endl;
+void LogWriter::log_response_to_client(
+    const http::response_header<ArenaFields> & response) {
+  std::string & line = begin_line();
+  line += "Responding \"HTTP/";
+  line += std::to_string(response.version());
+  line += ' ';
+  line += std::to_string(response.result_int());
+  line += ' ';
+  append(line, response.reason());
+  line += '"';
+  emit(line);
+}
+
+void LogWriter::log_response_to_client(const CachedResponse & response) {
+  // cached responses are always served as HTTP/1.1
+  std::string & line = begin_line();
+  line += "Responding \"HTTP/11 ";
+  line += std::to_string(response.status_code);
+  line += ' ';
+  line += response.status_message;
+  line += '"';
+  emit(line);
+}
+
+void LogWriter::log_partial_response_to_client() {
+  std::string & line = begin_line();
+  line += "Responding \"HTTP/11 206 Partial Content\"";
+  emit(line);
 }
 
 void LogWriter::log_tunnel_closed() {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": Tunnel closed" << std::endl;
+  std::string & line = begin_line();
+  line += "Tunnel closed";
+  emit(line);
 }
 
-void LogWriter::log_note(std::string note) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": NOTE " << note << std::endl;
+void LogWriter::log_note(beast::string_view note) {
+  std::string & line = begin_line();
+  line += "NOTE ";
+  append(line, note);
+  emit(line);
 }
 
-void LogWriter::log_warning(std::string warning) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": WARNING " << warning << std::endl;
+void LogWriter::log_warning(beast::string_view warning) {
+  std::string & line = begin_line();
+  line += "WARNING ";
+  append(line, warning);
+  emit(line);
 }
 
-void LogWriter::log_error(std::string error) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": ERROR " << error << std::endl;
+void LogWriter::log_error(beast::string_view error) {
+  std::string & line = begin_line();
+  line += "ERROR ";
+  append(line, error);
+  emit(line);
 }
 
 void LogWriter::log_not_in_cache() {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": not in cache" << std::endl;
+  std::string & line = begin_line();
+  line += "not in cache";
+  emit(line);
 }
 
 void LogWriter::log_expired(std::chrono::steady_clock::time_point time) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": in cache, but expired at " << to_utc_string(time) << std::endl;
+  std::string & line = begin_line();
+  line += "in cache, but expired at ";
+  append_utc(line, time);
+  emit(line);
 }
 
 void LogWriter::log_require_validation() {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": in cache, requires validation" << std::endl;
+  std::string & line = begin_line();
+  line += "in cache, requires validation";
+  emit(line);
 }
 
 void LogWriter::log_valid() {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": in cache, valid" << std::endl;
+  std::string & line = begin_line();
+  line += "in cache, valid";
+  emit(line);
 }
 
-void LogWriter::log_not_cacheable(std::string reason) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": not cacheable because " << reason << std::endl;
+void LogWriter::log_not_cacheable(beast::string_view reason) {
+  std::string & line = begin_line();
+  line += "not cacheable because ";
+  append(line, reason);
+  emit(line);
 }
 
 void LogWriter::log_cached_with_expire_time(std::chrono::steady_clock::time_point time) {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": cached, expires at " << to_utc_string(time) << std::endl;
+  std::string & line = begin_line();
+  line += "cached, expires at ";
+  append_utc(line, time);
+  emit(line);
 }
 
 void LogWriter::log_cached_with_revalidation() {
-  std::lock_guard<std::mutex> lock(log_mutex);
-  logfile << id << ": cached, but requires re-validation" << std::endl;
+  std::string & line = begin_line();
+  line += "cached, but requires re-validation";
+  emit(line);
 }
\ No newline at end of file
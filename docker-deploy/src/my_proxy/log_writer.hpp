@@ -9,11 +9,12 @@
 #include <boost/beast/version.hpp>
 #include <boost/config.hpp>
 
+#include "arena.hpp"
+#include "cache.hpp"
+#include "log_pipeline.hpp"
+
 #include <ctime>
-#include <fstream>
-#include <iomanip>
 #include <iostream>
-#include <mutex>
 #include <string>
 
 namespace beast = boost::beast;    // from <boost/beast.hpp>
@@ -21,56 +22,97 @@ namespace http = beast::http;      // from <boost/beast/http.hpp>
 namespace net = boost::asio;       // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
 
+/**
+ * formats the log lines of one session and hands them to the shared
+ * LogPipeline, no lock is taken and no syscall is made on the caller's thread
+*/
 class LogWriter {
  private:
   int id;
-  std::ofstream & logfile;
-  std::mutex & log_mutex;
+  LogPipeline & pipeline;
+  // every line is formatted here, its capacity is reused from line to line
+  std::string line_;
   // Returns the current time as a string in UTC with asctime format
-  std::string current_utc_time();
-  std::string to_utc_string(const std::chrono::steady_clock::time_point & tp);
+  const std::string & current_utc_time();
+  static void append_utc(std::string & line,
+                         const std::chrono::steady_clock::time_point & tp);
+  static void append_version(std::string & line, unsigned version) {
+    line += std::to_string(version / 10);
+    line += '.';
+    line += std::to_string(version % 10);
+  }
+  // "ID: "
+  std::string & begin_line() {
+    line_.clear();
+    line_ += std::to_string(id);
+    line_ += ": ";
+    return line_;
+  }
+  static void append(std::string & line, beast::string_view sv) {
+    line.append(sv.data(), sv.size());
+  }
+  // terminates the line and queues it
+  void emit(std::string & line) {
+    line += '\n';
+    pipeline.submit(line);
+  }
 
  public:
-  LogWriter(int id, std::ofstream & log, std::mutex & mutex) :
-      id(id), logfile(log), log_mutex(mutex) {}
+  LogWriter(int id, LogPipeline & pipeline) : id(id), pipeline(pipeline) {}
+
+  void set_id(int new_id) { id = new_id; }
 
   template<class Body, class Allocator>
   void log_request_from_client(
       const http::request<Body, http::basic_fields<Allocator> > & request,
-      std::string client_address) {
-    std::lock_guard<std::mutex> lock(log_mutex);
-    auto http_version = request.version();
-    std::string http_version_string = "HTTP/" + std::to_string(http_version / 10) + "." +
-                                      std::to_string(http_version % 10);
-    logfile << id << ": \"" << request.method_string() << " " << request.target() << " "
-            << "HTTP/" << http_version_string << "\" from " << client_address << " @ "
-            << current_utc_time() << std::endl;
+      const std::string & client_address) {
+    std::string & line = begin_line();
+    line += '"';
+    append(line, request.method_string());
+    line += ' ';
+    append(line, request.target());
+    line += " HTTP/HTTP/";
+    append_version(line, request.version());
+    line += "\" from ";
+    line += client_address;
+    line += " @ ";
+    line += current_utc_time();
+    emit(line);
   }
 
   template<class Body, class Allocator>
   void log_request_to_server(
       const http::request<Body, http::basic_fields<Allocator> > & request,
-      std::string server_name) {
-    std::lock_guard<std::mutex> lock(log_mutex);
-    logfile << id << ": Requesting \"" << request.method_string() << " "
-            << request.target() << " "
-            << "HTTP/" << request.version() << "\" from " << server_name << std::endl;
+      const std::string & server_name) {
+    std::string & line = begin_line();
+    line += "Requesting \"";
+    append(line, request.method_string());
+    line += ' ';
+    append(line, request.target());
+    line += " HTTP/";
+    line += std::to_string(request.version());
+    line += "\" from ";
+    line += server_name;
+    emit(line);
   }
 
-  void log_response_from_server(const http::response<http::string_body> & response,
-                                std::string server_name);
-  void log_response_to_client(const http::response<http::string_body> & response);
+  void log_response_from_server(const http::response_header<ArenaFields> & response,
+                                const std::string & server_name);
+  void log_response_to_client(const http::response_header<ArenaFields> & response);
+  void log_response_to_client(const CachedResponse & response);
+  // ranges of a cached body, a 206
+  void log_partial_response_to_client();
   void log_tunnel_closed();
-  void log_note(std::string note);
-  void log_warning(std::string warning);
-  void log_error(std::string error);
+  void log_note(beast::string_view note);
+  void log_warning(beast::string_view warning);
+  void log_error(beast::string_view error);
   //method while handling get req from client
   void log_not_in_cache();
   void log_expired(std::chrono::steady_clock::time_point time);
   void log_require_validation();
   void log_valid();
   //method while handling get resp from server
-  void log_not_cacheable(std::string reason);
+  void log_not_cacheable(beast::string_view reason);
   void log_cached_with_expire_time(std::chrono::steady_clock::time_point time);
   void log_cached_with_revalidation();
 };
@@ -0,0 +1,186 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace {
+struct ThreadCounters;
+
+// the blocks of running threads and the totals of exited ones
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadCounters *> live;
+  Metrics::Snapshot retired{};
+};
+
+// never destroyed, threads may still exit while statics are torn down
+Registry & registry() {
+  static Registry * instance = new Registry;
+  return *instance;
+}
+
+struct alignas(64) ThreadCounters {
+  std::atomic<uint64_t> values[Metrics::num_counters];
+
+  ThreadCounters() {
+    for (std::atomic<uint64_t> & value : values) {
+      value.store(0, std::memory_order_relaxed);
+    }
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.live.push_back(this);
+  }
+
+  ~ThreadCounters() {
+    Registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (int i = 0; i < Metrics::num_counters; ++i) {
+      r.retired[i] += values[i].load(std::memory_order_relaxed);
+    }
+    r.live.erase(std::find(r.live.begin(), r.live.end(), this));
+  }
+};
+
+ThreadCounters & local_counters() {
+  thread_local ThreadCounters counters;
+  return counters;
+}
+
+struct Family {
+  const char * name;
+  const char * type;
+  const char * help;
+};
+
+const Family families[] = {
+    {"proxy_requests_total", "counter", "Client requests by method."},
+    {"proxy_cache_lookups_total", "counter", "Cache lookups of GET requests by outcome."},
+    {"proxy_collapsed_requests_total",
+     "counter",
+     "Cache misses answered by a concurrent fetch of the same key."},
+    {"proxy_cache_error_fallbacks_total",
+     "counter",
+     "Failed origin fetches answered from the cache."},
+    {"proxy_not_modified_total",
+     "counter",
+     "Conditional requests answered with 304 from the cache."},
+    {"proxy_cache_recoded_hits_total",
+     "counter",
+     "Cache hits sent in a coding other than the origin's."},
+    {"proxy_range_responses_total",
+     "counter",
+     "Range requests by how they were answered."},
+    {"proxy_tunnel_bytes_total", "counter", "Bytes relayed through CONNECT tunnels."},
+    {"proxy_sessions_total", "counter", "Client connections accepted."},
+    {"proxy_upstream_failures_total", "counter", "Origin lookups and connects that failed."},
+    {"proxy_session_errors_total", "counter", "Client connections ended by an error."},
+};
+
+// family and labels of each counter, sessions_closed only feeds the gauge
+struct Sample {
+  const char * family;
+  const char * labels;
+};
+
+const Sample samples[Metrics::num_counters] = {
+    {"proxy_requests_total", "method=\"GET\""},
+    {"proxy_requests_total", "method=\"POST\""},
+    {"proxy_requests_total", "method=\"PUT\""},
+    {"proxy_requests_total", "method=\"CONNECT\""},
+    {"proxy_requests_total", "method=\"other\""},
+    {"proxy_cache_lookups_total", "outcome=\"hit\""},
+    {"proxy_cache_lookups_total", "outcome=\"miss\""},
+    {"proxy_cache_lookups_total", "outcome=\"expired\""},
+    {"proxy_cache_lookups_total", "outcome=\"revalidated\""},
+    {"proxy_cache_lookups_total", "outcome=\"stale\""},
+    {"proxy_collapsed_requests_total", ""},
+    {"proxy_cache_error_fallbacks_total", ""},
+    {"proxy_not_modified_total", ""},
+    {"proxy_cache_recoded_hits_total", "coding=\"gzip\""},
+    {"proxy_cache_recoded_hits_total", "coding=\"identity\""},
+    {"proxy_range_responses_total", "outcome=\"partial\""},
+    {"proxy_range_responses_total", "outcome=\"not_satisfiable\""},
+    {"proxy_range_responses_total", "outcome=\"refetched\""},
+    {"proxy_tunnel_bytes_total", "direction=\"upstream\""},
+    {"proxy_tunnel_bytes_total", "direction=\"downstream\""},
+    {"proxy_sessions_total", ""},
+    {nullptr, ""},
+    {"proxy_upstream_failures_total", "stage=\"resolve\""},
+    {"proxy_upstream_failures_total", "stage=\"connect\""},
+    {"proxy_session_errors_total", "kind=\"timeout\""},
+    {"proxy_session_errors_total", "kind=\"other\""},
+};
+
+void render_header(std::string & out, const char * name, const char * type, const char * help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+}  // namespace
+
+void Metrics::add(Counter counter, uint64_t n) {
+  // only this thread writes its block, no read-modify-write needed
+  std::atomic<uint64_t> & value = local_counters().values[counter];
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+Metrics::Snapshot Metrics::snapshot() {
+  Registry & r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  Snapshot totals = r.retired;
+  for (ThreadCounters * counters : r.live) {
+    for (int i = 0; i < num_counters; ++i) {
+      totals[i] += counters->values[i].load(std::memory_order_relaxed);
+    }
+  }
+  return totals;
+}
+
+void Metrics::render(std::string & out) {
+  Snapshot totals = snapshot();
+  for (const Family & family : families) {
+    render_header(out, family.name, family.type, family.help);
+    for (int i = 0; i < num_counters; ++i) {
+      if (samples[i].family == nullptr || std::strcmp(samples[i].family, family.name) != 0) {
+        continue;
+      }
+      out += family.name;
+      if (*samples[i].labels) {
+        out += '{';
+        out += samples[i].labels;
+        out += '}';
+      }
+      out += ' ';
+      out += std::to_string(totals[i]);
+      out += '\n';
+    }
+  }
+  // opened and closed are counted on whichever threads ran the session
+  uint64_t opened = totals[sessions_opened];
+  uint64_t closed = totals[sessions_closed];
+  render_value(out,
+               "proxy_active_sessions",
+               "gauge",
+               "Client connections open right now.",
+               opened > closed ? opened - closed : 0);
+}
+
+void Metrics::render_value(std::string & out,
+                           const char * name,
+                           const char * type,
+                           const char * help,
+                           uint64_t value) {
+  render_header(out, name, type, help);
+  out += name;
+  out += ' ';
+  out += std::to_string(value);
+  out += '\n';
+}
@@ -0,0 +1,66 @@
+#ifndef METRICS
+#define METRICS
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * process-wide counters, cheap enough for the request path.
+ * every thread counts into a block of its own (cache-line aligned, written
+ * only by that thread, so add() is a plain load and store without a lock
+ * or a shared cache line), a scrape sums the blocks of all threads plus
+ * what exited threads left behind.
+*/
+class Metrics {
+ public:
+  enum Counter {
+    requests_get,
+    requests_post,
+    requests_put,
+    requests_connect,
+    requests_other,
+    cache_hit,
+    cache_miss,
+    cache_expired,
+    cache_revalidated,
+    cache_stale,      // expired, served while refreshed in the background
+    cache_collapsed,  // misses answered by another request's fetch
+    served_on_error,  // failed origin fetches answered from the cache
+    cache_not_modified,  // client conditionals answered with 304
+    cache_gzip_served,   // hits answered with the gzip copy of the body
+    cache_inflated,      // hits on gzip bodies inflated for the client
+    range_partial,          // ranges answered from a cached body
+    range_not_satisfiable,  // ranges outside the cached body, 416
+    range_refetched,        // ranges of uncacheable bodies, asked of the origin
+    tunnel_bytes_upstream,    // client to origin
+    tunnel_bytes_downstream,  // origin to client
+    sessions_opened,
+    sessions_closed,
+    upstream_resolve_failures,
+    upstream_connect_failures,
+    session_timeouts,
+    session_errors,
+    num_counters
+  };
+
+  typedef std::array<uint64_t, num_counters> Snapshot;
+
+  static void add(Counter counter, uint64_t n = 1);
+
+  // totals over all threads, not an atomic snapshot across counters
+  static Snapshot snapshot();
+
+  // appends the counters in the Prometheus text exposition format
+  static void render(std::string & out);
+
+  // one metric family of the text format, for gauges kept elsewhere
+  static void render_value(std::string & out,
+                           const char * name,
+                           const char * type,
+                           const char * help,
+                           uint64_t value);
+};
+
+#endif  //METRICS
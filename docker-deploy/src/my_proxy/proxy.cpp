@@ -1,7 +1,6 @@
+#include "admin_server.hpp"
 #include "proxy_server.hpp"
 
-std::mutex global_mutex;
-
 int main(int argc, char * argv[]) {
   // Call the daemon system call
   if (daemon(0, 0) < 0) {
@@ -11,33 +10,101 @@ int main(int argc, char * argv[]) {
   // Execute the main process
   while (true) {
     // Check command line arguments.
-    if (argc != 4) {
-      std::cerr << "Usage: http-server-async <address> <port> <threads>\n"
+    ProxyServer::ThreadModel model = ProxyServer::shared;
+    if (argc < 4 || argc > 11 ||
+        (argc >= 7 && !ProxyServer::parse_thread_model(argv[6], model))) {
+      std::cerr << "Usage: http-server-async <address> <port> <threads> [cache_mb] "
+                   "[admin_port] [shared|per-core] [collapse_wait_ms] [disk_cache_dir] "
+                   "[disk_cache_mb] [gzip_threads]\n"
                 << "Example:\n"
-                << "    http-server-async 0.0.0.0 8080 1\n";
+                << "    http-server-async 0.0.0.0 8080 1 64 9145\n"
+                << "admin_port serves /metrics, 9145 unless given, 0 turns it off. it "
+                   "listens on 127.0.0.1 unless given as address:port\n"
+                << "per-core runs an io_context per thread, each thread pinned to a "
+                   "core\n"
+                << "collapse_wait_ms bounds how long a miss waits for a concurrent "
+                   "fetch of the same response, 5000 unless given, 0 turns it off\n"
+                << "disk_cache_dir keeps a copy of the cached responses on disk, "
+                   "across restarts, in up to disk_cache_mb (1024 unless given)\n"
+                << "gzip_threads compress cached text bodies for clients accepting "
+                   "gzip, 2 unless given, 0 turns it off\n";
       return EXIT_FAILURE;
     }
 
     auto const address = net::ip::make_address(argv[1]);
     auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
     auto const threads = std::max<int>(1, std::atoi(argv[3]));
+    // response cache budget in bytes, 64 MB unless given on the command line
+    size_t const cache_bytes =
+        static_cast<size_t>(argc >= 5 ? std::max<int>(1, std::atoi(argv[4])) : 64)
+        << 20;
+    // metrics are scraped from here, 0 turns the admin port off. the counters
+    // are not for everyone, loopback only unless an address is given
+    std::string const admin_arg = argc >= 6 ? argv[5] : "9145";
+    auto const admin_colon = admin_arg.rfind(':');
+    std::string admin_host = "127.0.0.1";
+    if (admin_colon != std::string::npos) {
+      // "[::1]:9145" style for IPv6
+      admin_host = admin_arg.substr(0, admin_colon);
+      if (admin_host.size() > 2 && admin_host.front() == '[') {
+        admin_host = admin_host.substr(1, admin_host.size() - 2);
+      }
+    }
+    auto const admin_address = net::ip::make_address(admin_host);
+    auto const admin_port = static_cast<unsigned short>(std::atoi(
+        admin_arg.c_str() + (admin_colon == std::string::npos ? 0 : admin_colon + 1)));
+    auto const collapse_wait =
+        std::chrono::milliseconds(argc >= 8 ? std::max(0, std::atoi(argv[7])) : 5000);
+    // no disk tier unless a directory is given
+    std::string const disk_dir = argc >= 9 ? argv[8] : "";
+    size_t const disk_bytes =
+        static_cast<size_t>(argc >= 10 ? std::max<int>(1, std::atoi(argv[9])) : 1024)
+        << 20;
+    size_t const gzip_threads =
+        static_cast<size_t>(argc == 11 ? std::max(0, std::atoi(argv[10])) : 2);
 
-    // The io_context is required for all I/O
-    net::io_context ioc{threads};
+    //create the log pipeline, its writer thread appends to the log file
+    // Create the io_contexts and their listening ports
+    LogPipeline log_pipeline("/var/log/erss/log.txt");
+    ProxyServer proxy_server(model,
+                             threads,
+                             tcp::endpoint{address, port},
+                             log_pipeline,
+                             cache_bytes,
+                             collapse_wait,
+                             disk_dir,
+                             disk_bytes,
+                             gzip_threads);
 
-    //create a stream for log writing
-    // Create and launch a listening port
-    std::ofstream log_file("/var/log/erss/log.txt", std::ios_base::app);
-    std::make_shared<listener>(
-        ioc, tcp::endpoint{address, port}, log_file, 50, global_mutex)
-        ->run();
+    // the admin port gets a thread of its own, scrapes never queue behind
+    // proxy traffic
+    net::io_context admin_ioc{1};
+    std::thread admin_thread;
+    if (admin_port != 0) {
+      tcp::endpoint const admin_endpoint{admin_address, admin_port};
+      auto admin = std::make_shared<AdminServer>(admin_ioc, admin_endpoint);
+      admin->add_route("/metrics", [&proxy_server](std::string & out) {
+        proxy_server.render_metrics(out);
+      });
+      // p50/p99/p999 of every request phase since the start
+      admin->add_route("/latency", [](std::string & out) {
+        Latency::Snapshot totals;
+        Latency::snapshot(totals);
+        Latency::render_table(totals, out);
+      });
+      admin->run();
+      admin_thread = std::thread([&admin_ioc] { admin_ioc.run(); });
+    }
 
     // Run the I/O service on the requested number of threads
-    std::vector<std::thread> v;
-    v.reserve(threads - 1);
-    for (auto i = threads - 1; i > 0; --i)
-      v.emplace_back([&ioc] { ioc.run(); });
-    ioc.run();
+    proxy_server.run();
+    admin_ioc.stop();
+    if (admin_thread.joinable()) {
+      admin_thread.join();
+    }
+    if (proxy_server.signalled()) {
+      break;
+    }
   }
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,16 +1,66 @@
 #include "proxy_server.hpp"
 
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+
+// how often the log gets a line of per-phase latency percentiles
+static const std::chrono::seconds latency_summary_interval(60);
+
+typedef net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+
+// a context per thread tells asio it is only ever run by one thread
+static std::vector<std::unique_ptr<net::io_context> > make_contexts(
+    ProxyServer::ThreadModel model,
+    int threads) {
+  std::vector<std::unique_ptr<net::io_context> > contexts;
+  if (model == ProxyServer::shared) {
+    contexts.emplace_back(new net::io_context(threads));
+  }
+  else {
+    for (int i = 0; i < threads; ++i) {
+      contexts.emplace_back(new net::io_context(1));
+    }
+  }
+  return contexts;
+}
+
+// pin the calling thread to the core-th cpu it may run on (wrapping around
+// when there are more threads than cpus), a thread left unpinned still works
+static void pin_to_core(size_t core) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+    return;
+  }
+  size_t nth = core % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      int err = pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+      if (err != 0) {
+        std::cerr << "pin to cpu " << cpu << ": " << std::strerror(err) << "\n";
+      }
+      return;
+    }
+  }
+}
+
 listener::listener(net::io_context & ioc,
                    tcp::endpoint endpoint,
-                   std::ofstream & logfile,
-                   int capacity,
-                   std::mutex & my_mutex) :
+                   SharedState & shared,
+                   bool reuse_port) :
     ioc_(ioc),
     acceptor_(net::make_strand(ioc)),
-    logfile(logfile),
-    http_cache(capacity),
-    num_of_session(0),
-    my_mutex(my_mutex) {
+    shared_(shared),
+    pool_timer_(net::make_strand(ioc)),
+    latency_timer_(net::make_strand(ioc)) {
+  Latency::snapshot(last_latency_);
   beast::error_code ec;
   // Open the acceptor
   acceptor_.open(endpoint.protocol(), ec);
@@ -25,6 +75,13 @@ listener::listener(net::io_context & ioc,
     fail(ec, "set_option");
     return;
   }
+  if (reuse_port) {
+    acceptor_.set_option(reuse_port_option(true), ec);
+    if (ec) {
+      fail(ec, "set_option");
+      return;
+    }
+  }
 
   // Bind to the server address
   acceptor_.bind(endpoint, ec);
@@ -48,7 +105,7 @@ void listener::do_accept() {
       beast::bind_front_handler(&listener::on_accept, shared_from_this()));
 }
 
-void listener::on_accept(beast::error_code ec, tcp::socket socket) {
+void listener::on_accept(beast::error_code ec, strand_socket socket) {
   if (ec) {
     fail(ec, "accept");
     return;  // To avoid infinite loop
@@ -56,10 +113,295 @@ void listener::on_accept(beast::error_code ec, tcp::socket socket) {
   else {
     // Create the session and run it
     std::make_shared<session>(
-        std::move(socket), num_of_session++, logfile, http_cache, my_mutex)
+        std::move(socket),
+        shared_.num_of_session++,
+        shared_.log_pipeline,
+        shared_.http_cache,
+        shared_.compression,
+        shared_.num_of_session,
+        upstream_pool,
+        shared_.dns_cache,
+        shared_.collapsing)
         ->run();
   }
   do_accept();
 
   // Accept another connection
 }
+
+void listener::schedule_pool_sweep() {
+  pool_timer_.expires_after(std::chrono::seconds(5));
+  pool_timer_.async_wait(
+      beast::bind_front_handler(&listener::on_pool_sweep, shared_from_this()));
+}
+
+void listener::on_pool_sweep(beast::error_code ec) {
+  if (ec) {
+    fail(ec, "pool sweep");
+    return;
+  }
+  upstream_pool.evict_expired();
+  schedule_pool_sweep();
+}
+
+void listener::schedule_latency_summary() {
+  latency_timer_.expires_after(latency_summary_interval);
+  latency_timer_.async_wait(
+      beast::bind_front_handler(&listener::on_latency_summary, shared_from_this()));
+}
+
+void listener::on_latency_summary(beast::error_code ec) {
+  if (ec) {
+    fail(ec, "latency summary");
+    return;
+  }
+  Latency::Snapshot now;
+  Latency::snapshot(now);
+  Latency::Snapshot interval = now;
+  uint64_t samples = 0;
+  for (int p = 0; p < Latency::num_phases; ++p) {
+    interval[p] -= last_latency_[p];
+    samples += interval[p].count();
+  }
+  last_latency_ = now;
+  // an idle proxy keeps quiet
+  if (samples > 0) {
+    std::string line = "(no-id): NOTE latency over the last ";
+    line += std::to_string(latency_summary_interval.count());
+    line += "s: ";
+    Latency::render_summary(interval, line);
+    line += '\n';
+    shared_.log_pipeline.submit(line);
+  }
+  schedule_latency_summary();
+}
+
+ProxyServer::ProxyServer(ThreadModel model,
+                         int threads,
+                         tcp::endpoint endpoint,
+                         LogPipeline & log_pipeline,
+                         size_t cache_bytes,
+                         std::chrono::milliseconds collapse_wait,
+                         const std::string & disk_dir,
+                         size_t disk_bytes,
+                         size_t gzip_threads) :
+    model_(model),
+    threads_(std::max(1, threads)),
+    contexts_(make_contexts(model, threads_)),
+    shared_(log_pipeline,
+            cache_bytes,
+            *contexts_.front(),
+            collapse_wait,
+            disk_dir,
+            disk_bytes,
+            gzip_threads) {
+  for (auto & ioc : contexts_) {
+    listeners_.push_back(
+        std::make_shared<listener>(*ioc, endpoint, shared_, model == per_core));
+  }
+}
+
+ProxyServer::~ProxyServer() {
+  // sessions still queued on the contexts use shared_ when destroyed, so
+  // the contexts go first. the followers' executors may be gone by the time
+  // their leader is destroyed, they are dropped before any context
+  listeners_.clear();
+  shared_.collapsing.abandon();
+  contexts_.clear();
+}
+
+bool ProxyServer::parse_thread_model(const std::string & name, ThreadModel & model) {
+  if (name == "shared") {
+    model = shared;
+    return true;
+  }
+  if (name == "per-core") {
+    model = per_core;
+    return true;
+  }
+  return false;
+}
+
+void ProxyServer::run() {
+  for (auto & l : listeners_) {
+    l->run();
+  }
+  listeners_.front()->report_latency();
+  // a signal stops the contexts, the destructors then write out the disk tier
+  net::signal_set signals(*contexts_.front(), SIGINT, SIGTERM);
+  signals.async_wait([this](const beast::error_code & ec, int) {
+    if (!ec) {
+      signalled_ = true;
+      stop();
+    }
+  });
+
+  std::vector<std::thread> v;
+  if (model_ == shared) {
+    net::io_context & ioc = *contexts_.front();
+    v.reserve(threads_ - 1);
+    for (auto i = threads_ - 1; i > 0; --i) {
+      v.emplace_back([&ioc] { ioc.run(); });
+    }
+    ioc.run();
+  }
+  else {
+    v.reserve(contexts_.size() - 1);
+    for (size_t core = 1; core < contexts_.size(); ++core) {
+      net::io_context & ioc = *contexts_[core];
+      v.emplace_back([&ioc, core] {
+        pin_to_core(core);
+        ioc.run();
+      });
+    }
+    pin_to_core(0);
+    contexts_.front()->run();
+  }
+  for (auto & t : v) {
+    t.join();
+  }
+}
+
+void ProxyServer::stop() {
+  for (auto & ioc : contexts_) {
+    ioc->stop();
+  }
+}
+
+static void render_disk_metrics(std::string & out, const DiskCacheStats & disk) {
+  Metrics::render_value(out,
+                        "proxy_disk_cache_hits_total",
+                        "counter",
+                        "Cache misses answered by the disk tier.",
+                        disk.hits);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_misses_total",
+                        "counter",
+                        "Cache misses the disk tier could not answer either.",
+                        disk.misses);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_written_total",
+                        "counter",
+                        "Cache entries written through to disk.",
+                        disk.written);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_dropped_total",
+                        "counter",
+                        "Cache entries the disk tier could not take.",
+                        disk.dropped);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_compactions_total",
+                        "counter",
+                        "Segments rewritten to reclaim dead records.",
+                        disk.compactions);
+  Metrics::render_value(
+      out, "proxy_disk_cache_entries", "gauge", "Responses held on disk.", disk.entries);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_segments",
+                        "gauge",
+                        "Segment files of the disk tier.",
+                        disk.segments);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_bytes",
+                        "gauge",
+                        "Bytes appended to the segments, live or dead.",
+                        disk.bytes_used);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_live_bytes",
+                        "gauge",
+                        "Bytes of records the index still points at.",
+                        disk.live_bytes);
+  Metrics::render_value(out,
+                        "proxy_disk_cache_capacity_bytes",
+                        "gauge",
+                        "The disk tier budget.",
+                        disk.capacity_bytes);
+}
+
+static void render_compression_metrics(std::string & out,
+                                       const CompressionStats & gzip) {
+  Metrics::render_value(out,
+                        "proxy_gzip_compressed_total",
+                        "counter",
+                        "Cache entries given a gzip copy of their body.",
+                        gzip.compressed);
+  Metrics::render_value(out,
+                        "proxy_gzip_skipped_total",
+                        "counter",
+                        "Entries left identity only: little gain, or no room for both.",
+                        gzip.skipped);
+  Metrics::render_value(out,
+                        "proxy_gzip_dropped_total",
+                        "counter",
+                        "Entries not compressed: queue full, or replaced meanwhile.",
+                        gzip.dropped);
+  Metrics::render_value(out,
+                        "proxy_gzip_input_bytes_total",
+                        "counter",
+                        "Body bytes handed to the gzip workers.",
+                        gzip.bytes_in);
+  Metrics::render_value(out,
+                        "proxy_gzip_output_bytes_total",
+                        "counter",
+                        "Gzip bytes stored next to the bodies.",
+                        gzip.bytes_out);
+  Metrics::render_value(out,
+                        "proxy_gzip_queued_bytes",
+                        "gauge",
+                        "Body bytes waiting for a gzip worker.",
+                        gzip.queued_bytes);
+}
+
+void ProxyServer::render_metrics(std::string & out) {
+  Metrics::render(out);
+  Latency::render(out);
+  CacheStats cache = shared_.http_cache.stats();
+  Metrics::render_value(
+      out, "proxy_cache_entries", "gauge", "Responses held in the cache.", cache.entries);
+  Metrics::render_value(out,
+                        "proxy_cache_bytes",
+                        "gauge",
+                        "Bytes charged against the cache budget.",
+                        cache.bytes_used);
+  Metrics::render_value(out,
+                        "proxy_cache_capacity_bytes",
+                        "gauge",
+                        "The cache budget.",
+                        cache.capacity_bytes);
+  Metrics::render_value(out,
+                        "proxy_cache_evictions_total",
+                        "counter",
+                        "Entries pushed out of the cache to make room.",
+                        cache.evictions);
+  Metrics::render_value(out,
+                        "proxy_cache_rejections_total",
+                        "counter",
+                        "Entries the admission filter kept out of the cache.",
+                        cache.rejections);
+  if (shared_.disk_cache) {
+    render_disk_metrics(out, shared_.disk_cache->stats());
+  }
+  if (shared_.compression.enabled()) {
+    render_compression_metrics(out, shared_.compression.stats());
+  }
+  size_t idle_upstream = 0;
+  for (auto & l : listeners_) {
+    idle_upstream += l->idle_upstream_connections();
+  }
+  Metrics::render_value(out,
+                        "proxy_upstream_idle_connections",
+                        "gauge",
+                        "Origin connections waiting in the pool.",
+                        idle_upstream);
+  BufferPool::Stats buffers = BufferPool::stats();
+  Metrics::render_value(out,
+                        "proxy_tunnel_buffer_bytes",
+                        "gauge",
+                        "Relay buffer bytes held by tunnels and bodies moving data.",
+                        buffers.in_use_bytes);
+  Metrics::render_value(out,
+                        "proxy_tunnel_buffer_pooled_bytes",
+                        "gauge",
+                        "Relay buffer bytes waiting in the free lists.",
+                        buffers.pooled_bytes);
+}
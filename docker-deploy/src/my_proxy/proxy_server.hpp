@@ -1,5 +1,6 @@
 #ifndef PROXY_SERVER
 #define PROXY_SERVER
+#include "disk_cache.hpp"
 #include "session.hpp"
 
 namespace beast = boost::beast;  // from <boost/beast.hpp>
@@ -8,31 +9,143 @@ namespace net = boost::asio;     // from <boost/asio.hpp>
 namespace ph = boost::asio::placeholders;
 using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
 
+/**
+ * what the listeners of every io_context share: the log, the response and
+ * resolver caches (both safe to use from any thread) and the request ids
+*/
+struct SharedState {
+  LogPipeline & log_pipeline;
+  // the tier behind http_cache, null unless a directory is given
+  std::unique_ptr<DiskCache> disk_cache;
+  Cache<CacheKey, CachedResponsePtr> http_cache;
+  // gzips entries of http_cache, declared after it so it stops first
+  CompressionPool compression;
+  DnsCache dns_cache;
+  CollapsedForwarding collapsing;
+  // log ids, one per request (persistent connections draw more than one)
+  std::atomic<int> num_of_session;
+
+  // lookups complete on resolver_ioc before they are posted to the sessions
+  SharedState(LogPipeline & log_pipeline,
+              size_t cache_bytes,
+              net::io_context & resolver_ioc,
+              std::chrono::milliseconds collapse_wait = std::chrono::milliseconds(5000),
+              const std::string & disk_dir = "",
+              size_t disk_bytes = 0,
+              size_t gzip_threads = 2) :
+      log_pipeline(log_pipeline),
+      http_cache(cache_bytes),
+      compression(http_cache, gzip_threads),
+      dns_cache(std::make_shared<AsioDnsBackend>(resolver_ioc)),
+      collapsing(collapse_wait),
+      num_of_session(0) {
+    if (!disk_dir.empty()) {
+      disk_cache.reset(new DiskCache(disk_dir, disk_bytes));
+      if (disk_cache->usable()) {
+        http_cache.set_tier(disk_cache.get());
+      }
+    }
+  }
+};
+
 class listener : public std::enable_shared_from_this<listener> {
   net::io_context & ioc_;
   tcp::acceptor acceptor_;
-  std::ofstream & logfile;
-  Cache<std::string, CachedResponse> http_cache;
-  int num_of_session;
-  std::mutex & my_mutex;
+  SharedState & shared_;
+  // upstream connections are pooled per listener, a core reuses its own
+  ConnectionPool upstream_pool;
+  net::steady_timer pool_timer_;
+  // the latency summary in the log covers what happened since the last one
+  net::steady_timer latency_timer_;
+  Latency::Snapshot last_latency_;
 
   void fail(beast::error_code ec, char const * what) {
     std::cerr << what << ": " << ec.message() << "\n";
   }
 
  public:
+  // reuse_port lets the listeners of several io_contexts bind the same
+  // endpoint, the kernel spreads the connections over them
   listener(net::io_context & ioc,
            tcp::endpoint endpoint,
-           std::ofstream & logfile,
-           int capacity,
-           std::mutex & my_mutex);
+           SharedState & shared,
+           bool reuse_port = false);
 
   // Start accepting incoming connections
-  void run() { do_accept(); }
+  void run() {
+    do_accept();
+    schedule_pool_sweep();
+  }
+
+  // a line of per-phase latency percentiles in the log every minute, one
+  // listener of a proxy does this
+  void report_latency() { schedule_latency_summary(); }
+
+  size_t idle_upstream_connections() { return upstream_pool.size(); }
 
  private:
+  // close pooled upstream connections that have been idle too long
+  void schedule_pool_sweep();
+
+  void on_pool_sweep(beast::error_code ec);
+
+  void schedule_latency_summary();
+
+  void on_latency_summary(beast::error_code ec);
+
   void do_accept();
 
-  void on_accept(beast::error_code ec, tcp::socket socket);
+  void on_accept(beast::error_code ec, strand_socket socket);
+};
+/**
+ * the io_contexts of a proxy and the threads running them.
+ * shared: one io_context run by every thread, each session on a strand of
+ * its own, any thread may run any session.
+ * per_core: one io_context, listener and thread per core, the thread pinned
+ * to its core. a session stays on the thread that accepted it, upstream
+ * connections are pooled per core, only the caches and the log are shared.
+*/
+class ProxyServer {
+ public:
+  enum ThreadModel { shared, per_core };
+
+ private:
+  ThreadModel model_;
+  int threads_;
+  std::vector<std::unique_ptr<net::io_context> > contexts_;
+  SharedState shared_;
+  std::vector<std::shared_ptr<listener> > listeners_;
+  std::atomic<bool> signalled_{false};
+
+ public:
+  ProxyServer(ThreadModel model,
+              int threads,
+              tcp::endpoint endpoint,
+              LogPipeline & log_pipeline,
+              size_t cache_bytes,
+              std::chrono::milliseconds collapse_wait = std::chrono::milliseconds(5000),
+              const std::string & disk_dir = "",
+              size_t disk_bytes = 0,
+              size_t gzip_threads = 2);
+  ~ProxyServer();
+
+  // "shared" or "per-core", false for anything else
+  static bool parse_thread_model(const std::string & name, ThreadModel & model);
+
+  // where the first listener runs, for the odd timer of the embedding code
+  net::io_context & context() { return *contexts_.front(); }
+
+  // the proxy counters plus the cache, pool and buffer gauges, for the
+  // admin port. safe to call from any thread
+  void render_metrics(std::string & out);
+
+  // serve on the calling thread and the ones started here, until stopped
+  // or sent SIGINT or SIGTERM
+  void run();
+
+  void stop();
+
+  // run() returned because of a signal, the process should exit
+  bool signalled() const { return signalled_; }
 };
 #endif  //PROXY_SERVER
\ No newline at end of file
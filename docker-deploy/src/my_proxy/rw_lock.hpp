@@ -0,0 +1,36 @@
+#ifndef RW_LOCK
+#define RW_LOCK
+
+#include <pthread.h>
+
+/**
+ * thin reader/writer lock over pthread_rwlock_t
+ * (std::shared_mutex needs c++17, boost::shared_mutex needs libboost_thread)
+*/
+class RWLock {
+  pthread_rwlock_t rwlock;
+
+ public:
+  RWLock() { pthread_rwlock_init(&rwlock, nullptr); }
+  ~RWLock() { pthread_rwlock_destroy(&rwlock); }
+  RWLock(const RWLock &) = delete;
+  RWLock & operator=(const RWLock &) = delete;
+
+  void lock() { pthread_rwlock_wrlock(&rwlock); }
+  void unlock() { pthread_rwlock_unlock(&rwlock); }
+  void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+  void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+};
+
+// scoped shared (reader) ownership, the counterpart of std::lock_guard
+class SharedLockGuard {
+  RWLock & rw;
+
+ public:
+  explicit SharedLockGuard(RWLock & rw) : rw(rw) { rw.lock_shared(); }
+  ~SharedLockGuard() { rw.unlock_shared(); }
+  SharedLockGuard(const SharedLockGuard &) = delete;
+  SharedLockGuard & operator=(const SharedLockGuard &) = delete;
+};
+
+#endif  //RW_LOCK
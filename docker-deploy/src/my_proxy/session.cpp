@@ -2,65 +2,334 @@
 
 #include "cache_handler.hpp"
 
+#include <limits>
+
+// how long a client connection may sit idle waiting for its next request
+static const std::chrono::seconds client_idle_timeout(15);
+// how long a relayed body may stall in either direction
+static const std::chrono::seconds relay_idle_timeout(15);
+// an origin that does not answer the handshake by then counts as failed,
+// its cached entries are served instead where they allow it
+static const std::chrono::seconds connect_timeout(5);
+// bytes of body moved per read while relaying
+static const size_t relay_buf_size = 64 * 1024;
+// how long an upload waits for the origin to answer Expect: 100-continue
+// before the body is sent anyway
+static const std::chrono::seconds continue_timeout(1);
+static const std::string continue_line = "HTTP/1.1 100 Continue\r\n\r\n";
+
+namespace {
+// headers and bodies are written separately, Nagle would hold a body back
+// until the peer acknowledges its header
+void disable_nagle(strand_stream & stream) {
+  beast::error_code ignored;
+  stream.socket().set_option(tcp::no_delay(true), ignored);
+}
+}  // namespace
+
+session::~session() {
+  finish_leading(nullptr);
+  Metrics::add(Metrics::sessions_closed);
+}
+
 void session::run() {
   // We need to be executing within a strand to perform async operations
   // on the I/O objects in this session. Although not strictly necessary
   // for single-threaded contexts, this example code is written to be
   // thread-safe by default.
-  client_.expires_after(std::chrono::seconds(15));
-  http::async_read(
+  disable_nagle(client_);
+  beast::error_code ec;
+  client_addr_ = client_.socket().remote_endpoint(ec).address().to_string();
+  do_read_request();
+}
+
+void session::end_phase(Latency::Phase phase) {
+  Latency::clock::time_point now = Latency::clock::now();
+  Latency::record(phase, now - phase_start_);
+  phase_start_ = now;
+}
+
+void session::do_read_request() {
+  // pipelined requests may already be waiting in lead_in_, async_read
+  // consumes those before touching the socket
+  client_.expires_after(client_idle_timeout);
+  req_parser_.emplace(
+      std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc()));
+  // request bodies are streamed, their size no longer matters
+  req_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+  http::async_read_header(
       client_,
       lead_in_,
-      req_,
-      beast::bind_front_handler(&session::on_connect_request, shared_from_this()));
+      *req_parser_,
+      make_handler(&session::on_connect_request));
+}
+
+void session::finish_request() {
+  // a fetch that ended without an entry lets its followers go
+  finish_leading(nullptr);
+  // an upstream connection whose response was completely framed goes back
+  // to the pool, anything else is closed
+  if (upstream_reusable_ && req_.method() != http::verb::connect &&
+      server_lead_in_.size() == 0) {
+    upstream_pool_.release(host, port, server_.socket());
+  }
+  else {
+    beast::error_code ec;
+    server_.socket().shutdown(tcp::socket::shutdown_both, ec);
+  }
+  server_.close();
+  upstream_reusable_ = false;
+  server_lead_in_.consume(server_lead_in_.size());
+  continue_timer_.cancel();
+  upload_serializer_.reset();
+  // an idle keep-alive connection holds no relay buffer
+  relay_buf_.reset();
+  revalidating_.reset();
+  filling_ = false;
+  range_refetched_ = false;
+  if (!keep_alive_ || request_body_pending()) {
+    // log tunnel closed in do_close()
+    lw_.log_tunnel_closed();
+    return do_close();
+  }
+  // everything the request kept in the arena goes, then the arena itself
+  req_parser_.reset();
+  relay_serializer_.reset();
+  relay_parser_.reset();
+  upload_msg_ = arena_message<upload_type>();
+  req_ = arena_message<request_type>();
+  res_ = arena_message<response_type>();
+  arena_.reset();
+  ++served_;
+  do_read_request();
+}
+
+bool session::client_wants_keep_alive() const {
+  // Proxy-Connection is the non-standard header clients send to proxies,
+  // a close in either header ends the connection
+  auto it = req_.find("Proxy-Connection");
+  if (it != req_.end()) {
+    if (beast::iequals(it->value(), "close")) {
+      return false;
+    }
+    if (beast::iequals(it->value(), "keep-alive") &&
+        req_.find(http::field::connection) == req_.end()) {
+      return true;
+    }
+  }
+  return req_.keep_alive();
+}
+
+bool session::request_body_pending() const {
+  return req_parser_ && !req_parser_->is_done();
+}
+
+void session::prepare_client_response() {
+  // Connection is hop-by-hop, tell the client what we will do and make sure
+  // the body is framed so the next response can follow it. an unread upload
+  // leaves the connection unframed, it has to close
+  if (request_body_pending()) {
+    keep_alive_ = false;
+  }
+  res_.keep_alive(keep_alive_);
+  res_.prepare_payload();
 }
 
 void session::on_connect_request(boost::system::error_code ec,
                                  std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "on connect request");
+  if (check_error(ec, bytes_transferred, "on connect request")) {
+    return;
+  }
+  if (served_ == 0) {
+    // later requests on the connection start with an idle wait
+    end_phase(Latency::request_parsed);
+  }
+  // the header moves into req_, the parser keeps the body framing
+  req_ = request_type(std::move(req_parser_->get().base()));
+  switch (req_.method()) {
+    case http::verb::get:
+      Metrics::add(Metrics::requests_get);
+      break;
+    case http::verb::post:
+      Metrics::add(Metrics::requests_post);
+      break;
+    case http::verb::put:
+      Metrics::add(Metrics::requests_put);
+      break;
+    case http::verb::connect:
+      Metrics::add(Metrics::requests_connect);
+      break;
+    default:
+      Metrics::add(Metrics::requests_other);
+      break;
+  }
   //we receive client request here, then we need to log the request
-  std::string client_addr = client_.socket().remote_endpoint().address().to_string();
-  lw_.log_request_from_client(req_, client_addr);
-  std::pair<std::string, std::string> server_name = hp.get_server_name(req_);
-  host = server_name.first;
-  port = server_name.second;
-  try {
-    auto eps = tcp::resolver(server_.get_executor()).resolve(host, port);
-    server_.async_connect(
-        eps, beast::bind_front_handler(&session::on_connect, shared_from_this()));
-  }
-  catch (std::exception & e) {
-    send_bad_response(http::status::bad_request, "Bad Request");
+  if (served_ > 0) {
+    // every request on a persistent connection gets its own log id
+    lw_.set_id(request_ids_++);
+  }
+  keep_alive_ = client_wants_keep_alive();
+  const auto & if_none_match = req_[http::field::if_none_match];
+  client_if_none_match_.assign(if_none_match.data(), if_none_match.size());
+  const auto & if_modified_since = req_[http::field::if_modified_since];
+  client_if_modified_since_.assign(if_modified_since.data(), if_modified_since.size());
+  const auto & range = req_[http::field::range];
+  client_range_.assign(range.data(), range.size());
+  const auto & if_range = req_[http::field::if_range];
+  client_if_range_.assign(if_range.data(), if_range.size());
+  lw_.log_request_from_client(req_, client_addr_);
+  hp.get_server_name(req_, host, port);
+  if (req_.method() == http::verb::get) {
+    // hits, stale answers and followers of a concurrent fetch never wait for
+    // an origin connection, a GET opens one only when it fetches
+    return handle_get_request();
   }
+  open_upstream();
 }
 
-void session::on_write_bad_client(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "on write bad client");
+void session::open_upstream() {
+  // tunnels always get a connection of their own
+  if (req_.method() != http::verb::connect &&
+      upstream_pool_.acquire(host, port, server_.socket())) {
+    reused_upstream_ = true;
+    return on_connect(beast::error_code(), tcp::endpoint());
+  }
+  reused_upstream_ = false;
+  connect_upstream(&session::on_connect);
+}
+
+void session::connect_upstream(connect_handler handler) {
+  start_phase();
+  auto self = shared_from_this();
+  dns_.async_resolve(host,
+                     port,
+                     server_.get_executor(),
+                     [self, handler](beast::error_code ec, Endpoints endpoints) {
+                       self->on_resolve(handler, ec, endpoints);
+                     });
+}
+
+void session::on_resolve(connect_handler handler,
+                         beast::error_code ec,
+                         const Endpoints & endpoints) {
+  if (ec) {
+    Metrics::add(Metrics::upstream_resolve_failures);
+    if (serve_cached_on_error()) {
+      return;
+    }
+    return send_bad_response(http::status::bad_request, "Bad Request");
+  }
+  end_phase(Latency::resolve);
+  // without a deadline a blackholed origin holds us for the kernel's SYN
+  // retries, minutes
+  server_.expires_after(connect_timeout);
+  server_.async_connect(endpoints, make_handler(handler));
+}
+
+void session::on_reconnect(beast::error_code ec,
+                           tcp::resolver::results_type::endpoint_type) {
+  if (ec) {
+    Metrics::add(Metrics::upstream_connect_failures);
+    if (serve_cached_on_error()) {
+      return;
+    }
+    return send_bad_response(http::status::bad_request, "Bad Request");
+  }
+  upstream_connected();
+  server_.expires_after(std::chrono::seconds(15));
+  send_upstream_request();
+}
+
+void session::upstream_connected() {
+  end_phase(Latency::connect);
+  // pooled connections keep the option
+  disable_nagle(server_);
+}
+
+void session::hold_relay_buf() {
+  if (!relay_buf_.data()) {
+    relay_buf_.acquire(relay_buf_size);
+  }
+}
+
+bool session::retry_upstream(beast::error_code ec) {
+  // a pooled connection can be closed by the origin between the liveness
+  // check and our request, try once more on a fresh connection
+  if (!ec || !reused_upstream_) {
+    return false;
+  }
+  reused_upstream_ = false;
+  beast::error_code ignored;
+  server_.socket().shutdown(tcp::socket::shutdown_both, ignored);
+  server_.close();
+  server_lead_in_.consume(server_lead_in_.size());
+  res_ = arena_message<response_type>();
+  // a 100 Continue wait starts over on the new connection, the old timer
+  // must not cancel its connect
+  continue_timer_.cancel();
+  continue_timed_out_ = false;
+  connect_upstream(&session::on_reconnect);
+  return true;
+}
+
+void session::send_upstream_request() {
+  upstream_reusable_ = false;
+  if (req_.method() == http::verb::post || req_.method() == http::verb::put) {
+    // only the header goes out now, the body follows piecewise
+    upload_msg_ = upload_type(req_.base());
+    upload_msg_.body().data = nullptr;
+    upload_msg_.body().more = request_body_pending();
+    upload_serializer_.emplace(upload_msg_);
+    return http::async_write_header(
+        server_,
+        *upload_serializer_,
+        make_handler(&session::post_on_write_server));
+  }
+  http::async_write(server_, req_, make_handler(&session::get_on_write_server));
+}
+
+void session::on_write_own_response(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "on write own response")) {
+    return;
+  }
+  end_phase(Latency::client_write);
   // log: ID: Responding "RESPONSE"
   lw_.log_response_to_client(res_);
-  // log tunnel closed in do_close()
-  lw_.log_tunnel_closed();
-  do_close();
+  finish_request();
 }
 
 void session::on_connect(beast::error_code ec,
                          tcp::resolver::results_type::endpoint_type) {
   if (ec) {
-    // may need to send back bad response to client
-    send_bad_response(http::status::bad_request, "Bad Request");
-    return fail(ec, "on connect");
+    Metrics::add(Metrics::upstream_connect_failures);
+    if (serve_cached_on_error()) {
+      return;
+    }
+    // send back bad response to client, it finishes the request
+    return send_bad_response(http::status::bad_request, "Bad Request");
   }
   /***
 	 * here connection to server has been built
 	*/
+  if (!reused_upstream_) {
+    upstream_connected();
+  }
   server_.expires_after(std::chrono::seconds(15));
+  // nothing has been sent on the connection yet
+  upstream_reusable_ = true;
+  if (req_.method() != http::verb::connect) {
+    // Proxy-Connection is ours, ask the origin to keep the connection open
+    // so it can be pooled
+    req_.erase("Proxy-Connection");
+    req_.keep_alive(true);
+  }
   if (req_.method() == http::verb::connect) {
     handle_connect_request();
   }
   else if (req_.method() == http::verb::get) {
-    handle_get_request();
+    send_upstream_request();
   }
-  else if (req_.method() == http::verb::post) {
+  else if (req_.method() == http::verb::post || req_.method() == http::verb::put) {
     handle_post_request();
   }
   else {
@@ -69,198 +338,900 @@ void session::on_connect(beast::error_code ec,
 }
 
 void session::handle_connect_request() {
-  res_ = {http::status::ok, req_.version()};
+  res_ = arena_message<response_type>();
+  res_.result(http::status::ok);
+  res_.version(req_.version());
   res_.keep_alive(true);
   res_.prepare_payload();
   auto self = shared_from_this();
-  http::async_write(
-      client_,
-      res_,
-      beast::bind_front_handler(&session::on_connect_response, shared_from_this()));
+  http::async_write(client_, res_, make_handler(&session::on_connect_response));
 }
 
 void session::handle_get_request() {
+  // the full body is fetched and cached, the ranges are cut from it
+  req_.erase(http::field::range);
+  req_.erase(http::field::if_range);
   // Check if there is cache in log
-  std::string key = hp.get_cache_key(req_);
-  CachedResponse cached_res = cache_handler.get(key);
-  if (cached_res != CachedResponse()) {  //cache has reaponse
-    if (cache_handler.cached_response_state(cached_res, req_) == "valid") {
+  hp.get_cache_key(req_, cache_key_);
+  // a URL whose responses vary moves cache_key_ to the client's variant
+  CachedResponsePtr cached_res = cache_handler.lookup(cache_key_, req_);
+  if (cached_res) {  //cache has reaponse
+    Freshness state = cache_handler.cached_response_state(*cached_res, req_);
+    if (state == Freshness::valid) {
+      Metrics::add(Metrics::cache_hit);
       // log: ID: in cache, valid
       lw_.log_valid();
-      http::response<http::string_body> resp = hp.parse_cached_response(cached_res);
-      return http::async_write(
-          client_,
-          resp,
-          beast::bind_front_handler(&session::get_on_write_client, shared_from_this()));
+      return respond_from_cache(cached_res);
     }
-    else if (cache_handler.cached_response_state(cached_res, req_) == "expired") {
+    else if (state == Freshness::stale) {
+      // stale-while-revalidate: the client does not wait for the origin
+      lw_.log_note("in cache, stale, refreshing in the background");
+      Metrics::add(Metrics::cache_stale);
+      CacheRefresh::start(net::make_strand(server_.get_executor().get_inner_executor()),
+                          request_ids_++,
+                          log_pipeline_,
+                          cache_handler.cache(),
+                          cache_handler.compression(),
+                          dns_,
+                          collapsing_,
+                          cache_key_,
+                          host,
+                          port,
+                          req_.target(),
+                          cached_res);
+      return respond_from_cache(cached_res);
+    }
+    else if (state == Freshness::expired) {
       // log: ID: in cache, but expired at EXPIREDTIME
-      lw_.log_expired(cached_res.get_expiration_time());
-      cache_handler.remove(key);
-      return http::async_write(
-          server_,
-          req_,
-          beast::bind_front_handler(&session::get_on_write_server, shared_from_this()));
+      lw_.log_expired(cached_res->get_expiration_time());
+      Metrics::add(Metrics::cache_expired);
+      // an entry allowing stale-if-error stays for the origin failing
+      if (!cache_handler.usable_on_error(*cached_res, req_)) {
+        cache_handler.remove(cache_key_);
+      }
+      // with a validator the origin can answer 304 instead of the body
+      if (!cached_res->e_tag.empty() || !cached_res->last_modified.empty()) {
+        revalidate(cached_res);
+      }
+      return fetch_or_follow();
     }
-    else if (cache_handler.cached_response_state(cached_res, req_) == "must-revalidate") {
+    else if (state == Freshness::must_revalidate) {
       // log: ID: in cache, requires validation
       lw_.log_require_validation();
-      req_ = {http::verb::get, "/", 11};
-      req_.set(http::field::host, cached_res.server);
-      req_.set(http::field::if_none_match, cached_res.e_tag);
-      return http::async_write(
-          server_,
-          req_,
-          beast::bind_front_handler(&session::get_on_write_server, shared_from_this()));
+      Metrics::add(Metrics::cache_revalidated);
+      revalidate(cached_res);
+      return fetch_or_follow();
     }
   }
   else {
     lw_.log_not_in_cache();
+    Metrics::add(Metrics::cache_miss);
 
-    http::async_write(
-        server_,
-        req_,
-        beast::bind_front_handler(&session::get_on_write_server, shared_from_this()));
+    fetch_or_follow();
+  }
+}
+
+void session::fetch_or_follow() {
+  if (!collapsing_.enabled()) {
+    return open_upstream();
+  }
+  unsigned generation = ++follow_generation_;
+  // the callback and the type-erased executor cost allocations, only a
+  // follower needs them
+  if (collapsing_.lead_or_follow(cache_key_, [this, generation] {
+        auto self = shared_from_this();
+        return CollapsedForwarding::Waiter{
+            server_.get_executor(), [self, generation](CachedResponsePtr entry) {
+              self->on_leader_done(generation, entry);
+            }};
+      })) {
+    leading_fetch_ = true;
+    return open_upstream();
+  }
+  // no origin connection is opened while we wait, the leader's entry
+  // usually makes it unnecessary
+  following_fetch_ = true;
+  follow_timer_.expires_after(collapsing_.wait_timeout());
+  follow_timer_.async_wait(make_handler(&session::on_follow_timeout));
+}
+
+void session::on_leader_done(unsigned generation, CachedResponsePtr entry) {
+  if (!following_fetch_ || generation != follow_generation_) {
+    // we gave up waiting and fetched on our own
+    return;
+  }
+  following_fetch_ = false;
+  follow_timer_.cancel();
+  if (!entry) {
+    lw_.log_note("concurrent fetch not cacheable, fetching");
+    return open_upstream();
+  }
+  if (!entry->vary.empty()) {
+    // the leader did not know the response varies, it may be another variant
+    std::string values;
+    HttpParser::get_variant(entry->vary, req_, values);
+    if (values != entry->variant) {
+      lw_.log_note("concurrent fetch got another variant, fetching");
+      return open_upstream();
+    }
+  }
+  Metrics::add(Metrics::cache_collapsed);
+  lw_.log_note("answered by a concurrent fetch");
+  respond_from_cache(entry);
+}
+
+void session::on_follow_timeout(beast::error_code ec) {
+  // a cancelled wait, or one that ended before the timer was set again
+  if (ec || !following_fetch_ ||
+      follow_timer_.expiry() > std::chrono::steady_clock::now()) {
+    return;
+  }
+  following_fetch_ = false;
+  lw_.log_note("concurrent fetch too slow, fetching");
+  open_upstream();
+}
+
+bool session::serve_cached_on_error() {
+  if (req_.method() != http::verb::get) {
+    return false;
+  }
+  // the entry may have changed since handle_get_request looked it up.
+  // cache_key_ may be the key we lead the fetch of, it is left alone
+  CacheKey key;
+  hp.get_cache_key(req_, key);
+  CachedResponsePtr cached = cache_handler.lookup(key, req_);
+  if (!cached) {
+    return false;
+  }
+  Freshness state = cache_handler.cached_response_state(*cached, req_);
+  if (state != Freshness::valid && state != Freshness::stale &&
+      !cache_handler.usable_on_error(*cached, req_)) {
+    return false;
+  }
+  lw_.log_warning("origin failed, answered from the cache");
+  Metrics::add(Metrics::served_on_error);
+  upstream_reusable_ = false;
+  relay_parser_.reset();
+  respond_from_cache(cached);
+  return true;
+}
+
+void session::finish_leading(CachedResponsePtr entry) {
+  if (leading_fetch_) {
+    leading_fetch_ = false;
+    collapsing_.finish(cache_key_, std::move(entry));
   }
 }
 
 void session::get_on_write_server(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "get on write server");
+  if (retry_upstream(ec)) {
+    return;
+  }
+  if (ec && serve_cached_on_error()) {
+    return;
+  }
+  if (check_error(ec, bytes_transferred, "get on write server")) {
+    return;
+  }
+  start_phase();
   // log: ID: Requesting "REQUEST" from SERVER
   lw_.log_request_to_server(req_, host);
-  http::async_read(
+  // only the header is read here, the body is relayed as it arrives
+  relay_parser_.emplace(
+      std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc()));
+  // boost::none would disable the limit, but beast 1.74 compares content
+  // lengths against the empty optional and rejects them
+  relay_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+  http::async_read_header(
       server_,
-      lead_in_,
-      res_,
-      beast::bind_front_handler(&session::get_on_read_server, shared_from_this()));
+      server_lead_in_,
+      *relay_parser_,
+      make_handler(&session::get_on_read_server));
 }
 
 void session::get_on_read_server(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "get on read server");
+  if (retry_upstream(ec)) {
+    return;
+  }
+  if (ec && serve_cached_on_error()) {
+    return;
+  }
+  if (check_error(ec, bytes_transferred, "get on read server")) {
+    return;
+  }
+  end_phase(Latency::upstream_ttfb);
+  relay_type & msg = relay_parser_->get();
   // log: ID: Received "RESPONSE" from SERVER
-  lw_.log_response_from_server(res_, host);
-  std::string cached_key = hp.get_cache_key(req_);
-  CachedResponse cr = cache_handler.get_cached_response(cached_key);
-  if (res_.result() == http::status::not_modified) {
-    res_ = hp.parse_cached_response(cr);
-    return http::async_write(
-        client_,
-        res_,
-        beast::bind_front_handler(&session::get_on_write_client, shared_from_this()));
-  }
-  else if (res_.result() == http::status::ok) {
-    // Save cache here
-    if (cache_handler.can_be_cached(res_)) {
-      std::string cache_key = hp.get_cache_key(req_);
-      CachedResponse cache_value = hp.parse_response(res_);
-      cache_handler.cache_response(cache_key, cache_value);
+  lw_.log_response_from_server(msg, host);
+  if (msg.result() == http::status::not_modified && revalidating_) {
+    // a 304 has no body, the connection is ready for the next request
+    upstream_reusable_ = relay_parser_->is_done() && !relay_parser_->need_eof();
+    // entries are shared and immutable, a renewed copy replaces ours
+    CachedResponsePtr renewed = hp.renew(*revalidating_, msg);
+    relay_parser_.reset();
+    cache_handler.cache_response(cache_key_, renewed);
+    finish_leading(renewed);
+    return respond_from_cache(renewed);
+  }
+  else if ((msg.result() >= http::status::ok &&
+            msg.result() < beast::http::status::multiple_choices) ||
+           msg.result() == http::status::not_modified) {
+    // a 304 to the client's own conditions is relayed like any answer
+    // Save cache here, the body is copied into the entry while it streams
+    if (msg.result() == http::status::ok) {
+      // Cache-Control is parsed once, for the decision and for the entry
+      CacheControl directives = CacheControl::parse(msg[http::field::cache_control]);
+      if (cache_handler.can_be_cached(msg, directives)) {
+        tee_ = hp.parse_response(msg, directives);
+        HttpParser::get_variant(tee_->vary, req_, tee_->variant);
+      }
+    }
+    if (!tee_) {
+      // there will be no entry, waiting for the body helps nobody
+      finish_leading(nullptr);
+    }
+    if (msg.result() == http::status::ok && !client_range_.empty() &&
+        !range_refetched_) {
+      if (!tee_ || (relay_parser_->content_length() &&
+                    *relay_parser_->content_length() > cache_handler.max_entry_bytes())) {
+        return refetch_range();
+      }
+      filling_ = true;
+      return relay_read_body();
+    }
+    return relay_response_header();
+  }
+  else {
+    int status = msg.result_int();
+    if ((status == 500 || status == 502 || status == 503 || status == 504) &&
+        serve_cached_on_error()) {
+      return;
+    }
+    relay_parser_.reset();
+    send_bad_response(http::status::bad_gateway, "502 Bad Gateway");
+  }
+}
+
+void session::relay_response_header() {
+  relay_type & msg = relay_parser_->get();
+  // Connection is hop-by-hop. a body delimited by the origin closing the
+  // connection is re-framed as chunked when the client connection stays open
+  if (request_body_pending()) {
+    keep_alive_ = false;
+  }
+  if (!relay_parser_->content_length() && !relay_parser_->chunked() &&
+      !relay_parser_->is_done()) {
+    if (keep_alive_ && msg.version() == 11) {
+      msg.chunked(true);
+    }
+    else {
+      keep_alive_ = false;
     }
-    return http::async_write(
-        client_,
-        res_,
-        beast::bind_front_handler(&session::get_on_write_client, shared_from_this()));
   }
-  else if (res_.result() > beast::http::status::ok &&
-           res_.result() < beast::http::status::multiple_choices) {
+  msg.keep_alive(keep_alive_);
+  msg.body().data = nullptr;
+  msg.body().more = !relay_parser_->is_done();
+  relay_serializer_.emplace(msg);
+  client_.expires_after(relay_idle_timeout);
+  http::async_write_header(
+      client_,
+      *relay_serializer_,
+      make_handler(&session::get_on_relay_write));
+}
+
+void session::relay_read_body() {
+  if (relay_parser_->is_done() && filling_) {
+    return finish_fill();
+  }
+  if (relay_parser_->is_done()) {
+    // flush whatever the serializer still owes (the last chunk, if any)
+    relay_type & msg = relay_parser_->get();
+    msg.body().data = nullptr;
+    msg.body().size = 0;
+    msg.body().more = false;
+    client_.expires_after(relay_idle_timeout);
     return http::async_write(
         client_,
-        res_,
-        beast::bind_front_handler(&session::get_on_write_client, shared_from_this()));
+        *relay_serializer_,
+        make_handler(&session::get_on_relay_write));
+  }
+  hold_relay_buf();
+  relay_type & msg = relay_parser_->get();
+  msg.body().data = relay_buf_.data();
+  msg.body().size = relay_buf_.size();
+  server_.expires_after(relay_idle_timeout);
+  http::async_read(
+      server_,
+      server_lead_in_,
+      *relay_parser_,
+      make_handler(&session::get_on_relay_read));
+}
+
+void session::get_on_relay_read(beast::error_code ec, std::size_t bytes_transferred) {
+  // a full buffer is not an error, it is our turn to forward it
+  if (ec == http::error::need_buffer) {
+    ec = {};
+  }
+  if (check_error(ec, bytes_transferred, "get on relay read")) {
+    return;
+  }
+  relay_type & msg = relay_parser_->get();
+  size_t got = relay_buf_.size() - msg.body().size;
+  if (relay_parser_->is_done()) {
+    end_phase(Latency::upstream_body);
+  }
+  if (tee_) {
+    if (tee_->body.size() + got > cache_handler.max_entry_bytes()) {
+      lw_.log_note("response too large to cache");
+      tee_.reset();
+      finish_leading(nullptr);
+      if (filling_) {
+        return refetch_range();
+      }
+    }
+    else {
+      tee_->body.append(relay_buf_.data(), got);
+    }
+  }
+  if (filling_) {
+    return relay_read_body();
+  }
+  if (got == 0 && !relay_parser_->is_done()) {
+    return relay_read_body();
+  }
+  msg.body().data = relay_buf_.data();
+  msg.body().size = got;
+  msg.body().more = !relay_parser_->is_done();
+  client_.expires_after(relay_idle_timeout);
+  http::async_write(
+      client_,
+      *relay_serializer_,
+      make_handler(&session::get_on_relay_write));
+}
+
+void session::get_on_relay_write(beast::error_code ec, std::size_t bytes_transferred) {
+  // the serializer wants the next piece of the body
+  if (ec == http::error::need_buffer) {
+    ec = {};
+  }
+  if (check_error(ec, bytes_transferred, "get on relay write")) {
+    return;
+  }
+  if (!relay_serializer_->is_done()) {
+    return relay_read_body();
+  }
+  get_on_write_client();
+}
+
+void session::get_on_write_client() {
+  end_phase(Latency::client_write);
+  // log: ID: Responding "RESPONSE"
+  lw_.log_response_to_client(relay_parser_->get());
+  // an origin that answered without the upload may still be waiting for it
+  upstream_reusable_ = !relay_parser_->need_eof() && !request_body_pending();
+  if (tee_) {
+    // the body is complete, publish the entry
+    hp.serialize_header(*tee_);
+    cache_handler.cache_response(cache_key_, tee_);
+    // the followers get the entry even if the cache turned it away
+    finish_leading(tee_);
+    tee_.reset();
+  }
+  relay_serializer_.reset();
+  relay_parser_.reset();
+  finish_request();
+}
+
+void session::finish_fill() {
+  filling_ = false;
+  upstream_reusable_ = !relay_parser_->need_eof() && !request_body_pending();
+  hp.serialize_header(*tee_);
+  cache_handler.cache_response(cache_key_, tee_);
+  finish_leading(tee_);
+  CachedResponsePtr entry = std::move(tee_);
+  relay_parser_.reset();
+  respond_from_cache(std::move(entry));
+}
+
+void session::refetch_range() {
+  Metrics::add(Metrics::range_refetched);
+  lw_.log_note("range of an uncacheable response, fetching the range");
+  range_refetched_ = true;
+  filling_ = false;
+  tee_.reset();
+  finish_leading(nullptr);
+  // the full body may still be on its way, this connection cannot be reused
+  relay_parser_.reset();
+  beast::error_code ignored;
+  server_.socket().shutdown(tcp::socket::shutdown_both, ignored);
+  server_.close();
+  server_lead_in_.consume(server_lead_in_.size());
+  upstream_reusable_ = false;
+  reused_upstream_ = false;
+  // the origin answers the client's own request now, conditions included
+  revalidating_.reset();
+  std::pair<http::field, const std::string *> fields[] = {
+      {http::field::if_none_match, &client_if_none_match_},
+      {http::field::if_modified_since, &client_if_modified_since_},
+      {http::field::range, &client_range_},
+      {http::field::if_range, &client_if_range_}};
+  for (const auto & field : fields) {
+    if (field.second->empty()) {
+      req_.erase(field.first);
+    }
+    else {
+      req_.set(field.first, *field.second);
+    }
+  }
+  connect_upstream(&session::on_reconnect);
+}
+
+void session::revalidate(const CachedResponsePtr & cached) {
+  revalidating_ = cached;
+  if (cached->e_tag.empty()) {
+    req_.erase(http::field::if_none_match);
   }
   else {
-    send_bad_response(http::status::bad_gateway, "502 Bad Gateway");
+    req_.set(http::field::if_none_match, cached->e_tag);
+  }
+  if (cached->last_modified.empty()) {
+    req_.erase(http::field::if_modified_since);
+  }
+  else {
+    req_.set(http::field::if_modified_since, cached->last_modified);
+  }
+}
+
+void session::respond_from_cache(CachedResponsePtr cached) {
+  if (CacheHandler::not_modified(
+          *cached, client_if_none_match_, client_if_modified_since_)) {
+    Metrics::add(Metrics::cache_not_modified);
+    return send_not_modified(*cached);
+  }
+  write_cached_response(std::move(cached));
+}
+
+void session::send_not_modified(const CachedResponse & cached) {
+  res_ = arena_message<response_type>();
+  res_.result(http::status::not_modified);
+  res_.version(req_.version());
+  res_.set(http::field::server, cached.server);
+  if (!cached.e_tag.empty()) {
+    res_.set(http::field::etag, cached.e_tag);
+  }
+  if (!cached.last_modified.empty()) {
+    res_.set(http::field::last_modified, cached.last_modified);
+  }
+  prepare_client_response();
+  start_phase();
+  http::async_write(client_, res_, make_handler(&session::on_write_own_response));
+}
+
+void session::write_cached_response(CachedResponsePtr cached) {
+  // hold a reference until the write completes, the cache may drop the
+  // entry meanwhile
+  cached_res_ = std::move(cached);
+  start_phase();
+  if (request_body_pending()) {
+    keep_alive_ = false;
+  }
+  // the stored header has no Connection field, splice one in before the
+  // blank line when this is the last response on the connection
+  static const std::string close_header = "Connection: close\r\n\r\n";
+  bool accepts_gzip = HttpParser::accepts_gzip(req_);
+  if (!accepts_gzip && cached_res_->gzip_encoded()) {
+    return write_inflated_response();
+  }
+  // a range the entry no longer matches (If-Range) gets the whole body
+  if (!client_range_.empty() &&
+      CacheHandler::range_validates(*cached_res_, client_if_range_)) {
+    std::vector<ByteRange> ranges;
+    RangeResult result =
+        HttpParser::parse_range(client_range_, cached_res_->body.size(), ranges);
+    if (result == RangeResult::satisfiable) {
+      return write_ranges(ranges);
+    }
+    if (result == RangeResult::unsatisfiable) {
+      return send_range_not_satisfiable(cached_res_->body.size());
+    }
+  }
+  bool gzip = accepts_gzip && !cached_res_->gzip_body.empty();
+  if (gzip) {
+    Metrics::add(Metrics::cache_gzip_served);
+  }
+  const std::string & header =
+      gzip ? cached_res_->gzip_wire_header : cached_res_->wire_header;
+  std::array<net::const_buffer, 3> buffers = {
+      {keep_alive_ ? net::buffer(header) : net::buffer(header.data(), header.size() - 2),
+       keep_alive_ ? net::const_buffer() : net::buffer(close_header),
+       net::buffer(gzip ? cached_res_->gzip_body : cached_res_->body)}};
+  net::async_write(client_, buffers, make_handler(&session::on_write_cached_client));
+}
+
+void session::write_ranges(const std::vector<ByteRange> & ranges) {
+  Metrics::add(Metrics::range_partial);
+  std::vector<size_t> ends;
+  hp.serialize_partial(*cached_res_, ranges, keep_alive_, range_text_, ends);
+  // the slices point into the entry, cached_res_ holds it until the write ends
+  std::vector<net::const_buffer> buffers;
+  size_t start = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    buffers.push_back(net::buffer(range_text_.data() + start, ends[i] - start));
+    buffers.push_back(net::buffer(cached_res_->body.data() + ranges[i].first,
+                                  ranges[i].last - ranges[i].first + 1));
+    start = ends[i];
   }
+  buffers.push_back(net::buffer(range_text_.data() + start, ends.back() - start));
+  net::async_write(client_, buffers, make_handler(&session::on_write_partial));
 }
 
-void session::get_on_write_client(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "get on write client");
+void session::send_range_not_satisfiable(size_t size) {
+  Metrics::add(Metrics::range_not_satisfiable);
+  cached_res_.reset();
+  res_ = arena_message<response_type>();
+  res_.result(http::status::range_not_satisfiable);
+  res_.version(req_.version());
+  res_.set(http::field::content_range, "bytes */" + std::to_string(size));
+  prepare_client_response();
+  http::async_write(client_, res_, make_handler(&session::on_write_own_response));
+}
+
+void session::on_write_partial(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "on write partial")) {
+    return;
+  }
+  end_phase(Latency::client_write);
   // log: ID: Responding "RESPONSE"
-  lw_.log_response_to_client(res_);
-  // log tunnel closed in do_close()
-  lw_.log_tunnel_closed();
-  do_close();
+  lw_.log_partial_response_to_client();
+  cached_res_.reset();
+  finish_request();
+}
+
+void session::write_inflated_response() {
+  Metrics::add(Metrics::cache_inflated);
+  // an HTTP/1.0 client cannot take chunks, the end of the body is the close
+  if (req_.version() < 11) {
+    keep_alive_ = false;
+  }
+  inflater_.reset(new GzipInflater(cached_res_->body));
+  hp.serialize_decoded_header(*cached_res_, keep_alive_, decoded_header_);
+  net::async_write(
+      client_, net::buffer(decoded_header_), make_handler(&session::on_write_inflated));
+}
+
+void session::on_write_inflated(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "on write inflated")) {
+    return;
+  }
+  // a slice per write keeps the strand responsive on large bodies
+  hold_relay_buf();
+  size_t got = 0;
+  if (!inflater_->read(relay_buf_.data(), relay_buf_.size(), got)) {
+    // the header is out, all that is left is to cut the body short
+    lw_.log_warning("cached gzip body is corrupt");
+    inflater_.reset();
+    cache_handler.remove(cache_key_);
+    keep_alive_ = false;
+    return do_close();
+  }
+  net::const_buffer slice(relay_buf_.data(), got);
+  if (!inflater_->done()) {
+    if (!keep_alive_) {
+      return net::async_write(client_, slice, make_handler(&session::on_write_inflated));
+    }
+    return net::async_write(
+        client_, http::make_chunk(slice), make_handler(&session::on_write_inflated));
+  }
+  inflater_.reset();
+  if (!keep_alive_) {
+    return net::async_write(
+        client_, slice, make_handler(&session::on_write_cached_client));
+  }
+  if (got == 0) {
+    return net::async_write(
+        client_, http::make_chunk_last(), make_handler(&session::on_write_cached_client));
+  }
+  net::async_write(client_,
+                   beast::buffers_cat(http::make_chunk(slice), http::make_chunk_last()),
+                   make_handler(&session::on_write_cached_client));
+}
+
+void session::on_write_cached_client(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "on write cached client")) {
+    return;
+  }
+  end_phase(Latency::client_write);
+  // log: ID: Responding "RESPONSE"
+  lw_.log_response_to_client(*cached_res_);
+  cached_res_.reset();
+  finish_request();
 }
 
 void session::handle_post_request() {
-  http::async_write(
-      server_,
-      req_,
-      beast::bind_front_handler(&session::post_on_write_server, shared_from_this()));
+  send_upstream_request();
 }
 
 void session::post_on_write_server(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "post on write server");
+  if (retry_upstream(ec)) {
+    return;
+  }
+  if (check_error(ec, bytes_transferred, "post on write server")) {
+    return;
+  }
   // log: ID: Requesting "REQUEST" from SERVER
   lw_.log_request_to_server(req_, host);
+  auto expect = req_.find(http::field::expect);
+  if (expect == req_.end() || !beast::iequals(expect->value(), "100-continue") ||
+      !request_body_pending()) {
+    return upload_read_body();
+  }
+  // the client holds the body back until it hears 100 Continue, let the
+  // origin decide first so a rejected upload is never transferred.
+  // origins that ignore Expect get the body after continue_timeout
+  continue_timed_out_ = false;
+  continue_timer_.expires_after(continue_timeout);
+  continue_timer_.async_wait(make_handler(&session::on_continue_timeout));
+  post_read_response();
+}
+
+void session::on_continue_timeout(beast::error_code ec) {
+  if (ec) {
+    // cancelled, the origin answered in time
+    return;
+  }
+  // abandon the pending header read, post_on_read_server starts the upload
+  continue_timed_out_ = true;
+  server_.socket().cancel(ec);
+}
+
+void session::on_write_continue(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "on write continue")) {
+    return;
+  }
+  upload_read_body();
+}
+
+void session::upload_read_body() {
+  // once body bytes are consumed the request cannot be replayed elsewhere
+  reused_upstream_ = false;
+  if (!request_body_pending()) {
+    // flush whatever the serializer still owes (the last chunk, if any)
+    upload_msg_.body().data = nullptr;
+    upload_msg_.body().size = 0;
+    upload_msg_.body().more = false;
+    server_.expires_after(relay_idle_timeout);
+    return http::async_write(
+        server_,
+        *upload_serializer_,
+        make_handler(&session::post_on_upload_write));
+  }
+  hold_relay_buf();
+  upload_type & msg = req_parser_->get();
+  msg.body().data = relay_buf_.data();
+  msg.body().size = relay_buf_.size();
+  client_.expires_after(relay_idle_timeout);
   http::async_read(
-      server_,
+      client_,
       lead_in_,
-      res_,
-      beast::bind_front_handler(&session::post_on_read_server, shared_from_this()));
+      *req_parser_,
+      make_handler(&session::post_on_upload_read));
 }
 
-void session::post_on_read_server(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "post on read server");
-  // log: ID: Received "RESPONSE" from SERVER
-  lw_.log_response_from_server(res_, host);
+void session::post_on_upload_read(beast::error_code ec, std::size_t bytes_transferred) {
+  // a full buffer is not an error, it is our turn to forward it
+  if (ec == http::error::need_buffer) {
+    ec = {};
+  }
+  if (check_error(ec, bytes_transferred, "post on upload read")) {
+    return;
+  }
+  size_t got = relay_buf_.size() - req_parser_->get().body().size;
+  if (got == 0 && request_body_pending()) {
+    return upload_read_body();
+  }
+  upload_msg_.body().data = relay_buf_.data();
+  upload_msg_.body().size = got;
+  upload_msg_.body().more = request_body_pending();
+  server_.expires_after(relay_idle_timeout);
   http::async_write(
-      client_,
-      res_,
-      beast::bind_front_handler(&session::post_on_write_client, shared_from_this()));
+      server_,
+      *upload_serializer_,
+      make_handler(&session::post_on_upload_write));
 }
-void session::post_on_write_client(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "get on write client");
-  // log: ID: Responding "RESPONSE"
-  lw_.log_response_to_client(res_);
-  // log tunnel closed in do_close()
-  lw_.log_tunnel_closed();
-  do_close();
+
+void session::post_on_upload_write(beast::error_code ec, std::size_t bytes_transferred) {
+  // the serializer wants the next piece of the body
+  if (ec == http::error::need_buffer) {
+    ec = {};
+  }
+  if (check_error(ec, bytes_transferred, "post on upload write")) {
+    return;
+  }
+  if (!upload_serializer_->is_done()) {
+    return upload_read_body();
+  }
+  upload_serializer_.reset();
+  // the response may be long in coming, the buffer waits in the pool
+  relay_buf_.reset();
+  post_read_response();
+}
+
+void session::post_read_response() {
+  start_phase();
+  relay_parser_.emplace(
+      std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc()));
+  relay_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+  server_.expires_after(relay_idle_timeout);
+  http::async_read_header(
+      server_,
+      server_lead_in_,
+      *relay_parser_,
+      make_handler(&session::post_on_read_server));
+}
+
+void session::post_on_read_server(beast::error_code ec, std::size_t bytes_transferred) {
+  if (ec == net::error::operation_aborted && continue_timed_out_) {
+    // the origin kept quiet, send the body and read the answer after it
+    continue_timed_out_ = false;
+    return net::async_write(
+        client_,
+        net::buffer(continue_line),
+        make_handler(&session::on_write_continue));
+  }
+  if (retry_upstream(ec)) {
+    return;
+  }
+  if (check_error(ec, bytes_transferred, "post on read server")) {
+    return;
+  }
+  continue_timer_.cancel();
+  continue_timed_out_ = false;
+  relay_type & msg = relay_parser_->get();
+  if (msg.result() == http::status::continue_ && request_body_pending()) {
+    // the origin accepts the upload, pass the go-ahead on to the client
+    return net::async_write(
+        client_,
+        net::buffer(continue_line),
+        make_handler(&session::on_write_continue));
+  }
+  if (msg.result_int() / 100 == 1) {
+    // other interim responses are not forwarded, wait for the final one
+    return post_read_response();
+  }
+  end_phase(Latency::upstream_ttfb);
+  // log: ID: Received "RESPONSE" from SERVER
+  lw_.log_response_from_server(msg, host);
+  if (request_body_pending()) {
+    // answered before the upload, the origin connection is out of step
+    upload_serializer_.reset();
+  }
+  relay_response_header();
 }
 
 void session::on_connect_response(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "on connect response");
+  if (check_error(ec, bytes_transferred, "on connect response")) {
+    return;
+  }
+  if (start_splice_tunnel()) {
+    return;
+  }
+  // the relay reads only what the readiness peek announced, it must never
+  // block the io thread
+  client_.socket().non_blocking(true, ec);
+  server_.socket().non_blocking(true, ec);
   client_do_read();
   server_do_read();
 }
 
+bool session::start_splice_tunnel() {
+  if (!SpliceRelay::supported()) {
+    return false;
+  }
+  // either direction ending closes the tunnel, like the user-space relay
+  auto self = shared_from_this();
+  SpliceRelay::DoneHandler done = [self](beast::error_code ec) {
+    self->fail(ec, "splice tunnel");
+  };
+  auto upstream = SpliceRelay::create(
+      client_.socket(), server_.socket(), Metrics::tunnel_bytes_upstream, done);
+  auto downstream = SpliceRelay::create(
+      server_.socket(), client_.socket(), Metrics::tunnel_bytes_downstream, done);
+  if (!upstream || !downstream) {
+    return false;
+  }
+  upstream->start();
+  downstream->start();
+  return true;
+}
+
 void session::client_do_read() {
-  client_.socket().async_read_some(
-      boost::asio::buffer(client_buf_),
-      beast::bind_front_handler(&session::client_on_read, shared_from_this()));
+  // wait for data without holding a buffer, an idle tunnel costs nothing
+  client_.socket().async_receive(
+      boost::asio::buffer(&client_peek_, 1),
+      tcp::socket::message_peek,
+      make_handler(&session::client_on_ready));
 }
-///to change
-void session::client_on_read(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "client on read");
-  async_write(
-      server_.socket(),
-      boost::asio::buffer(client_buf_,
-                          bytes_transferred),  //boost::asio::buffer(client_buf_, xfer),
-      beast::bind_front_handler(&session::client_on_written, shared_from_this()));
+
+void session::client_on_ready(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "client on read")) {
+    return;
+  }
+  client_buf_.acquire(client_buf_size_);
+  size_t n = client_.socket().read_some(
+      boost::asio::buffer(client_buf_.data(), client_buf_.size()), ec);
+  if (ec == net::error::would_block) {
+    client_buf_.reset();
+    return client_do_read();
+  }
+  if (check_error(ec, n, "client on read")) {
+    return;
+  }
+  Metrics::add(Metrics::tunnel_bytes_upstream, n);
+  client_buf_size_ = BufferPool::next_size(client_buf_.size(), n);
+  async_write(server_.socket(),
+              boost::asio::buffer(client_buf_.data(), n),
+              make_handler(&session::client_on_written));
 }
 
 void session::client_on_written(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "client on written");
+  client_buf_.reset();
+  if (check_error(ec, bytes_transferred, "client on written")) {
+    return;
+  }
   client_do_read();
 }
 
 void session::server_do_read() {
-  server_.socket().async_read_some(
-      boost::asio::buffer(server_buf_),
-      beast::bind_front_handler(&session::server_on_read, shared_from_this()));
+  server_.socket().async_receive(
+      boost::asio::buffer(&server_peek_, 1),
+      tcp::socket::message_peek,
+      make_handler(&session::server_on_ready));
 }
 
-void session::server_on_read(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "server on read");
+void session::server_on_ready(beast::error_code ec, std::size_t bytes_transferred) {
+  if (check_error(ec, bytes_transferred, "server on read")) {
+    return;
+  }
+  server_buf_.acquire(server_buf_size_);
+  size_t n = server_.socket().read_some(
+      boost::asio::buffer(server_buf_.data(), server_buf_.size()), ec);
+  if (ec == net::error::would_block) {
+    server_buf_.reset();
+    return server_do_read();
+  }
+  if (check_error(ec, n, "server on read")) {
+    return;
+  }
+  Metrics::add(Metrics::tunnel_bytes_downstream, n);
+  server_buf_size_ = BufferPool::next_size(server_buf_.size(), n);
   async_write(client_.socket(),
-              boost::asio::buffer(server_buf_, bytes_transferred),
-              beast::bind_front_handler(&session::server_on_written, shared_from_this()));
+              boost::asio::buffer(server_buf_.data(), n),
+              make_handler(&session::server_on_written));
 }
 
 void session::server_on_written(beast::error_code ec, std::size_t bytes_transferred) {
-  check_error(ec, bytes_transferred, "server on written");
+  server_buf_.reset();
+  if (check_error(ec, bytes_transferred, "server on written")) {
+    return;
+  }
   server_do_read();
 }
 
+void session::fail(beast::error_code ec, char const * what) {
+  boost::ignore_unused(what);
+  finish_leading(nullptr);
+  // a peer closing the connection, or our own close cancelling what was
+  // still pending, is how connections normally end
+  if (ec == beast::error::timeout) {
+    Metrics::add(Metrics::session_timeouts);
+  }
+  else if (ec != net::error::eof && ec != http::error::end_of_stream &&
+           ec != net::error::operation_aborted) {
+    Metrics::add(Metrics::session_errors);
+  }
+  do_close();
+}
+
 void session::do_close() {
   // Send a TCP shutdown
   beast::error_code ec;
@@ -270,25 +1241,27 @@ void session::do_close() {
   // At this point the connection is closed gracefully
 }
 
-void session::check_error(beast::error_code ec,
+bool session::check_error(beast::error_code ec,
                           std::size_t bytes_transferred,
                           char const * what) {
   boost::ignore_unused(bytes_transferred);
   if (ec) {
-    return fail(ec, what);
+    fail(ec, what);
+    return true;
   }
+  return false;
 }
 
 void session::send_bad_response(http::status status, std::string body) {
-  res_ = {status, req_.version()};
+  res_ = arena_message<response_type>();
+  res_.result(status);
+  res_.version(req_.version());
   res_.set(beast::http::field::server, "My Server");
   res_.set(beast::http::field::content_type, "text/plain");
   res_.body() = body;
-  res_.prepare_payload();
+  prepare_client_response();
+  start_phase();
   // log error message
   lw_.log_error(body);
-  http::async_write(
-      client_,
-      res_,
-      beast::bind_front_handler(&session::on_write_bad_client, shared_from_this()));
+  http::async_write(client_, res_, make_handler(&session::on_write_own_response));
 }
\ No newline at end of file
@@ -8,21 +8,36 @@
 #include <boost/beast/version.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/config.hpp>
+#include <boost/optional.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
+#include "arena.hpp"
+#include "buffer_pool.hpp"
 #include "cache.hpp"
 #include "cache_handler.hpp"
+#include "cache_refresh.hpp"
+#include "collapsed_forwarding.hpp"
+#include "compression.hpp"
+#include "connection_pool.hpp"
+#include "dns_cache.hpp"
+#include "handler_memory.hpp"
 #include "http_parser.hpp"
+#include "io_types.hpp"
+#include "latency.hpp"
 #include "log_writer.hpp"
+#include "metrics.hpp"
+#include "splice_relay.hpp"
 
 namespace beast = boost::beast;  // from <boost/beast.hpp>
 namespace http = beast::http;    // from <boost/beast/http.hpp>
@@ -30,78 +45,313 @@ namespace net = boost::asio;     // from <boost/asio.hpp>
 namespace ph = boost::asio::placeholders;
 using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
 
+typedef beast::basic_stream<tcp, strand_executor> strand_stream;
+
 class session : public std::enable_shared_from_this<session> {
-  beast::tcp_stream client_;
-  beast::tcp_stream server_;
+  typedef http::request<http::string_body, ArenaFields> request_type;
+  typedef http::response<http::string_body, ArenaFields> response_type;
+  typedef http::request<http::buffer_body, ArenaFields> upload_type;
+  typedef http::response<http::buffer_body, ArenaFields> relay_type;
+
+  // operations in flight live here, declared first so it outlives them
+  HandlerMemory handler_memory_;
+  strand_stream client_;
+  strand_stream server_;
   net::streambuf lead_in_;
-  std::array<uint8_t, 8192> client_buf_;
-  std::array<uint8_t, 8192> server_buf_;
-  http::request<http::string_body> req_;
-  http::response<http::string_body> res_;
+  beast::flat_buffer server_lead_in_;
+  // user-space tunnel relay: a buffer is held only from the moment a socket
+  // is readable until its bytes are written to the other side, the size
+  // follows how much each direction reads at a time
+  PooledBuffer client_buf_;
+  PooledBuffer server_buf_;
+  size_t client_buf_size_{4096};
+  size_t server_buf_size_{4096};
+  char client_peek_;
+  char server_peek_;
+  // the header fields of every message below, emptied when a request is
+  // finished. declared before them so it outlives them
+  Arena arena_;
+  // the client request is parsed header first, an upload body is then
+  // pulled through the parser piecewise
+  boost::optional<http::request_parser<http::buffer_body, ArenaAllocator<char> > >
+      req_parser_;
+  request_type req_;
+  response_type res_;
+  // POST/PUT bodies are relayed to the origin through these
+  upload_type upload_msg_;
+  boost::optional<http::request_serializer<http::buffer_body, ArenaFields> >
+      upload_serializer_;
+  // bounds the wait for the origin's answer to Expect: 100-continue
+  strand_timer continue_timer_;
+  bool continue_timed_out_{false};
+  // responses are relayed piecewise through these
+  boost::optional<http::response_parser<http::buffer_body, ArenaAllocator<char> > >
+      relay_parser_;
+  boost::optional<http::response_serializer<http::buffer_body, ArenaFields> >
+      relay_serializer_;
+  // shared by the upload and the response relay, which never overlap. taken
+  // from the pool when a body starts moving, returned when the request ends
+  PooledBuffer relay_buf_;
+  // cache entry being filled while a cacheable body streams past
+  std::shared_ptr<CachedResponse> tee_;
+  CachedResponsePtr cached_res_;
+  // a gzip entry going out inflated, a slice of relay_buf_ per write
+  std::unique_ptr<GzipInflater> inflater_;
+  std::string decoded_header_;
+  // the entry our conditional request to the origin revalidates
+  CachedResponsePtr revalidating_;
+  // the client's own conditions, req_ may carry ours instead
+  std::string client_if_none_match_;
+  std::string client_if_modified_since_;
+  // Range and If-Range are answered from the entry, the origin sees neither
+  // unless the body cannot be cached
+  std::string client_range_;
+  std::string client_if_range_;
+  // a miss for a range: the body goes into tee_ only, the range is then
+  // cut from the new entry
+  bool filling_{false};
+  bool range_refetched_{false};
+  // the header and part headers of a 206, the slices stay in the entry
+  std::string range_text_;
   LogWriter lw_;
   CacheHandler cache_handler;
   std::string host;
   std::string port;
+  // built once per GET, the capacity carries over to the next request
+  CacheKey cache_key_;
+  std::string client_addr_;
   HttpParser hp;
+  std::atomic<int> & request_ids_;
+  ConnectionPool & upstream_pool_;
+  DnsCache & dns_;
+  CollapsedForwarding & collapsing_;
+  // background refreshes log through it
+  LogPipeline & log_pipeline_;
+  // misses of cache_key_ arriving while we fetch it wait for our entry
+  bool leading_fetch_{false};
+  // waiting for the fetch another session leads, the generation tells the
+  // answer awaited now from a late one of an earlier wait
+  bool following_fetch_{false};
+  unsigned follow_generation_{0};
+  strand_timer follow_timer_;
+  // server_ came from the pool (and may turn out to be dead)
+  bool reused_upstream_{false};
+  // server_ has no request or response in flight and can be pooled
+  bool upstream_reusable_{false};
+  // requests answered on this client connection so far
+  int served_{0};
+  bool keep_alive_{false};
+  // when the phase of the request in progress began
+  Latency::clock::time_point phase_start_;
 
  public:
   // Take ownership of the stream
-  session(tcp::socket && socket,
+  session(strand_socket && socket,
           int id,
-          std::ofstream & logfile,
-          Cache<std::string, CachedResponse> & cache,
-          std::mutex & mutex) :
+          LogPipeline & log_pipeline,
+          Cache<CacheKey, CachedResponsePtr> & cache,
+          CompressionPool & compression,
+          std::atomic<int> & request_ids,
+          ConnectionPool & upstream_pool,
+          DnsCache & dns,
+          CollapsedForwarding & collapsing) :
       client_(std::move(socket)),
       server_(socket.get_executor()),
-      lw_(id, logfile, mutex),
-      cache_handler(cache, lw_) {}
+      req_(std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc())),
+      res_(std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc())),
+      upload_msg_(std::piecewise_construct,
+                  std::make_tuple(),
+                  std::make_tuple(fields_alloc())),
+      continue_timer_(socket.get_executor()),
+      lw_(id, log_pipeline),
+      cache_handler(cache, compression, lw_),
+      request_ids_(request_ids),
+      upstream_pool_(upstream_pool),
+      dns_(dns),
+      collapsing_(collapsing),
+      log_pipeline_(log_pipeline),
+      follow_timer_(socket.get_executor()) {
+    Metrics::add(Metrics::sessions_opened);
+    start_phase();
+  }
+
+  ~session();
 
   void run();
 
  private:
+  typedef void (session::*connect_handler)(beast::error_code,
+                                           tcp::resolver::results_type::endpoint_type);
+
+  // completion handler calling fn, its operation is kept in handler_memory_
+  template<class... Args>
+  MemberHandler<session, Args...> make_handler(void (session::*fn)(Args...)) {
+    return MemberHandler<session, Args...>(fn, shared_from_this(), handler_memory_);
+  }
+
+  ArenaAllocator<char> fields_alloc() { return ArenaAllocator<char>(arena_); }
+
+  // an empty message whose fields live in arena_
+  template<class Message>
+  Message arena_message() {
+    return Message(
+        std::piecewise_construct, std::make_tuple(), std::make_tuple(fields_alloc()));
+  }
+
+  void start_phase() { phase_start_ = Latency::clock::now(); }
+
+  // records the phase that began at phase_start_, the next one begins now
+  void end_phase(Latency::Phase phase);
+
+  void do_read_request();
+
+  // answered one request, read the next one or close the connection
+  void finish_request();
+
+  bool client_wants_keep_alive() const;
+
+  // the client still has request body bytes on the wire that we never read
+  bool request_body_pending() const;
+
+  void prepare_client_response();
+
   void on_connect_request(boost::system::error_code ec, std::size_t bytes_transferred);
 
-  void on_write_bad_client(beast::error_code ec, std::size_t bytes_transferred);
+  // res_, a response of our own, was written
+  void on_write_own_response(beast::error_code ec, std::size_t bytes_transferred);
+
+  // a pooled connection to host:port, or a new one, then on_connect
+  void open_upstream();
 
   void on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type);
 
+  // resolve host:port through the shared dns cache, then connect
+  void connect_upstream(connect_handler handler);
+
+  void on_resolve(connect_handler handler,
+                  beast::error_code ec,
+                  const Endpoints & endpoints);
+
+  void on_reconnect(beast::error_code ec, tcp::resolver::results_type::endpoint_type);
+
+  // a fresh connection to the origin is up
+  void upstream_connected();
+
+  // relay_buf_, from the pool unless this request holds it already
+  void hold_relay_buf();
+
+  // returns true if a failed pooled connection is being replaced
+  bool retry_upstream(beast::error_code ec);
+
+  // write req_ to server_, GET and POST continue in their own handlers
+  void send_upstream_request();
+
   void handle_connect_request();
 
   void handle_get_request();
 
+  // fetch cache_key_ from the origin, or wait for whoever fetches it already
+  void fetch_or_follow();
+
+  void on_leader_done(unsigned generation, CachedResponsePtr entry);
+
+  void on_follow_timeout(beast::error_code ec);
+
+  // hand what our fetch produced (null: nothing) to the sessions waiting
+  void finish_leading(CachedResponsePtr entry);
+
+  // the origin failed a GET: answer it from the cache if the entry is fresh
+  // or allows stale-if-error, returns false when it does not
+  bool serve_cached_on_error();
+
   void get_on_write_server(beast::error_code ec, std::size_t bytes_transferred);
 
   void get_on_read_server(beast::error_code ec, std::size_t bytes_transferred);
 
-  void get_on_write_client(beast::error_code ec, std::size_t bytes_transferred);
+  void relay_response_header();
+
+  void relay_read_body();
+
+  void get_on_relay_read(beast::error_code ec, std::size_t bytes_transferred);
+
+  void get_on_relay_write(beast::error_code ec, std::size_t bytes_transferred);
+
+  void get_on_write_client();
+
+  // the range miss's body is complete, cache it and answer from it
+  void finish_fill();
+
+  // the body will not be cached, ask the origin for the client's ranges
+  void refetch_range();
+
+  // ask the origin whether cached is still current, the request keeps its
+  // target and gets the entry's validators
+  void revalidate(const CachedResponsePtr & cached);
+
+  // 304 when the client already has cached, the entry otherwise
+  void respond_from_cache(CachedResponsePtr cached);
+
+  void send_not_modified(const CachedResponse & cached);
+
+  // the body the client accepts: the gzip copy when it takes gzip, the
+  // stored body inflated when that is gzip and it does not. ranges are cut
+  // from the stored body
+  void write_cached_response(CachedResponsePtr cached);
+
+  void write_inflated_response();
+
+  void write_ranges(const std::vector<ByteRange> & ranges);
+
+  void send_range_not_satisfiable(size_t size);
+
+  void on_write_partial(beast::error_code ec, std::size_t bytes_transferred);
+
+  void on_write_inflated(beast::error_code ec, std::size_t bytes_transferred);
+
+  void on_write_cached_client(beast::error_code ec, std::size_t bytes_transferred);
 
   void handle_post_request();
 
   void post_on_write_server(beast::error_code ec, std::size_t bytes_transferred);
 
-  void post_on_read_server(beast::error_code ec, std::size_t bytes_transferred);
+  void on_continue_timeout(beast::error_code ec);
+
+  void on_write_continue(beast::error_code ec, std::size_t bytes_transferred);
 
-  void post_on_write_client(beast::error_code ec, std::size_t bytes_transferred);
+  void upload_read_body();
+
+  void post_on_upload_read(beast::error_code ec, std::size_t bytes_transferred);
+
+  void post_on_upload_write(beast::error_code ec, std::size_t bytes_transferred);
+
+  void post_read_response();
+
+  void post_on_read_server(beast::error_code ec, std::size_t bytes_transferred);
 
   void on_connect_response(beast::error_code ec, std::size_t bytes_transferred);
 
+  // relay the tunnel in the kernel, false if the user-space relay must do it
+  bool start_splice_tunnel();
+
   void client_do_read();
 
-  void client_on_read(beast::error_code ec, std::size_t bytes_transferred);
+  void client_on_ready(beast::error_code ec, std::size_t bytes_transferred);
 
   void client_on_written(beast::error_code ec, std::size_t bytes_transferred);
 
   void server_do_read();
 
-  void server_on_read(beast::error_code ec, std::size_t bytes_transferred);
+  void server_on_ready(beast::error_code ec, std::size_t bytes_transferred);
 
   void server_on_written(beast::error_code ec, std::size_t bytes_transferred);
 
-  void fail(beast::error_code ec, char const * what) { do_close(); }
+  // counts why the connection ends, then closes it
+  void fail(beast::error_code ec, char const * what);
 
   void do_close();
 
-  void check_error(beast::error_code ec,
+  // returns true (after closing) when ec is set
+  bool check_error(beast::error_code ec,
                    std::size_t bytes_transferred,
                    char const * what);
 
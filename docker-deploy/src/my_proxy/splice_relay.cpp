@@ -0,0 +1,153 @@
+#include "splice_relay.hpp"
+
+// build with -DNO_SPLICE to keep tunnels on the user-space relay
+#if defined(__linux__) && !defined(NO_SPLICE)
+#define HAVE_SPLICE 1
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <boost/core/ignore_unused.hpp>
+
+#include <cerrno>
+
+// pipes are grown to this size when the kernel allows it, one splice moves
+// at most this much
+static const size_t wanted_pipe_size = 256 * 1024;
+
+SpliceRelay::SpliceRelay(strand_socket & from,
+                         strand_socket & to,
+                         Metrics::Counter relayed,
+                         DoneHandler done) :
+    from(from), to(to), pipe_size(64 * 1024), relayed(relayed), done(std::move(done)) {}
+
+SpliceRelay::~SpliceRelay() {
+#ifdef HAVE_SPLICE
+  if (pipe_read >= 0) {
+    ::close(pipe_read);
+    ::close(pipe_write);
+  }
+#endif
+}
+
+bool SpliceRelay::supported() {
+#ifdef HAVE_SPLICE
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::shared_ptr<SpliceRelay> SpliceRelay::create(strand_socket & from,
+                                                   strand_socket & to,
+                                                   Metrics::Counter relayed,
+                                                   DoneHandler done) {
+  std::shared_ptr<SpliceRelay> relay;
+#ifdef HAVE_SPLICE
+  int fds[2];
+  if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return relay;
+  }
+  relay.reset(new SpliceRelay(from, to, relayed, std::move(done)));
+  relay->pipe_read = fds[0];
+  relay->pipe_write = fds[1];
+  // a bigger pipe means fewer splices per megabyte, failing is harmless
+  int size = ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(wanted_pipe_size));
+  if (size > 0) {
+    relay->pipe_size = size;
+  }
+  // splice has to see EAGAIN instead of blocking the io thread
+  boost::system::error_code ec;
+  from.non_blocking(true, ec);
+  to.non_blocking(true, ec);
+  if (ec) {
+    relay.reset();
+  }
+#else
+  boost::ignore_unused(from, to, relayed, done);
+#endif
+  return relay;
+}
+
+void SpliceRelay::start() {
+  wait_readable();
+}
+
+void SpliceRelay::wait_readable() {
+  auto self = shared_from_this();
+  from.async_receive(net::buffer(&peek_byte, 1),
+                     tcp::socket::message_peek,
+                     [self](boost::system::error_code ec, std::size_t n) {
+                       self->on_readable(ec, n);
+                     });
+}
+
+void SpliceRelay::on_readable(boost::system::error_code ec,
+                              std::size_t bytes_transferred) {
+  boost::ignore_unused(bytes_transferred);
+  if (ec) {
+    return finish(ec);
+  }
+#ifdef HAVE_SPLICE
+  ssize_t n = ::splice(from.native_handle(),
+                       nullptr,
+                       pipe_write,
+                       nullptr,
+                       pipe_size - in_pipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n == 0) {
+    return finish(net::error::eof);
+  }
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return wait_readable();
+    }
+    return finish(boost::system::error_code(errno, boost::system::system_category()));
+  }
+  in_pipe += n;
+  drain();
+#endif
+}
+
+void SpliceRelay::drain() {
+#ifdef HAVE_SPLICE
+  while (in_pipe > 0) {
+    ssize_t n = ::splice(pipe_read,
+                         nullptr,
+                         to.native_handle(),
+                         nullptr,
+                         in_pipe,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        auto self = shared_from_this();
+        return to.async_wait(
+            tcp::socket::wait_write,
+            [self](boost::system::error_code ec) { self->on_writable(ec); });
+      }
+      return finish(boost::system::error_code(errno, boost::system::system_category()));
+    }
+    in_pipe -= n;
+    Metrics::add(relayed, n);
+  }
+#endif
+  // go back through the reactor, a busy tunnel must not starve the other
+  // sessions of this thread
+  wait_readable();
+}
+
+void SpliceRelay::on_writable(boost::system::error_code ec) {
+  if (ec) {
+    return finish(ec);
+  }
+  drain();
+}
+
+void SpliceRelay::finish(boost::system::error_code ec) {
+  // drop the handler (and what it keeps alive) once it has run
+  DoneHandler handler;
+  handler.swap(done);
+  if (handler) {
+    handler(ec);
+  }
+}
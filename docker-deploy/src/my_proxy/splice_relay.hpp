@@ -0,0 +1,69 @@
+#ifndef SPLICE_RELAY
+#define SPLICE_RELAY
+
+#include <boost/asio.hpp>
+
+#include "io_types.hpp"
+#include "metrics.hpp"
+
+#include <functional>
+#include <memory>
+
+namespace net = boost::asio;       // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * one direction of a CONNECT tunnel moved socket to socket with splice(2)
+ * through a pipe, so tunnel bytes never enter user space.
+ * the asio reactor only reports readiness: a one byte MSG_PEEK receive for
+ * the source (a plain async_wait can miss an edge of the edge-triggered
+ * reactor) and async_wait for the destination, the splices themselves are
+ * non-blocking.
+ * done is called once with the error that ended the direction, eof when the
+ * source closed. linux only (and not with -DNO_SPLICE), create() returns
+ * nullptr elsewhere or when no pipe can be had, and the caller keeps its
+ * user-space relay.
+ * the bytes handed to `to` are added to the `relayed` counter.
+*/
+class SpliceRelay : public std::enable_shared_from_this<SpliceRelay> {
+ public:
+  typedef std::function<void(boost::system::error_code)> DoneHandler;
+
+ private:
+  strand_socket & from;
+  strand_socket & to;
+  int pipe_read{-1};
+  int pipe_write{-1};
+  size_t pipe_size;
+  size_t in_pipe{0};  // bytes taken from `from` not yet given to `to`
+  char peek_byte;
+  Metrics::Counter relayed;
+  DoneHandler done;
+
+  SpliceRelay(strand_socket & from,
+              strand_socket & to,
+              Metrics::Counter relayed,
+              DoneHandler done);
+
+  void wait_readable();
+  void on_readable(boost::system::error_code ec, std::size_t bytes_transferred);
+  void drain();
+  void on_writable(boost::system::error_code ec);
+  void finish(boost::system::error_code ec);
+
+ public:
+  ~SpliceRelay();
+  SpliceRelay(const SpliceRelay &) = delete;
+  SpliceRelay & operator=(const SpliceRelay &) = delete;
+
+  static bool supported();
+
+  static std::shared_ptr<SpliceRelay> create(strand_socket & from,
+                                               strand_socket & to,
+                                               Metrics::Counter relayed,
+                                               DoneHandler done);
+
+  void start();
+};
+
+#endif  //SPLICE_RELAY